@@ -0,0 +1,222 @@
+// card_cache_util.h
+// Thread-safe cache of decoded and scaled card layers, keyed by the source
+// path and the size the layer was scaled for. Shared layers (a rarity frame,
+// an overlay icon) are decoded and scaled once and then reused by every card
+// and page that stacks them.
+//
+// Entries are reference counted while a card is being composited and are
+// evicted least-recently-used once the cache grows past its byte budget.
+// A layer that is being filled by one thread is waited on by the others,
+// so the same file is never decoded twice at the same time.
+//
+// Usage:
+//   #include "card_cache_util.h"
+//   CardCache cache;
+//   card_cache_init(&cache, 512u * 1024u * 1024u);
+//   const CardCacheEntry *e = card_cache_acquire(&cache, &key, fill, userdata);
+//   ... read e->surface ...
+//   card_cache_release(&cache, e);
+//   card_cache_destroy(&cache);
+
+#ifndef CARD_CACHE_UTIL_H
+#define CARD_CACHE_UTIL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+
+#ifndef CARD_CACHE_PATHLEN
+#define CARD_CACHE_PATHLEN 128
+#endif
+
+// What a layer was scaled for. ref_w/ref_h are zero for a base layer
+// (stretched to w x h) and the base layer's source size otherwise.
+typedef struct CardCacheKey {
+    char path[CARD_CACHE_PATHLEN];
+    int w, h;
+    int ref_w, ref_h;
+} CardCacheKey;
+
+typedef enum CardCacheState {
+    cardCacheLoading = 0,
+    cardCacheReady = 1,
+    cardCacheFailed = 2
+} CardCacheState;
+
+typedef struct CardCacheEntry {
+    CardCacheKey key;
+    CardCacheState state;
+    SDL_Surface *surface;   // NULL unless state is cardCacheReady
+    int src_w, src_h;       // Dimensions of the decoded source image
+    size_t bytes;
+    int refs;
+    uint64_t last_used;
+    struct CardCacheEntry *next;
+} CardCacheEntry;
+
+// Decode and scale the layer described by key. Must set *src_w and *src_h
+// on success. Returns NULL on failure. Called without the cache lock held.
+typedef SDL_Surface *(*card_cache_fill_fn)(const CardCacheKey *key, int *src_w, int *src_h, void *userdata);
+
+typedef struct CardCache {
+    SDL_mutex *lock;
+    SDL_cond *filled;
+    CardCacheEntry *entries;
+    size_t bytes;
+    size_t peak;            // Most bytes held at once
+    size_t budget;
+    uint64_t clock;
+    uint64_t hits;
+    uint64_t misses;
+} CardCache;
+
+// API: returns 0 on success; nonzero on failure.
+int card_cache_init(CardCache *cache, size_t budget_bytes);
+void card_cache_destroy(CardCache *cache);
+
+// Returns a referenced entry (ready or failed) or NULL if out of memory.
+// A failed entry is remembered so a missing file is only tried once.
+const CardCacheEntry *card_cache_acquire(CardCache *cache, const CardCacheKey *key, card_cache_fill_fn fill, void *userdata);
+// The same without counting a hit or a miss, for a layer someone already
+// acquired and holds for this caller.
+const CardCacheEntry *card_cache_acquire_uncounted(CardCache *cache, const CardCacheKey *key, card_cache_fill_fn fill, void *userdata);
+void card_cache_release(CardCache *cache, const CardCacheEntry *entry);
+// Bytes of pixels held by the cache right now, and the most it has held.
+size_t card_cache_bytes(CardCache *cache);
+size_t card_cache_peak_bytes(CardCache *cache);
+
+// ===== Implementation (header-only) =====
+
+static int _cc_key_equal(const CardCacheKey *a, const CardCacheKey *b) {
+    return a->w == b->w && a->h == b->h && a->ref_w == b->ref_w && a->ref_h == b->ref_h
+        && strncmp(a->path, b->path, CARD_CACHE_PATHLEN) == 0;
+}
+
+// Drop unreferenced ready entries, oldest first, until we fit the budget.
+// Caller holds the lock.
+static void _cc_evict(CardCache *cache) {
+    while (cache->bytes > cache->budget) {
+        CardCacheEntry **victim = NULL;
+        for (CardCacheEntry **pp = &cache->entries; *pp; pp = &(*pp)->next) {
+            CardCacheEntry *e = *pp;
+            if (e->refs > 0 || e->state != cardCacheReady) continue;
+            if (!victim || e->last_used < (*victim)->last_used) victim = pp;
+        }
+        if (!victim) return; // Everything left is in use.
+
+        CardCacheEntry *e = *victim;
+        *victim = e->next;
+        cache->bytes -= e->bytes;
+        SDL_FreeSurface(e->surface);
+        free(e);
+    }
+}
+
+int card_cache_init(CardCache *cache, size_t budget_bytes) {
+    memset(cache, 0, sizeof(*cache));
+    cache->budget = budget_bytes;
+    cache->lock = SDL_CreateMutex();
+    cache->filled = SDL_CreateCond();
+    if (!cache->lock || !cache->filled) {
+        card_cache_destroy(cache);
+        return 1;
+    }
+    return 0;
+}
+
+void card_cache_destroy(CardCache *cache) {
+    CardCacheEntry *e = cache->entries;
+    while (e) {
+        CardCacheEntry *next = e->next;
+        SDL_FreeSurface(e->surface);
+        free(e);
+        e = next;
+    }
+    if (cache->filled) SDL_DestroyCond(cache->filled);
+    if (cache->lock) SDL_DestroyMutex(cache->lock);
+    memset(cache, 0, sizeof(*cache));
+}
+
+static const CardCacheEntry *_cc_acquire(CardCache *cache, const CardCacheKey *key, card_cache_fill_fn fill, void *userdata, int counted) {
+    SDL_LockMutex(cache->lock);
+
+    CardCacheEntry *e = cache->entries;
+    while (e && !_cc_key_equal(&e->key, key)) e = e->next;
+
+    if (e) {
+        while (e->state == cardCacheLoading) SDL_CondWait(cache->filled, cache->lock);
+        e->refs++;
+        e->last_used = ++cache->clock;
+        if (counted) cache->hits++;
+        SDL_UnlockMutex(cache->lock);
+        return e;
+    }
+
+    e = (CardCacheEntry *)calloc(1, sizeof(*e));
+    if (!e) {
+        SDL_UnlockMutex(cache->lock);
+        return NULL;
+    }
+    e->key = *key;
+    e->state = cardCacheLoading;
+    e->refs = 1;
+    e->next = cache->entries;
+    cache->entries = e;
+    if (counted) cache->misses++;
+    SDL_UnlockMutex(cache->lock);
+
+    int src_w = 0, src_h = 0;
+    SDL_Surface *surface = fill(key, &src_w, &src_h, userdata);
+
+    SDL_LockMutex(cache->lock);
+    if (surface) {
+        e->surface = surface;
+        e->src_w = src_w;
+        e->src_h = src_h;
+        e->bytes = (size_t)surface->pitch * (size_t)surface->h;
+        e->state = cardCacheReady;
+        cache->bytes += e->bytes;
+        if (cache->bytes > cache->peak) cache->peak = cache->bytes;
+    }
+    else {
+        e->state = cardCacheFailed;
+    }
+    e->last_used = ++cache->clock;
+    _cc_evict(cache);
+    SDL_CondBroadcast(cache->filled);
+    SDL_UnlockMutex(cache->lock);
+    return e;
+}
+
+const CardCacheEntry *card_cache_acquire(CardCache *cache, const CardCacheKey *key, card_cache_fill_fn fill, void *userdata) {
+    return _cc_acquire(cache, key, fill, userdata, 1);
+}
+
+const CardCacheEntry *card_cache_acquire_uncounted(CardCache *cache, const CardCacheKey *key, card_cache_fill_fn fill, void *userdata) {
+    return _cc_acquire(cache, key, fill, userdata, 0);
+}
+
+void card_cache_release(CardCache *cache, const CardCacheEntry *entry) {
+    if (!entry) return;
+    SDL_LockMutex(cache->lock);
+    ((CardCacheEntry *)entry)->refs--;
+    _cc_evict(cache);
+    SDL_UnlockMutex(cache->lock);
+}
+
+size_t card_cache_bytes(CardCache *cache) {
+    SDL_LockMutex(cache->lock);
+    size_t bytes = cache->bytes;
+    SDL_UnlockMutex(cache->lock);
+    return bytes;
+}
+
+size_t card_cache_peak_bytes(CardCache *cache) {
+    SDL_LockMutex(cache->lock);
+    size_t peak = cache->peak;
+    SDL_UnlockMutex(cache->lock);
+    return peak;
+}
+
+#endif // CARD_CACHE_UTIL_H
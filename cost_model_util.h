@@ -0,0 +1,250 @@
+// cost_model_util.h
+// Predicts a job's wall time, CPU time, peak memory and output size before
+// it runs, from a linear model calibrated by earlier runs on the same host.
+//
+// A job is described by how much work of each kind it does, counted from the
+// config and the card files' headers: source pixels decoded and scaled, layer
+// pixels composited and page pixels encoded. Each kind has a cost in ns per
+// pixel, output formats have a size in bytes per page pixel, and memory is a
+// base plus the page, the layer cache and the decodes in flight.
+//
+// Work is spread over the threads the way the renderer does it: cards load
+// on up to one thread per slot while the page before is composited, also on
+// up to one thread per slot, and encoded (PNG on one thread, JPEG on all), so
+//
+//   wall = overhead + max(load, compose + encode) + min(load, compose + encode) / pages
+//
+// the last term being the first page's loads and the last page's encode,
+// which nothing overlaps.
+//
+// A measured run is folded into the model per coefficient: the first
+// measurement replaces the default, later ones are averaged in with a weight
+// of at least 1/5, so the model follows a host that changes.
+//
+// Usage:
+//   #include "cost_model_util.h"
+//   CostModel model;
+//   cost_model_load(&model, "host.model");   // defaults if it isn't there
+//   CostJob job = { ... };
+//   CostEstimate e;
+//   cost_estimate(&model, &job, threads, &e);
+//   ... run, measuring ...
+//   cost_model_update(&model, &job, threads, &measured);
+//   cost_model_save(&model, "host.model");
+
+#ifndef COST_MODEL_UTIL_H
+#define COST_MODEL_UTIL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef enum CostTerm {
+    costDecode = 0,      // Per source pixel
+    costScale,           // Per source pixel
+    costCompose,         // Per layer pixel on the page
+    costEncodePNG,       // Per page pixel
+    costEncodeJPEG,      // Per page pixel
+    costTermCount
+} CostTerm;
+
+typedef enum CostOutput {
+    costOutputPNG = 0,
+    costOutputJPEG,
+    costOutputCount
+} CostOutput;
+
+typedef struct CostModel {
+    double ns_per_px[costTermCount];
+    double bytes_per_px[costOutputCount];
+    double base_mb;          // Resident memory not modelled below
+    double overhead_s;       // Start-up, config and copies of identical pages
+    int samples[costTermCount];
+    int size_samples[costOutputCount];
+    int runs;                // Measured runs folded in
+} CostModel;
+
+// The work of one job.
+typedef struct CostJob {
+    double px[costTermCount];
+    double output_px[costOutputCount];   // Page pixels written, copies included
+    int pages_rendered;
+    int max_parallel;        // Most loads or composites at once per page
+    double page_bytes;       // The page surface
+    double cache_bytes;      // Decoded layers kept, up to the cache limit
+    double load_bytes;       // Largest single decode in flight
+    double prefetch_bytes;   // Card files read ahead
+} CostJob;
+
+typedef struct CostEstimate {
+    double wall_s;
+    double cpu_s;
+    double rss_mb;
+    double output_bytes;
+} CostEstimate;
+
+// What a run actually took, for cost_model_update.
+typedef struct CostMeasured {
+    double ns[costTermCount];          // Thread time per term
+    double output_bytes[costOutputCount];
+    double wall_s;
+    double rss_mb;                     // 0 if unknown
+} CostMeasured;
+
+// API: returns 0 on success; nonzero on failure.
+void cost_model_defaults(CostModel *model);
+// Loads the model at path, or leaves the defaults if it can't be read.
+int cost_model_load(CostModel *model, const char *path);
+int cost_model_save(const CostModel *model, const char *path);
+void cost_estimate(const CostModel *model, const CostJob *job, int threads, CostEstimate *estimate);
+void cost_model_update(CostModel *model, const CostJob *job, int threads, const CostMeasured *measured);
+// Peak resident memory of this process in MB, 0 where it can't be read.
+double cost_peak_rss_mb(void);
+
+// ===== Implementation (header-only) =====
+
+static const char *_cost_term_names[costTermCount] = {
+    "decode_ns_per_px", "scale_ns_per_px", "compose_ns_per_px", "png_encode_ns_per_px", "jpeg_encode_ns_per_px"
+};
+static const char *_cost_output_names[costOutputCount] = { "png_bytes_per_px", "jpeg_bytes_per_px" };
+
+void cost_model_defaults(CostModel *model) {
+    // Rough figures for one core of a recent desktop; calibrate to replace them.
+    static const double ns[costTermCount] = { 12.0, 4.0, 6.0, 20.0, 10.0 };
+    memset(model, 0, sizeof(*model));
+    memcpy(model->ns_per_px, ns, sizeof(ns));
+    model->bytes_per_px[costOutputPNG] = 0.2;
+    model->bytes_per_px[costOutputJPEG] = 0.05;
+    model->base_mb = 30.0;
+    model->overhead_s = 0.05;
+}
+
+int cost_model_load(CostModel *model, const char *path) {
+    cost_model_defaults(model);
+    FILE *f = fopen(path, "r");
+    if (!f) return 1;
+    char line[256], name[64];
+    double value;
+    int samples;
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#' || sscanf(line, "%63s %lf %d", name, &value, &samples) != 3) continue;
+        for (int t = 0; t < costTermCount; t++) {
+            if (strcmp(name, _cost_term_names[t]) == 0) {
+                model->ns_per_px[t] = value;
+                model->samples[t] = samples;
+            }
+        }
+        for (int o = 0; o < costOutputCount; o++) {
+            if (strcmp(name, _cost_output_names[o]) == 0) {
+                model->bytes_per_px[o] = value;
+                model->size_samples[o] = samples;
+            }
+        }
+        if (strcmp(name, "base_mb") == 0) model->base_mb = value;
+        if (strcmp(name, "overhead_s") == 0) {
+            model->overhead_s = value;
+            model->runs = samples;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+int cost_model_save(const CostModel *model, const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) return 1;
+    fprintf(f, "# cardprint cost model: name, value, measurements folded in\n");
+    for (int t = 0; t < costTermCount; t++) fprintf(f, "%s %.6g %d\n", _cost_term_names[t], model->ns_per_px[t], model->samples[t]);
+    for (int o = 0; o < costOutputCount; o++) fprintf(f, "%s %.6g %d\n", _cost_output_names[o], model->bytes_per_px[o], model->size_samples[o]);
+    fprintf(f, "base_mb %.6g %d\n", model->base_mb, model->runs);
+    fprintf(f, "overhead_s %.6g %d\n", model->overhead_s, model->runs);
+    return fclose(f) != 0;
+}
+
+static int _cost_parallel(const CostJob *job, int threads) {
+    int parallel = threads < job->max_parallel ? threads : job->max_parallel;
+    return parallel < 1 ? 1 : parallel;
+}
+
+// Seconds of load, compose and encode, each spread over its threads.
+static void _cost_phases(const CostModel *model, const CostJob *job, int threads, double *load, double *compose, double *encode) {
+    double parallel = _cost_parallel(job, threads);
+    *load = (job->px[costDecode] * model->ns_per_px[costDecode] + job->px[costScale] * model->ns_per_px[costScale]) / parallel * 1e-9;
+    *compose = job->px[costCompose] * model->ns_per_px[costCompose] / parallel * 1e-9;
+    *encode = (job->px[costEncodePNG] * model->ns_per_px[costEncodePNG] +
+        job->px[costEncodeJPEG] * model->ns_per_px[costEncodeJPEG] / (threads < 1 ? 1 : threads)) * 1e-9;
+}
+
+static double _cost_pipelined(const CostJob *job, double load, double compose, double encode) {
+    double pages = job->pages_rendered > 0 ? job->pages_rendered : 1;
+    double output = compose + encode;
+    return (load > output ? load : output) + (load < output ? load : output) / pages;
+}
+
+static double _cost_variable_mb(const CostJob *job, int threads) {
+    return (job->page_bytes + job->cache_bytes + job->load_bytes * _cost_parallel(job, threads) + job->prefetch_bytes) / (1024.0 * 1024.0);
+}
+
+void cost_estimate(const CostModel *model, const CostJob *job, int threads, CostEstimate *estimate) {
+    double load, compose, encode;
+    _cost_phases(model, job, threads, &load, &compose, &encode);
+    estimate->wall_s = model->overhead_s + _cost_pipelined(job, load, compose, encode);
+
+    estimate->cpu_s = model->overhead_s;
+    for (int t = 0; t < costTermCount; t++) estimate->cpu_s += job->px[t] * model->ns_per_px[t] * 1e-9;
+
+    estimate->rss_mb = model->base_mb + _cost_variable_mb(job, threads);
+    estimate->output_bytes = 0;
+    for (int o = 0; o < costOutputCount; o++) estimate->output_bytes += job->output_px[o] * model->bytes_per_px[o];
+}
+
+static void _cost_fold(double *value, int *samples, double measured) {
+    double weight = 1.0 / (*samples + 1);
+    if (weight < 0.2) weight = 0.2;
+    *value += (measured - *value) * weight;
+    (*samples)++;
+}
+
+void cost_model_update(CostModel *model, const CostJob *job, int threads, const CostMeasured *measured) {
+    // Terms too small to time reliably are left alone.
+    for (int t = 0; t < costTermCount; t++) {
+        if (job->px[t] >= 1e5 && measured->ns[t] > 0) _cost_fold(&model->ns_per_px[t], &model->samples[t], measured->ns[t] / job->px[t]);
+    }
+    for (int o = 0; o < costOutputCount; o++) {
+        if (job->output_px[o] > 0 && measured->output_bytes[o] > 0) {
+            _cost_fold(&model->bytes_per_px[o], &model->size_samples[o], measured->output_bytes[o] / job->output_px[o]);
+        }
+    }
+
+    // Whatever the terms don't explain is overhead, and the same for memory.
+    double load, compose, encode;
+    _cost_phases(model, job, threads, &load, &compose, &encode);
+    double overhead = measured->wall_s - _cost_pipelined(job, load, compose, encode);
+    double base = measured->rss_mb - _cost_variable_mb(job, threads);
+    int runs = model->runs;
+    _cost_fold(&model->overhead_s, &runs, overhead > 0 ? overhead : 0);
+    if (measured->rss_mb > 0) {
+        runs = model->runs;
+        _cost_fold(&model->base_mb, &runs, base > 0 ? base : 0);
+    }
+    model->runs = runs;
+}
+
+double cost_peak_rss_mb(void) {
+#if defined(__linux__)
+    FILE *f = fopen("/proc/self/status", "r");
+    if (!f) return 0;
+    char line[128];
+    long kb = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "VmHWM: %ld kB", &kb) == 1) break;
+    }
+    fclose(f);
+    return kb / 1024.0;
+#else
+    return 0;
+#endif
+}
+
+#endif // COST_MODEL_UTIL_H
@@ -0,0 +1,219 @@
+// halftone_util.h
+// Halftones pages to 1-bit or 2-bit gray for monochrome printers.
+//
+// A page is converted to luma (Rec. 601) and quantized to 2 or 4 levels, in
+// bands of rows spread over threads like jpeg_util.h's bands. Rows come out
+// packed as PNG and PWG raster want them: the leftmost pixel in the high bits
+// of a byte, 0 black.
+//
+// Ordered dithering compares each pixel with an 8x8 Bayer matrix. The result
+// for every gray level, matrix row and column is worked out once at init, and
+// so is a whole group of 8 pixels of one gray: 1 byte at 1 bit, 2 at 2 bits.
+// Margins, gutters and card backgrounds are runs of one color, so most of a
+// page is copied from those patterns 8 pixels at a time and only card art is
+// looked up pixel by pixel. Ordered dithering is the same whatever the bands.
+//
+// Error diffusion (Floyd-Steinberg, serpentine) gives finer detail and no
+// visible pattern, but each band starts without the error of the band above,
+// so a seam can show in smooth gradients every HALFTONE_BAND_ROWS rows.
+//
+// Usage:
+//   #include "halftone_util.h"
+//   Halftone ht;
+//   halftone_init(&ht, width, height, 1, halftoneOrdered, threads);
+//   halftone_page(&ht, pixels, pitch);   // every page; rows in ht.data, ht.stride apart
+//   halftone_destroy(&ht);
+
+#ifndef HALFTONE_UTIL_H
+#define HALFTONE_UTIL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+
+// Rows per band handed to a thread.
+#define HALFTONE_BAND_ROWS 64
+#define HALFTONE_MAX_THREADS 64
+
+typedef enum HalftoneMethod {
+    halftoneOrdered = 0,
+    halftoneDiffusion
+} HalftoneMethod;
+
+typedef struct Halftone {
+    int width, height, bits, threads;
+    HalftoneMethod method;
+    int stride;                   // Packed bytes per row
+    uint8_t *data;                // Packed rows of the last page
+    int band_count;
+    const uint8_t *pixels;        // Page being halftoned, XRGB8888
+    int pitch;
+    SDL_atomic_t next_band;
+    uint8_t levels[8][8][256];    // Ordered: output level by matrix row, column and gray
+    uint16_t groups[8][256];      // Ordered: 8 pixels of one gray, packed, by matrix row
+} Halftone;
+
+// API: returns 0 on success; nonzero on failure.
+int halftone_init(Halftone *ht, int width, int height, int bits, HalftoneMethod method, int threads);
+void halftone_destroy(Halftone *ht);
+int halftone_page(Halftone *ht, const void *pixels, int pitch);
+
+// ===== Implementation (header-only) =====
+
+static const uint8_t _ht_bayer[8][8] = {
+    {  0, 32,  8, 40,  2, 34, 10, 42 },
+    { 48, 16, 56, 24, 50, 18, 58, 26 },
+    { 12, 44,  4, 36, 14, 46,  6, 38 },
+    { 60, 28, 52, 20, 62, 30, 54, 22 },
+    {  3, 35, 11, 43,  1, 33,  9, 41 },
+    { 51, 19, 59, 27, 49, 17, 57, 25 },
+    { 15, 47,  7, 39, 13, 45,  5, 37 },
+    { 63, 31, 55, 23, 61, 29, 53, 21 }
+};
+
+static int _ht_gray(uint32_t p) {
+    return (int)((((p >> 16) & 0xFF) * 77 + ((p >> 8) & 0xFF) * 150 + (p & 0xFF) * 29) >> 8);
+}
+
+static void _ht_put(uint8_t *row, int bits, int x, int level) {
+    if (bits == 1) row[x >> 3] |= (uint8_t)(level << (7 - (x & 7)));
+    else row[x >> 2] |= (uint8_t)(level << (2 * (3 - (x & 3))));
+}
+
+static void _ht_ordered_row(const Halftone *ht, const uint32_t *src, uint8_t *out, int y) {
+    int my = y & 7;
+    int x = 0;
+    for (; x + 8 <= ht->width; x += 8) {
+        const uint32_t *p = src + x;
+        uint32_t first = p[0] & 0xFFFFFF;
+        int uniform = 1;
+        for (int i = 1; i < 8 && uniform; i++) uniform = (p[i] & 0xFFFFFF) == first;
+        if (uniform) {
+            uint16_t group = ht->groups[my][_ht_gray(first)];
+            if (ht->bits == 1) out[x >> 3] = (uint8_t)group;
+            else {
+                out[x >> 2] = (uint8_t)(group >> 8);
+                out[(x >> 2) + 1] = (uint8_t)group;
+            }
+            continue;
+        }
+        for (int i = 0; i < 8; i++) _ht_put(out, ht->bits, x + i, ht->levels[my][i][_ht_gray(p[i])]);
+    }
+    for (; x < ht->width; x++) _ht_put(out, ht->bits, x, ht->levels[my][x & 7][_ht_gray(src[x])]);
+}
+
+// Errors are kept in 16ths of a gray step, in two rows with a pixel of
+// padding at each end.
+static void _ht_diffuse_band(const Halftone *ht, int first, int last, int *errors) {
+    int max = (1 << ht->bits) - 1;
+    int *cur = errors + 1, *next = errors + ht->width + 3;
+    memset(errors, 0, sizeof(int) * (size_t)(ht->width + 2) * 2);
+    for (int y = first; y < last; y++) {
+        const uint32_t *src = (const uint32_t *)(ht->pixels + (size_t)y * ht->pitch);
+        uint8_t *out = ht->data + (size_t)y * ht->stride;
+        int dir = (y - first) & 1 ? -1 : 1;
+        int x = dir > 0 ? 0 : ht->width - 1;
+        for (int i = 0; i < ht->width; i++, x += dir) {
+            int value = _ht_gray(src[x]) * 16 + cur[x];
+            int level = (value * max + 255 * 8) / (255 * 16);
+            if (level < 0) level = 0;
+            if (level > max) level = max;
+            int error = value - level * 255 * 16 / max;
+            _ht_put(out, ht->bits, x, level);
+            cur[x + dir] += error * 7 / 16;
+            next[x - dir] += error * 3 / 16;
+            next[x] += error * 5 / 16;
+            next[x + dir] += error / 16;
+        }
+        int *t = cur; cur = next; next = t;
+        memset(next - 1, 0, sizeof(int) * (size_t)(ht->width + 2));
+    }
+}
+
+static int _ht_worker(void *data) {
+    Halftone *ht = (Halftone *)data;
+    int *errors = NULL;
+    if (ht->method == halftoneDiffusion) {
+        errors = (int *)malloc(sizeof(int) * (size_t)(ht->width + 2) * 2);
+        if (!errors) return 1;
+    }
+    for (;;) {
+        int band = SDL_AtomicAdd(&ht->next_band, 1);
+        if (band >= ht->band_count) break;
+        int first = band * HALFTONE_BAND_ROWS;
+        int last = SDL_min(first + HALFTONE_BAND_ROWS, ht->height);
+        memset(ht->data + (size_t)first * ht->stride, 0, (size_t)(last - first) * ht->stride);
+        if (ht->method == halftoneDiffusion) {
+            _ht_diffuse_band(ht, first, last, errors);
+            continue;
+        }
+        for (int y = first; y < last; y++) {
+            _ht_ordered_row(ht, (const uint32_t *)(ht->pixels + (size_t)y * ht->pitch), ht->data + (size_t)y * ht->stride, y);
+        }
+    }
+    free(errors);
+    return 0;
+}
+
+int halftone_init(Halftone *ht, int width, int height, int bits, HalftoneMethod method, int threads) {
+    memset(ht, 0, sizeof(*ht));
+    if (width <= 0 || height <= 0 || (bits != 1 && bits != 2)) return 1;
+    ht->width = width;
+    ht->height = height;
+    ht->bits = bits;
+    ht->method = method;
+    ht->threads = SDL_max(1, SDL_min(threads, HALFTONE_MAX_THREADS));
+    ht->stride = (width * bits + 7) / 8;
+    ht->band_count = (height + HALFTONE_BAND_ROWS - 1) / HALFTONE_BAND_ROWS;
+    ht->data = (uint8_t *)malloc((size_t)ht->stride * (size_t)height);
+    if (!ht->data) return 2;
+
+    // A level goes up by one where the gray's remainder above the level
+    // below passes the matrix threshold.
+    int max = (1 << bits) - 1;
+    for (int my = 0; my < 8; my++) {
+        for (int mx = 0; mx < 8; mx++) {
+            for (int gray = 0; gray < 256; gray++) {
+                int v = gray * max;
+                int level = v / 255;
+                if ((v % 255) * 128 >= (2 * _ht_bayer[my][mx] + 1) * 255) level++;
+                ht->levels[my][mx][gray] = (uint8_t)level;
+            }
+        }
+        for (int gray = 0; gray < 256; gray++) {
+            uint16_t group = 0;
+            for (int mx = 0; mx < 8; mx++) group = (uint16_t)((group << bits) | ht->levels[my][mx][gray]);
+            ht->groups[my][gray] = group;
+        }
+    }
+    return 0;
+}
+
+void halftone_destroy(Halftone *ht) {
+    free(ht->data);
+    memset(ht, 0, sizeof(*ht));
+}
+
+int halftone_page(Halftone *ht, const void *pixels, int pitch) {
+    ht->pixels = (const uint8_t *)pixels;
+    ht->pitch = pitch;
+    SDL_AtomicSet(&ht->next_band, 0);
+
+    SDL_Thread *threads[HALFTONE_MAX_THREADS];
+    int spawned = 0;
+    for (int i = 1; i < ht->threads && i < ht->band_count; i++) {
+        threads[spawned] = SDL_CreateThread(_ht_worker, "halftone", ht);
+        if (!threads[spawned]) break;
+        spawned++;
+    }
+    int result = _ht_worker(ht);
+    for (int i = 0; i < spawned; i++) {
+        int status;
+        SDL_WaitThread(threads[i], &status);
+        if (status != 0) result = status;
+    }
+    return result;
+}
+
+#endif // HALFTONE_UTIL_H
@@ -0,0 +1,264 @@
+// hash_util.h
+// Streaming XXH64 and SHA-256, for hashing output while it is written.
+//
+// XXH64 is the 64-bit xxHash: several GB/s, fine for catching truncated or
+// corrupted transfers, not for tamper evidence. SHA-256 is there for the
+// tools that want a cryptographic hash; it's about ten times slower.
+//
+// Usage:
+//   #include "hash_util.h"
+//   OutputHash h;
+//   output_hash_init(&h, 1);           // 1 = SHA-256 as well
+//   output_hash_update(&h, data, size); // as the bytes go out
+//   char xxh[17], sha[65];
+//   output_hash_final(&h, xxh, sha);
+
+#ifndef HASH_UTIL_H
+#define HASH_UTIL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef struct Xxh64State {
+    uint64_t v[4];
+    uint64_t total;
+    uint8_t buf[32];
+    size_t buf_len;
+} Xxh64State;
+
+typedef struct Sha256State {
+    uint32_t h[8];
+    uint64_t total;
+    uint8_t buf[64];
+    size_t buf_len;
+} Sha256State;
+
+typedef struct OutputHash {
+    Xxh64State xxh;
+    Sha256State sha;
+    int use_sha256;
+    uint64_t bytes;
+} OutputHash;
+
+void xxh64_init(Xxh64State *s, uint64_t seed);
+void xxh64_update(Xxh64State *s, const void *data, size_t size);
+uint64_t xxh64_digest(const Xxh64State *s);
+void sha256_init(Sha256State *s);
+void sha256_update(Sha256State *s, const void *data, size_t size);
+void sha256_final(Sha256State *s, uint8_t digest[32]);
+
+void output_hash_init(OutputHash *h, int use_sha256);
+void output_hash_update(OutputHash *h, const void *data, size_t size);
+// Hex digests; sha256_hex is left empty unless SHA-256 was asked for.
+void output_hash_final(OutputHash *h, char xxh64_hex[17], char sha256_hex[65]);
+
+// ===== Implementation (header-only) =====
+
+#define _XXH_P1 0x9E3779B185EBCA87ull
+#define _XXH_P2 0xC2B2AE3D27D4EB4Full
+#define _XXH_P3 0x165667B19E3779F9ull
+#define _XXH_P4 0x85EBCA77C2B2AE63ull
+#define _XXH_P5 0x27D4EB2F165667C5ull
+
+static uint64_t _xxh_rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static uint64_t _xxh_read64(const uint8_t *p) {
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+        (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static uint32_t _xxh_read32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t _xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * _XXH_P2;
+    acc = _xxh_rotl(acc, 31);
+    return acc * _XXH_P1;
+}
+
+static uint64_t _xxh_merge(uint64_t acc, uint64_t val) {
+    acc ^= _xxh_round(0, val);
+    return acc * _XXH_P1 + _XXH_P4;
+}
+
+void xxh64_init(Xxh64State *s, uint64_t seed) {
+    memset(s, 0, sizeof(*s));
+    s->v[0] = seed + _XXH_P1 + _XXH_P2;
+    s->v[1] = seed + _XXH_P2;
+    s->v[2] = seed;
+    s->v[3] = seed - _XXH_P1;
+}
+
+void xxh64_update(Xxh64State *s, const void *data, size_t size) {
+    const uint8_t *p = (const uint8_t *)data;
+    s->total += size;
+
+    if (s->buf_len + size < 32) {
+        memcpy(s->buf + s->buf_len, p, size);
+        s->buf_len += size;
+        return;
+    }
+    if (s->buf_len) {
+        size_t fill = 32 - s->buf_len;
+        memcpy(s->buf + s->buf_len, p, fill);
+        for (int i = 0; i < 4; i++) s->v[i] = _xxh_round(s->v[i], _xxh_read64(s->buf + 8 * i));
+        p += fill;
+        size -= fill;
+        s->buf_len = 0;
+    }
+    while (size >= 32) {
+        for (int i = 0; i < 4; i++) s->v[i] = _xxh_round(s->v[i], _xxh_read64(p + 8 * i));
+        p += 32;
+        size -= 32;
+    }
+    memcpy(s->buf, p, size);
+    s->buf_len = size;
+}
+
+uint64_t xxh64_digest(const Xxh64State *s) {
+    uint64_t h;
+    if (s->total >= 32) {
+        h = _xxh_rotl(s->v[0], 1) + _xxh_rotl(s->v[1], 7) + _xxh_rotl(s->v[2], 12) + _xxh_rotl(s->v[3], 18);
+        for (int i = 0; i < 4; i++) h = _xxh_merge(h, s->v[i]);
+    }
+    else {
+        h = s->v[2] + _XXH_P5;   // v[2] is the seed
+    }
+    h += s->total;
+
+    const uint8_t *p = s->buf;
+    size_t left = s->buf_len;
+    while (left >= 8) {
+        h ^= _xxh_round(0, _xxh_read64(p));
+        h = _xxh_rotl(h, 27) * _XXH_P1 + _XXH_P4;
+        p += 8;
+        left -= 8;
+    }
+    if (left >= 4) {
+        h ^= (uint64_t)_xxh_read32(p) * _XXH_P1;
+        h = _xxh_rotl(h, 23) * _XXH_P2 + _XXH_P3;
+        p += 4;
+        left -= 4;
+    }
+    while (left > 0) {
+        h ^= (*p) * _XXH_P5;
+        h = _xxh_rotl(h, 11) * _XXH_P1;
+        p++;
+        left--;
+    }
+
+    h ^= h >> 33;
+    h *= _XXH_P2;
+    h ^= h >> 29;
+    h *= _XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+static const uint32_t _sha_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define _SHA_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void _sha256_block(Sha256State *s, const uint8_t *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[4*i] << 24 | (uint32_t)p[4*i + 1] << 16 | (uint32_t)p[4*i + 2] << 8 | p[4*i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = _SHA_ROTR(w[i-15], 7) ^ _SHA_ROTR(w[i-15], 18) ^ (w[i-15] >> 3);
+        uint32_t s1 = _SHA_ROTR(w[i-2], 17) ^ _SHA_ROTR(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+
+    uint32_t a = s->h[0], b = s->h[1], c = s->h[2], d = s->h[3];
+    uint32_t e = s->h[4], f = s->h[5], g = s->h[6], h = s->h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (_SHA_ROTR(e, 6) ^ _SHA_ROTR(e, 11) ^ _SHA_ROTR(e, 25)) + ((e & f) ^ (~e & g)) + _sha_k[i] + w[i];
+        uint32_t t2 = (_SHA_ROTR(a, 2) ^ _SHA_ROTR(a, 13) ^ _SHA_ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d;
+    s->h[4] += e; s->h[5] += f; s->h[6] += g; s->h[7] += h;
+}
+
+void sha256_init(Sha256State *s) {
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memset(s, 0, sizeof(*s));
+    memcpy(s->h, iv, sizeof(iv));
+}
+
+void sha256_update(Sha256State *s, const void *data, size_t size) {
+    const uint8_t *p = (const uint8_t *)data;
+    s->total += size;
+    if (s->buf_len) {
+        size_t fill = 64 - s->buf_len;
+        if (fill > size) fill = size;
+        memcpy(s->buf + s->buf_len, p, fill);
+        s->buf_len += fill;
+        p += fill;
+        size -= fill;
+        if (s->buf_len < 64) return;
+        _sha256_block(s, s->buf);
+        s->buf_len = 0;
+    }
+    while (size >= 64) {
+        _sha256_block(s, p);
+        p += 64;
+        size -= 64;
+    }
+    memcpy(s->buf, p, size);
+    s->buf_len = size;
+}
+
+void sha256_final(Sha256State *s, uint8_t digest[32]) {
+    uint64_t bits = s->total * 8;
+    uint8_t pad[72] = { 0x80 };
+    size_t pad_len = (s->buf_len < 56 ? 56 : 120) - s->buf_len;
+    for (int i = 0; i < 8; i++) pad[pad_len + i] = (uint8_t)(bits >> (56 - 8 * i));
+    sha256_update(s, pad, pad_len + 8);
+    for (int i = 0; i < 8; i++) {
+        digest[4*i] = (uint8_t)(s->h[i] >> 24);
+        digest[4*i + 1] = (uint8_t)(s->h[i] >> 16);
+        digest[4*i + 2] = (uint8_t)(s->h[i] >> 8);
+        digest[4*i + 3] = (uint8_t)s->h[i];
+    }
+}
+
+void output_hash_init(OutputHash *h, int use_sha256) {
+    xxh64_init(&h->xxh, 0);
+    if (use_sha256) sha256_init(&h->sha);
+    h->use_sha256 = use_sha256;
+    h->bytes = 0;
+}
+
+void output_hash_update(OutputHash *h, const void *data, size_t size) {
+    xxh64_update(&h->xxh, data, size);
+    if (h->use_sha256) sha256_update(&h->sha, data, size);
+    h->bytes += size;
+}
+
+void output_hash_final(OutputHash *h, char xxh64_hex[17], char sha256_hex[65]) {
+    snprintf(xxh64_hex, 17, "%016llx", (unsigned long long)xxh64_digest(&h->xxh));
+    sha256_hex[0] = '\0';
+    if (h->use_sha256) {
+        uint8_t digest[32];
+        sha256_final(&h->sha, digest);
+        for (int i = 0; i < 32; i++) snprintf(sha256_hex + 2 * i, 3, "%02x", digest[i]);
+    }
+}
+
+#endif // HASH_UTIL_H
@@ -0,0 +1,455 @@
+// jpeg_util.h
+// Baseline JPEG writer for page proofs, encoding bands of rows in parallel.
+//
+// Each row of 16x16 MCUs is its own restart interval: the DC predictions
+// start over and the row ends on a byte boundary with an RSTn marker. A band
+// of rows then depends on nothing before it, so bands are claimed by several
+// threads, each writing into its own buffer, and the buffers are written out
+// in order. Restart markers cost a few bytes per row and let decoders resync
+// after a damaged row.
+//
+// Writes YCbCr with 2x2 chroma subsampling from XRGB8888 pixels, the standard
+// Huffman tables and quantizers scaled by quality (1-100) as libjpeg does,
+// and a JFIF density in dots per inch. Every byte written is also handed to
+// the optional sink, like png_band_util.h.
+//
+// Usage:
+//   #include "jpeg_util.h"
+//   JpegEncoder enc;
+//   jpeg_init(&enc, width, height, 85, 300, threads, 0);   // default band rows
+//   jpeg_write(&enc, pixels, pitch, "page01.jpg");   // every page
+//   jpeg_destroy(&enc);
+
+#ifndef JPEG_UTIL_H
+#define JPEG_UTIL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+
+// MCU rows per band handed to a thread, unless jpeg_init is given another.
+#define JPEG_BAND_ROWS 4
+#define JPEG_MAX_THREADS 64
+
+typedef struct JpegBand {
+    uint8_t *data;
+    size_t size, cap;
+    int failed;
+} JpegBand;
+
+typedef struct JpegEncoder {
+    int width, height, quality, dpi, threads;
+    int mcu_cols, mcu_rows;
+    int band_rows;                // MCU rows per band
+    uint8_t qt[2][64];            // Natural order; luma, chroma
+    float divisors[2][64];        // Quantizers folded with the DCT's scaling
+    uint16_t codes[4][256];       // Luma DC, luma AC, chroma DC, chroma AC
+    uint8_t code_sizes[4][256];
+    JpegBand *bands;
+    int band_count;
+    const uint8_t *pixels;        // Page being written
+    int pitch;
+    SDL_atomic_t next_band;
+    void (*sink)(void *ctx, const void *data, size_t size);
+    void *sink_ctx;
+} JpegEncoder;
+
+// API: returns 0 on success; nonzero on failure.
+int jpeg_init(JpegEncoder *enc, int width, int height, int quality, int dpi, int threads, int band_rows);
+void jpeg_destroy(JpegEncoder *enc);
+int jpeg_write(JpegEncoder *enc, const void *pixels, int pitch, const char *filename);
+
+// ===== Implementation (header-only) =====
+
+static const uint8_t _jpg_zigzag[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+static const uint8_t _jpg_luma_qt[64] = {
+    16, 11, 10, 16,  24,  40,  51,  61,
+    12, 12, 14, 19,  26,  58,  60,  55,
+    14, 13, 16, 24,  40,  57,  69,  56,
+    14, 17, 22, 29,  51,  87,  80,  62,
+    18, 22, 37, 56,  68, 109, 103,  77,
+    24, 35, 55, 64,  81, 104, 113,  92,
+    49, 64, 78, 87, 103, 121, 120, 101,
+    72, 92, 95, 98, 112, 100, 103,  99
+};
+
+static const uint8_t _jpg_chroma_qt[64] = {
+    17, 18, 24, 47, 99, 99, 99, 99,
+    18, 21, 26, 66, 99, 99, 99, 99,
+    24, 26, 56, 99, 99, 99, 99, 99,
+    47, 66, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99
+};
+
+// Huffman tables from Annex K: code counts per length 1-16, then symbols.
+static const uint8_t _jpg_dc_luma_bits[16] = { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+static const uint8_t _jpg_dc_chroma_bits[16] = { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+static const uint8_t _jpg_dc_vals[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+static const uint8_t _jpg_ac_luma_bits[16] = { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
+static const uint8_t _jpg_ac_luma_vals[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+    0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+    0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa
+};
+static const uint8_t _jpg_ac_chroma_bits[16] = { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+static const uint8_t _jpg_ac_chroma_vals[162] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+    0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+    0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa
+};
+
+static const uint8_t *const _jpg_huff_bits[4] = { _jpg_dc_luma_bits, _jpg_ac_luma_bits, _jpg_dc_chroma_bits, _jpg_ac_chroma_bits };
+static const uint8_t *const _jpg_huff_vals[4] = { _jpg_dc_vals, _jpg_ac_luma_vals, _jpg_dc_vals, _jpg_ac_chroma_vals };
+
+static void _jpg_build_codes(JpegEncoder *enc, int table) {
+    const uint8_t *bits = _jpg_huff_bits[table];
+    const uint8_t *vals = _jpg_huff_vals[table];
+    uint16_t code = 0;
+    int k = 0;
+    for (int len = 1; len <= 16; len++) {
+        for (int i = 0; i < bits[len - 1]; i++) {
+            enc->codes[table][vals[k]] = code++;
+            enc->code_sizes[table][vals[k]] = (uint8_t)len;
+            k++;
+        }
+        code <<= 1;
+    }
+}
+
+// ----- Bit output -----
+
+typedef struct _JpgBits {
+    JpegBand *band;
+    uint32_t acc;
+    int count;
+} _JpgBits;
+
+static void _jpg_put_byte(JpegBand *band, uint8_t b) {
+    if (band->size == band->cap) {
+        size_t cap = band->cap ? band->cap * 2 : 65536;
+        uint8_t *bigger = (uint8_t *)realloc(band->data, cap);
+        if (!bigger) {
+            band->failed = 1;
+            return;
+        }
+        band->data = bigger;
+        band->cap = cap;
+    }
+    band->data[band->size++] = b;
+}
+
+static void _jpg_put_bits(_JpgBits *w, uint32_t bits, int size) {
+    w->acc = (w->acc << size) | (bits & ((1u << size) - 1));
+    w->count += size;
+    while (w->count >= 8) {
+        uint8_t b = (uint8_t)(w->acc >> (w->count - 8));
+        _jpg_put_byte(w->band, b);
+        if (b == 0xff) _jpg_put_byte(w->band, 0);   // Byte stuffing
+        w->count -= 8;
+    }
+}
+
+// Pad the last byte with 1 bits, as a restart marker or EOI must be aligned.
+static void _jpg_flush_bits(_JpgBits *w) {
+    if (w->count > 0) _jpg_put_bits(w, 0x7f, 8 - w->count);
+    w->acc = 0;
+    w->count = 0;
+}
+
+// ----- Blocks -----
+
+// Scaled float DCT (AAN), as libjpeg's jfdctflt.c. Output is scaled by
+// 8 * aan[u] * aan[v], which the divisors take out again.
+static void _jpg_fdct_1d(float *d, int stride) {
+    float t0 = d[0] + d[7 * stride], t7 = d[0] - d[7 * stride];
+    float t1 = d[stride] + d[6 * stride], t6 = d[stride] - d[6 * stride];
+    float t2 = d[2 * stride] + d[5 * stride], t5 = d[2 * stride] - d[5 * stride];
+    float t3 = d[3 * stride] + d[4 * stride], t4 = d[3 * stride] - d[4 * stride];
+
+    float t10 = t0 + t3, t13 = t0 - t3, t11 = t1 + t2, t12 = t1 - t2;
+    d[0] = t10 + t11;
+    d[4 * stride] = t10 - t11;
+    float z1 = (t12 + t13) * 0.707106781f;
+    d[2 * stride] = t13 + z1;
+    d[6 * stride] = t13 - z1;
+
+    t10 = t4 + t5;
+    t11 = t5 + t6;
+    t12 = t6 + t7;
+    float z5 = (t10 - t12) * 0.382683433f;
+    float z2 = 0.541196100f * t10 + z5;
+    float z4 = 1.306562965f * t12 + z5;
+    float z3 = t11 * 0.707106781f;
+    float z11 = t7 + z3, z13 = t7 - z3;
+    d[5 * stride] = z13 + z2;
+    d[3 * stride] = z13 - z2;
+    d[stride] = z11 + z4;
+    d[7 * stride] = z11 - z4;
+}
+
+static void _jpg_put_value(_JpgBits *w, const JpegEncoder *enc, int table, int symbol_high, int value) {
+    int magnitude = value < 0 ? -value : value;
+    int size = 0;
+    while (magnitude) {
+        size++;
+        magnitude >>= 1;
+    }
+    int symbol = symbol_high | size;
+    _jpg_put_bits(w, enc->codes[table][symbol], enc->code_sizes[table][symbol]);
+    if (size) _jpg_put_bits(w, (uint32_t)(value < 0 ? value - 1 : value), size);
+}
+
+// Encode one 8x8 block of level-shifted samples; q is 0 for luma, 1 for chroma.
+static void _jpg_block(const JpegEncoder *enc, _JpgBits *w, float *block, int q, int *dc) {
+    for (int r = 0; r < 8; r++) _jpg_fdct_1d(block + 8 * r, 1);
+    for (int c = 0; c < 8; c++) _jpg_fdct_1d(block + c, 8);
+
+    int coef[64];
+    for (int i = 0; i < 64; i++) {
+        float v = block[i] * enc->divisors[q][i];
+        coef[i] = (int)(v < 0 ? v - 0.5f : v + 0.5f);
+        coef[i] = SDL_max(-1023, SDL_min(coef[i], 1023));   // Baseline AC sizes stop at 10 bits
+    }
+
+    _jpg_put_value(w, enc, 2 * q, 0, coef[0] - *dc);
+    *dc = coef[0];
+
+    int run = 0;
+    for (int k = 1; k < 64; k++) {
+        int v = coef[_jpg_zigzag[k]];
+        if (v == 0) {
+            run++;
+            continue;
+        }
+        while (run > 15) {
+            _jpg_put_bits(w, enc->codes[2 * q + 1][0xf0], enc->code_sizes[2 * q + 1][0xf0]);   // 16 zeros
+            run -= 16;
+        }
+        _jpg_put_value(w, enc, 2 * q + 1, run << 4, v);
+        run = 0;
+    }
+    if (run) _jpg_put_bits(w, enc->codes[2 * q + 1][0], enc->code_sizes[2 * q + 1][0]);   // End of block
+}
+
+static void _jpg_encode_band(JpegEncoder *enc, int index) {
+    JpegBand *band = &enc->bands[index];
+    _JpgBits w = { band, 0, 0 };
+    band->size = 0;
+    band->failed = 0;
+
+    int first = index * enc->band_rows;
+    int last = SDL_min(first + enc->band_rows, enc->mcu_rows);
+    float y[256], cb[256], cr[256], block[64];
+    for (int row = first; row < last; row++) {
+        int dc[3] = { 0, 0, 0 };
+        for (int col = 0; col < enc->mcu_cols; col++) {
+            // Edge MCUs repeat the last column and row.
+            for (int py = 0; py < 16; py++) {
+                int sy = SDL_min(row * 16 + py, enc->height - 1);
+                const uint32_t *src = (const uint32_t *)(enc->pixels + (size_t)sy * enc->pitch);
+                for (int px = 0; px < 16; px++) {
+                    uint32_t p = src[SDL_min(col * 16 + px, enc->width - 1)];
+                    float r = (float)((p >> 16) & 0xff), g = (float)((p >> 8) & 0xff), b = (float)(p & 0xff);
+                    y[py * 16 + px] = 0.299f * r + 0.587f * g + 0.114f * b - 128.0f;
+                    cb[py * 16 + px] = -0.168736f * r - 0.331264f * g + 0.5f * b;
+                    cr[py * 16 + px] = 0.5f * r - 0.418688f * g - 0.081312f * b;
+                }
+            }
+            for (int by = 0; by < 2; by++) {
+                for (int bx = 0; bx < 2; bx++) {
+                    for (int i = 0; i < 64; i++) block[i] = y[(by * 8 + i / 8) * 16 + bx * 8 + i % 8];
+                    _jpg_block(enc, &w, block, 0, &dc[0]);
+                }
+            }
+            for (int c = 0; c < 2; c++) {
+                const float *plane = c == 0 ? cb : cr;
+                for (int i = 0; i < 64; i++) {
+                    int sy = (i / 8) * 2, sx = (i % 8) * 2;
+                    block[i] = 0.25f * (plane[sy * 16 + sx] + plane[sy * 16 + sx + 1] + plane[(sy + 1) * 16 + sx] + plane[(sy + 1) * 16 + sx + 1]);
+                }
+                _jpg_block(enc, &w, block, 1, &dc[1 + c]);
+            }
+        }
+        _jpg_flush_bits(&w);
+        if (row + 1 < enc->mcu_rows) {
+            _jpg_put_byte(band, 0xff);
+            _jpg_put_byte(band, (uint8_t)(0xd0 + row % 8));
+        }
+    }
+}
+
+static int _jpg_worker(void *data) {
+    JpegEncoder *enc = (JpegEncoder *)data;
+    int band;
+    while ((band = SDL_AtomicAdd(&enc->next_band, 1)) < enc->band_count) _jpg_encode_band(enc, band);
+    return 0;
+}
+
+// ----- Headers -----
+
+static size_t _jpg_put16(uint8_t *p, size_t at, int v) {
+    p[at] = (uint8_t)(v >> 8);
+    p[at + 1] = (uint8_t)v;
+    return at + 2;
+}
+
+static size_t _jpg_header(const JpegEncoder *enc, uint8_t *h) {
+    size_t n = 0;
+    h[n++] = 0xff; h[n++] = 0xd8;   // SOI
+
+    static const uint8_t jfif[] = { 0xff, 0xe0, 0, 16, 'J', 'F', 'I', 'F', 0, 1, 1, 1 };   // v1.01, dots per inch
+    memcpy(h + n, jfif, sizeof(jfif));
+    n += sizeof(jfif);
+    n = _jpg_put16(h, n, enc->dpi);
+    n = _jpg_put16(h, n, enc->dpi);
+    h[n++] = 0; h[n++] = 0;         // No thumbnail
+
+    for (int q = 0; q < 2; q++) {
+        h[n++] = 0xff; h[n++] = 0xdb;
+        n = _jpg_put16(h, n, 67);
+        h[n++] = (uint8_t)q;
+        for (int k = 0; k < 64; k++) h[n++] = enc->qt[q][_jpg_zigzag[k]];
+    }
+
+    h[n++] = 0xff; h[n++] = 0xc0;   // SOF0
+    n = _jpg_put16(h, n, 17);
+    h[n++] = 8;
+    n = _jpg_put16(h, n, enc->height);
+    n = _jpg_put16(h, n, enc->width);
+    h[n++] = 3;
+    h[n++] = 1; h[n++] = 0x22; h[n++] = 0;
+    h[n++] = 2; h[n++] = 0x11; h[n++] = 1;
+    h[n++] = 3; h[n++] = 0x11; h[n++] = 1;
+
+    static const uint8_t huff_ids[4] = { 0x00, 0x10, 0x01, 0x11 };
+    for (int t = 0; t < 4; t++) {
+        int count = 0;
+        for (int i = 0; i < 16; i++) count += _jpg_huff_bits[t][i];
+        h[n++] = 0xff; h[n++] = 0xc4;
+        n = _jpg_put16(h, n, 3 + 16 + count);
+        h[n++] = huff_ids[t];
+        memcpy(h + n, _jpg_huff_bits[t], 16);
+        n += 16;
+        memcpy(h + n, _jpg_huff_vals[t], (size_t)count);
+        n += (size_t)count;
+    }
+
+    h[n++] = 0xff; h[n++] = 0xdd;   // DRI: one MCU row per interval
+    n = _jpg_put16(h, n, 4);
+    n = _jpg_put16(h, n, enc->mcu_cols);
+
+    static const uint8_t sos[] = { 0xff, 0xda, 0, 12, 3, 1, 0x00, 2, 0x11, 3, 0x11, 0, 63, 0 };
+    memcpy(h + n, sos, sizeof(sos));
+    n += sizeof(sos);
+    return n;
+}
+
+// ----- API -----
+
+int jpeg_init(JpegEncoder *enc, int width, int height, int quality, int dpi, int threads, int band_rows) {
+    memset(enc, 0, sizeof(*enc));
+    if (width <= 0 || height <= 0 || width > 65535 || height > 65535) return 1;
+    if (quality < 1) quality = 1;
+    if (quality > 100) quality = 100;
+
+    enc->width = width;
+    enc->height = height;
+    enc->quality = quality;
+    enc->dpi = dpi > 0 && dpi <= 65535 ? dpi : 72;
+    enc->threads = SDL_max(1, SDL_min(threads, JPEG_MAX_THREADS));
+    enc->mcu_cols = (width + 15) / 16;
+    enc->mcu_rows = (height + 15) / 16;
+    enc->band_rows = band_rows > 0 ? band_rows : JPEG_BAND_ROWS;
+    if (enc->mcu_cols > 65535) return 1;
+
+    // libjpeg's quality scaling.
+    int scale = quality < 50 ? 5000 / quality : 200 - 2 * quality;
+    static const float aan[8] = { 1.0f, 1.387039845f, 1.306562965f, 1.175875602f, 1.0f, 0.785694958f, 0.541196100f, 0.275899379f };
+    for (int i = 0; i < 64; i++) {
+        for (int q = 0; q < 2; q++) {
+            int v = ((q == 0 ? _jpg_luma_qt[i] : _jpg_chroma_qt[i]) * scale + 50) / 100;
+            enc->qt[q][i] = (uint8_t)SDL_max(1, SDL_min(v, 255));
+            enc->divisors[q][i] = 1.0f / (enc->qt[q][i] * aan[i / 8] * aan[i % 8] * 8.0f);
+        }
+    }
+    for (int t = 0; t < 4; t++) _jpg_build_codes(enc, t);
+
+    enc->band_count = (enc->mcu_rows + enc->band_rows - 1) / enc->band_rows;
+    enc->bands = (JpegBand *)calloc((size_t)enc->band_count, sizeof(JpegBand));
+    if (!enc->bands) return 2;
+    return 0;
+}
+
+void jpeg_destroy(JpegEncoder *enc) {
+    for (int i = 0; enc->bands && i < enc->band_count; i++) free(enc->bands[i].data);
+    free(enc->bands);
+    memset(enc, 0, sizeof(*enc));
+}
+
+static int _jpg_fwrite(const JpegEncoder *enc, FILE *f, const void *data, size_t size) {
+    if (size == 0) return 1;
+    if (fwrite(data, 1, size, f) != size) return 0;
+    if (enc->sink) enc->sink(enc->sink_ctx, data, size);
+    return 1;
+}
+
+int jpeg_write(JpegEncoder *enc, const void *pixels, int pitch, const char *filename) {
+    enc->pixels = (const uint8_t *)pixels;
+    enc->pitch = pitch;
+    SDL_AtomicSet(&enc->next_band, 0);
+
+    SDL_Thread *threads[JPEG_MAX_THREADS];
+    int spawned = 0;
+    for (int i = 1; i < enc->threads && i < enc->band_count; i++) {
+        threads[spawned] = SDL_CreateThread(_jpg_worker, "jpeg", enc);
+        if (!threads[spawned]) break;
+        spawned++;
+    }
+    _jpg_worker(enc);
+    for (int i = 0; i < spawned; i++) SDL_WaitThread(threads[i], NULL);
+
+    for (int i = 0; i < enc->band_count; i++) {
+        if (enc->bands[i].failed) return 1;
+    }
+
+    uint8_t header[1024];
+    size_t header_size = _jpg_header(enc, header);
+    static const uint8_t eoi[2] = { 0xff, 0xd9 };
+
+    FILE *f = fopen(filename, "wb");
+    if (!f) return 2;
+    int ok = _jpg_fwrite(enc, f, header, header_size);
+    for (int i = 0; ok && i < enc->band_count; i++) ok = _jpg_fwrite(enc, f, enc->bands[i].data, enc->bands[i].size);
+    ok = ok && _jpg_fwrite(enc, f, eoi, 2);
+    if (fclose(f) != 0) ok = 0;
+    return ok ? 0 : 3;
+}
+
+#endif // JPEG_UTIL_H
@@ -1,4 +1,26 @@
+// kill() and ftruncate() for the shared cache and popen() for --autotune
+// are POSIX, not C99.
+#define _POSIX_C_SOURCE 200809L
+
 #include "png_dpi_util.h"
+#include "card_cache_util.h"
+#include "prefetch_util.h"
+#include "perf_stats_util.h"
+#include "trace_util.h"
+#include "metrics_util.h"
+#include "scaled_cache_util.h"
+#include "mip_util.h"
+#include "png_band_util.h"
+#include "hash_util.h"
+#include "jpeg_util.h"
+#include "steal_util.h"
+#include "shm_cache_util.h"
+#include "png_stream_util.h"
+#include "cost_model_util.h"
+#include "tune_util.h"
+#include "pwg_util.h"
+#include "halftone_util.h"
+#include "mem_watch_util.h"
 
 #include <assert.h>
 
@@ -12,6 +34,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <time.h>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
 
@@ -26,6 +49,9 @@
 #define PAPERSIZE_PARAM_LEN 16
 #define PPI_PARAM_LEN 8
 #define MAX_PATHLEN 128
+#define MAX_LINELEN 1024 // Card lines can stack several layer paths.
+#define MAX_LAYERS 8
+#define MAX_CSV_COLUMNS 32
 #define CARDS_PER_PAGE 9
 #define MAX_NUM_PAGES 80 // Code assumes no more than 99 pages will be printed using this.
 #define MAX_CARDS CARDS_PER_PAGE*MAX_NUM_PAGES
@@ -47,7 +73,34 @@
 #define ARC_THICKNESS_PIXELS 3
 #define GUTTER_THICKNESS_PIXELS 3
 
-static char CARD_IMAGE_FILENAMES[MAX_CARDS][MAX_PATHLEN];
+#define DEFAULT_CACHE_MB 512
+#define DEFAULT_SHARED_CACHE_MB 1024
+#define DEFAULT_DISK_CACHE_MB 4096
+#define DEFAULT_PREFETCH_PAGES 4
+#define DEFAULT_JPEG_QUALITY 85
+#define DEFAULT_PNG_LEVEL 6
+#define DEFAULT_TUNE_PAGES 3
+#define TUNE_REPEATS 2 // Runs per setting; the fastest counts.
+#define MAX_GANG_ORDERS 256
+
+/**
+ * A card is a stack of layers drawn bottom to top.
+ * The first layer is the base and is stretched to the card shape.
+ * Other layers are placed at an offset given in pixels of the
+ * base layer's source image and keep their size relative to it.
+ */
+typedef struct CardLayer {
+    char path[MAX_PATHLEN];
+    int x;
+    int y;
+} CardLayer;
+
+typedef struct CardSpec {
+    int layerCount;
+    CardLayer layers[MAX_LAYERS];
+} CardSpec;
+
+static CardSpec CARD_SPECS[MAX_CARDS];
 
 static SDL_Point ARC_POINTS[NUM_POINTS_1200];
 
@@ -496,40 +549,711 @@ void DrawMarginBorder(SDL_Renderer* renderer, SDL_Color color, enum PPI ppi, enu
     SDL_RenderFillRects(renderer, rects, 4);
 }
 
-SDL_Surface* LoadCardImage(const char* filename, SDL_Color bgcolor, enum PPI ppi) {
-    SDL_Surface* image = NULL;
+/**
+ * What a thread loading and compositing cards works with.
+ * perf is NULL unless stats were asked for; counters are the thread's own.
+ * metrics is NULL unless a metrics listener was asked for.
+ * scaledCache is NULL unless scaled layers are kept on disk.
+ * sharedCache is NULL unless scaled layers are shared with other processes.
+ */
+typedef struct CardLoadContext {
+    Prefetcher* prefetcher;
+    ScaledCache* scaledCache;
+    ShmCache* sharedCache;
+    PerfStats* perf;
+    Metrics* metrics;
+    PerfCounters counters;
+    int page;           // Counted from 1, for tracepoints
+    bool filled;        // Set when the last cache lookup had to load the layer
+    bool pinned;        // The loader already acquired these layers and counted the lookups
+} CardLoadContext;
+
+void StageBegin(CardLoadContext* context, PerfSample* sample) {
+    if (context->perf != NULL)
+        perf_stage_begin(&context->counters, sample);
+    else if (context->metrics != NULL)
+        sample->start_ns = perf_now_ns();
+}
+
+void StageEnd(CardLoadContext* context, PerfSample* sample, PerfStage stage) {
+    if (context->perf != NULL)
+        perf_stage_end(context->perf, &context->counters, sample, stage);
+    if (context->metrics != NULL)
+        metrics_observe(context->metrics, stage, perf_now_ns() - sample->start_ns);
+}
+
+/**
+ * Decode a card file, from the bytes the prefetcher already
+ * read if it has them, otherwise straight from disk.
+ */
+SDL_Surface* DecodeCardFile(const char* filename, Prefetcher* prefetcher) {
+    const unsigned char* data = NULL;
+    size_t size = 0;
+    if (prefetcher != NULL && prefetch_take(prefetcher, filename, &data, &size) == 0) {
+        SDL_Surface* image = IMG_Load_RW(SDL_RWFromConstMem(data, (int)size), 1);
+        prefetch_release(prefetcher, filename);
+        return image;
+    }
+    return IMG_Load(filename);
+}
+
+/**
+ * Where a layer decoded at src_w x src_h ends up on the card.
+ * A base layer (ref_w and ref_h of 0) is stretched to w x h, the card shape.
+ * Other layers keep their size relative to the base layer's source image,
+ * which is ref_w x ref_h pixels, so art authored on the frame lines up.
+ */
+CardShape LayerTarget(int src_w, int src_h, int w, int h, int ref_w, int ref_h) {
+    CardShape targetRect = { .x = 0, .y = 0, .w = w, .h = h };
+    if (ref_w > 0 && ref_h > 0) {
+        targetRect.w = (int)((int64_t)src_w * w / ref_w);
+        targetRect.h = (int)((int64_t)src_h * h / ref_h);
+        if (targetRect.w < 1) targetRect.w = 1;
+        if (targetRect.h < 1) targetRect.h = 1;
+    }
+    return targetRect;
+}
+
+// Sources with more pixels than this are decoded a few rows at a time.
+#define STREAM_DECODE_PIXELS (16*1024*1024)
+
+/**
+ * Decode an open PNG stream a row at a time into the mip level the
+ * layer is resampled from. NULL if it fails to decode.
+ */
+SDL_Surface* StreamPngLevel(PngStream* stream, int w, int h, int ref_w, int ref_h, int* src_w, int* src_h, CardShape* targetRect) {
+    (*src_w) = stream->width;
+    (*src_h) = stream->height;
+    (*targetRect) = LayerTarget(stream->width, stream->height, w, h, ref_w, ref_h);
+    MipStream mip;
+    uint32_t* row = (uint32_t*)malloc(sizeof(uint32_t)*(size_t)stream->width);
+    bool streaming = row != NULL &&
+        mip_stream_init(&mip, stream->width, stream->height, mip_pick_level(stream->width, stream->height, targetRect->w, targetRect->h)) == 0;
+    for (int y = 0; streaming && y < stream->height; ++y) {
+        streaming = png_stream_read_row(stream, row) == 0;
+        if (streaming)
+            mip_stream_push(&mip, row);
+    }
+    SDL_Surface* level = NULL;
+    if (streaming)
+        level = mip_stream_finish(&mip);
+    else if (row != NULL)
+        mip_stream_destroy(&mip);
+    free(row);
+    return level;
+}
+
+/**
+ * Decode a large PNG a row at a time straight into the mip level the layer
+ * is resampled from, so memory is bounded by that level and a few rows per
+ * level, not by the source. Returns NULL, leaving it to the full decode, if
+ * the source is small, isn't a PNG that can be streamed, or fails to decode.
+ * Sets the source dimensions and where the layer ends up, see LayerTarget.
+ */
+SDL_Surface* StreamCardLevel(const char* filename, Prefetcher* prefetcher, int w, int h, int ref_w, int ref_h, int* src_w, int* src_h, CardShape* targetRect) {
+    const unsigned char* data = NULL;
+    size_t size = 0;
+    bool prefetched = prefetcher != NULL && prefetch_take(prefetcher, filename, &data, &size) == 0;
+
+    SDL_Surface* level = NULL;
+    PngStream* stream = (PngStream*)malloc(sizeof(PngStream));
+    if (stream != NULL && png_stream_open(stream, prefetched ? NULL : filename, data, size) == 0) {
+        if ((int64_t)stream->width*stream->height > STREAM_DECODE_PIXELS)
+            level = StreamPngLevel(stream, w, h, ref_w, ref_h, src_w, src_h, targetRect);
+        png_stream_close(stream);
+    }
+    free(stream);
+    if (prefetched)
+        prefetch_release(prefetcher, filename);
+    return level;
+}
+
+/**
+ * Decode a card layer and scale it for the page, see LayerTarget.
+ * Scaling resamples from the mip level just above the target size.
+ * With a disk cache the levels are kept, so a later run at another
+ * PPI starts from a stored level instead of decoding the source.
+ * The result is ARGB8888 with straight alpha. Sets the source dimensions.
+ */
+SDL_Surface* LoadCardImage(const char* filename, CardLoadContext* context, int w, int h, int ref_w, int ref_h, int* src_w, int* src_h) {
     assert(filename != NULL);
     assert(strlen(filename) >= 1);
 
-    image = IMG_Load(filename);
-    if (image == NULL)
-        return NULL;
-
-    CardShape targetRect = GetCardShape(ppi);
-    CardShape sourceRect = { .x = 0, .y = 0, .w = image->w, .h = image-> h };
-    SDL_Surface* postProcessedImage = SDL_CreateRGBSurface(0, targetRect.w, targetRect.h, 32, 0, 0, 0, 0);
-    SDL_Renderer* renderer = SDL_CreateSoftwareRenderer(postProcessedImage);
-    SDL_Rect bgRect = { .x = 0, .y = 0, .w = targetRect.w, .h = targetRect.h };
+    ScaledCache* scaledCache = context->scaledCache;
+    SDL_Surface* chosen = NULL;
+    CardShape targetRect;
+    PerfSample sample;
+
+    bool levelsKept = scaledCache != NULL && scaled_cache_peek_level(scaledCache, filename, 1, src_w, src_h) == 0;
+    if (levelsKept) {
+        targetRect = LayerTarget(*src_w, *src_h, w, h, ref_w, ref_h);
+        int levelIndex = mip_pick_level(*src_w, *src_h, targetRect.w, targetRect.h);
+        if (levelIndex > 0) {
+            StageBegin(context, &sample);
+            chosen = scaled_cache_load_level(scaledCache, filename, levelIndex, src_w, src_h);
+            StageEnd(context, &sample, perfStageDecode);
+            // The cache deleted a level that didn't read back; decode the
+            // source whole and store the levels again.
+            if (chosen == NULL)
+                levelsKept = false;
+        }
+    }
 
-    SDL_SetRenderDrawColor(renderer, bgcolor.r, bgcolor.g, bgcolor.b, bgcolor.a);
-    SDL_RenderFillRect(renderer, &bgRect);
-    SDL_DestroyRenderer(renderer);
+    // Keeping the levels needs the half-size one, most of the source's
+    // memory, so a source whose levels go to the disk cache is decoded whole.
+    if (chosen == NULL && (scaledCache == NULL || levelsKept)) {
+        // Scaling is interleaved with decoding; counted as decoding.
+        StageBegin(context, &sample);
+        chosen = StreamCardLevel(filename, context->prefetcher, w, h, ref_w, ref_h, src_w, src_h, &targetRect);
+        StageEnd(context, &sample, perfStageDecode);
+    }
 
-    SDL_BlitScaled(image, &sourceRect, postProcessedImage, &targetRect);
+    if (chosen == NULL) {
+        StageBegin(context, &sample);
+        SDL_Surface* image = DecodeCardFile(filename, context->prefetcher);
+        StageEnd(context, &sample, perfStageDecode);
+        if (image == NULL)
+            return NULL;
+
+        StageBegin(context, &sample);
+        (*src_w) = image->w;
+        (*src_h) = image->h;
+        targetRect = LayerTarget(image->w, image->h, w, h, ref_w, ref_h);
+        int levelIndex = mip_pick_level(image->w, image->h, targetRect.w, targetRect.h);
+        bool keepLevels = scaledCache != NULL && !levelsKept;
+        int levelCount = keepLevels ? mip_level_count(image->w, image->h) : levelIndex;
+
+        SDL_Surface* level = SDL_ConvertSurfaceFormat(image, SDL_PIXELFORMAT_ARGB8888, 0);
+        SDL_FreeSurface(image);
+        if (level == NULL)
+            return NULL;
+
+        // Halve down to the level needed, or all the way when they're kept.
+        if (levelIndex == 0)
+            chosen = level;
+        for (int k = 1; k <= levelCount; ++k) {
+            SDL_Surface* next = mip_half(level);
+            if (next == NULL)
+                break;
+            if (keepLevels)
+                scaled_cache_store_level(scaledCache, filename, k, *src_w, *src_h, next);
+            if (level != chosen)
+                SDL_FreeSurface(level);
+            level = next;
+            if (k == levelIndex)
+                chosen = level;
+        }
+        if (level != chosen)
+            SDL_FreeSurface(level);
+        StageEnd(context, &sample, perfStageScale);
+        if (chosen == NULL)
+            return NULL;
+    }
 
-    SDL_FreeSurface(image);
+    StageBegin(context, &sample);
+    SDL_Surface* postProcessedImage = mip_resample(chosen, targetRect.w, targetRect.h);
+    StageEnd(context, &sample, perfStageScale);
+    SDL_FreeSurface(chosen);
     return postProcessedImage;
 }
 
-void AddCardToPage(SDL_Surface* pageImage, SDL_Surface* cardImage, int pos, enum PPI ppi, enum PaperSize paperSize) {
+/**
+ * Fill callback for the card cache. userdata is the CardLoadContext.
+ */
+SDL_Surface* FillCardCache(const CardCacheKey* key, int* src_w, int* src_h, void* userdata) {
+    CardLoadContext* context = (CardLoadContext*)userdata;
+    context->filled = true;
+    TRACE_CACHE_MISS(key->path, context->page);
+
+    TRACE_CARD_LOAD_START(key->path, context->page);
+    SDL_Surface* image = NULL;
+    int sharedSlot = -1;
+    PerfSample sample;
+    if (context->sharedCache != NULL) {
+        // Counted as decoding, waiting for another process included.
+        StageBegin(context, &sample);
+        image = shm_cache_acquire(context->sharedCache, key->path, key->w, key->h, key->ref_w, key->ref_h, src_w, src_h, &sharedSlot);
+        StageEnd(context, &sample, perfStageDecode);
+    }
+    if (image == NULL && context->scaledCache != NULL) {
+        // Counted as decoding; it replaces both decode and scale.
+        StageBegin(context, &sample);
+        image = scaled_cache_load(context->scaledCache, key->path, key->w, key->h, key->ref_w, key->ref_h, src_w, src_h);
+        StageEnd(context, &sample, perfStageDecode);
+    }
+    if (image == NULL) {
+        image = LoadCardImage(key->path, context, key->w, key->h, key->ref_w, key->ref_h, src_w, src_h);
+        if (image != NULL && context->scaledCache != NULL)
+            scaled_cache_store(context->scaledCache, key->path, key->w, key->h, key->ref_w, key->ref_h, *src_w, *src_h, image);
+    }
+    if (sharedSlot >= 0) {
+        // Other processes may be waiting for this one. Keep the shared copy
+        // rather than a second one of our own.
+        SDL_Surface* shared = NULL;
+        if (image != NULL)
+            shared = shm_cache_fill(context->sharedCache, sharedSlot, *src_w, *src_h, image);
+        else
+            shm_cache_abandon(context->sharedCache, sharedSlot);
+        if (shared != NULL) {
+            SDL_FreeSurface(image);
+            image = shared;
+        }
+    }
+    TRACE_CARD_LOAD_END(key->path, context->page, image == NULL ? -1 : 0);
+    if (image == NULL) {
+        printf("Error reading %s\n", key->path);
+        printf("%s\n", SDL_GetError());
+    }
+    return image;
+}
+
+/**
+ * Fill a rectangle of the page directly. Unlike the renderer
+ * this is safe to call from several threads on disjoint areas.
+ */
+void FillPageRect(SDL_Surface* pageImage, SDL_Rect rect, SDL_Color color) {
+    assert(pageImage->format->format == SDL_PIXELFORMAT_RGB888);
+    Uint32 pixel = ((Uint32)color.r << 16) | ((Uint32)color.g << 8) | (Uint32)color.b;
+
+    for (int y = rect.y; y < rect.y + rect.h; ++y) {
+        Uint32* row = (Uint32*)((Uint8*)pageImage->pixels + (size_t)y*pageImage->pitch);
+        for (int x = rect.x; x < rect.x + rect.w; ++x) {
+            row[x] = pixel;
+        }
+    }
+}
+
+/**
+ * Alpha-blend an ARGB8888 layer onto the RGB888 page with its
+ * top-left corner at x,y. Anything outside clip is left alone.
+ */
+void CompositeLayer(SDL_Surface* pageImage, SDL_Rect clip, SDL_Surface* layer, int x, int y) {
+    assert(pageImage->format->format == SDL_PIXELFORMAT_RGB888);
+    assert(layer->format->format == SDL_PIXELFORMAT_ARGB8888);
+
+    int x0 = x > clip.x ? x : clip.x;
+    int y0 = y > clip.y ? y : clip.y;
+    int x1 = x + layer->w < clip.x + clip.w ? x + layer->w : clip.x + clip.w;
+    int y1 = y + layer->h < clip.y + clip.h ? y + layer->h : clip.y + clip.h;
+
+    for (int py = y0; py < y1; ++py) {
+        Uint32* dst = (Uint32*)((Uint8*)pageImage->pixels + (size_t)py*pageImage->pitch);
+        const Uint32* src = (const Uint32*)((const Uint8*)layer->pixels + (size_t)(py - y)*layer->pitch);
+        for (int px = x0; px < x1; ++px) {
+            Uint32 s = src[px - x];
+            Uint32 a = s >> 24;
+            if (a == 255) {
+                dst[px] = s & 0xFFFFFF;
+            }
+            else if (a > 0) {
+                Uint32 d = dst[px];
+                Uint32 r = (((s >> 16) & 0xFF)*a + ((d >> 16) & 0xFF)*(255 - a) + 127)/255;
+                Uint32 g = (((s >> 8) & 0xFF)*a + ((d >> 8) & 0xFF)*(255 - a) + 127)/255;
+                Uint32 b = ((s & 0xFF)*a + (d & 0xFF)*(255 - a) + 127)/255;
+                dst[px] = (r << 16) | (g << 8) | b;
+            }
+        }
+    }
+}
+
+/**
+ * Get every layer of a card from the cache, scaled for targetRect and
+ * loaded if need be. Stops at the first layer that can't be loaded and
+ * sets failedLayer to it. The layers acquired stay referenced either
+ * way; release each non-NULL one.
+ */
+bool AcquireCardLayers(CardCache* cache, CardLoadContext* context, const CardSpec* card, CardShape targetRect, const CardCacheEntry* layers[MAX_LAYERS], int* failedLayer) {
+    bool loaded = true;
+    for (int i = 0; i < card->layerCount && loaded; ++i) {
+        CardCacheKey key = { .w = targetRect.w, .h = targetRect.h };
+        strncpy(key.path, card->layers[i].path, CARD_CACHE_PATHLEN - 1);
+        if (i > 0) {
+            key.ref_w = layers[0]->src_w;
+            key.ref_h = layers[0]->src_h;
+        }
+
+        context->filled = false;
+        if (context->pinned) {
+            layers[i] = card_cache_acquire_uncounted(cache, &key, FillCardCache, context);
+        }
+        else {
+            layers[i] = card_cache_acquire(cache, &key, FillCardCache, context);
+            if (!context->filled)
+                TRACE_CACHE_HIT(key.path, context->page);
+            if (context->metrics != NULL)
+                metrics_add(context->metrics, context->filled ? metricCacheMisses : metricCacheHits, 1);
+        }
+        loaded = layers[i] != NULL && layers[i]->state == cardCacheReady;
+        if (!loaded)
+            (*failedLayer) = i;
+    }
+    return loaded;
+}
+
+/**
+ * Build a card straight into its slot on the page: the card background,
+ * then each layer from the cache. Returns false, leaving the slot untouched,
+ * if any layer couldn't be loaded, and sets failedLayer to the first one.
+ */
+bool AddCardToPage(SDL_Surface* pageImage, CardCache* cache, CardLoadContext* context, const CardSpec* card, SDL_Color bgcolor, int pos, enum PPI ppi, enum PaperSize paperSize, int* failedLayer) {
     assert(pageImage != NULL);
-    assert(cardImage != NULL);
+    assert(card != NULL && card->layerCount >= 1);
     assert(pos >= 0 && pos < 9);
-    
-    CardShape sourceRect = { .x = 0, .y = 0, .w = cardImage->w, .h = cardImage->h };
+
     CardShape targetRect = CardPlacement(pos, ppi, paperSize);
+    const CardCacheEntry* layers[MAX_LAYERS] = { NULL };
+    bool loaded = AcquireCardLayers(cache, context, card, targetRect, layers, failedLayer);
+
+    if (loaded) {
+        PerfSample sample;
+        StageBegin(context, &sample);
+        FillPageRect(pageImage, targetRect, bgcolor);
+        for (int i = 0; i < card->layerCount; ++i) {
+            int x = targetRect.x;
+            int y = targetRect.y;
+            if (i > 0) {
+                x += (int)((int64_t)card->layers[i].x * targetRect.w / layers[0]->src_w);
+                y += (int)((int64_t)card->layers[i].y * targetRect.h / layers[0]->src_h);
+            }
+            CompositeLayer(pageImage, targetRect, layers[i]->surface, x, y);
+        }
+        StageEnd(context, &sample, perfStageCompose);
+    }
+
+    for (int i = 0; i < card->layerCount; ++i) {
+        card_cache_release(cache, layers[i]);
+    }
+    return loaded;
+}
+
+/**
+ * A card that couldn't be built, for the list printed after the job.
+ */
+typedef struct CardFailure {
+    int page;           // Counted from 1
+    int slot;
+    char path[MAX_PATHLEN];
+} CardFailure;
+
+static CardFailure CARD_FAILURES[MAX_CARDS];
+static SDL_atomic_t CARD_FAILURE_COUNT;
+
+/**
+ * Stands in for cards that couldn't be built: a gray card with a
+ * frame and a cross, obviously not meant to be printed. Rendered
+ * once per PPI and kept until FreePlaceholderCards.
+ */
+static SDL_Surface* PLACEHOLDER_CARDS[3];
+
+SDL_Surface* PlaceholderCard(enum PPI ppi) {
+    int index = ppi == ppi300 ? 0 : ppi == ppi600 ? 1 : 2;
+    if (PLACEHOLDER_CARDS[index] != NULL)
+        return PLACEHOLDER_CARDS[index];
+
+    CardShape shape = GetCardShape(ppi);
+    SDL_Surface* card = SDL_CreateRGBSurfaceWithFormat(0, shape.w, shape.h, 32, SDL_PIXELFORMAT_ARGB8888);
+    if (card == NULL)
+        return NULL;
+
+    int thickness = ppi/50;
+    double diagonal = sqrt((double)shape.w*shape.w + (double)shape.h*shape.h);
+    for (int y = 0; y < shape.h; ++y) {
+        Uint32* row = (Uint32*)((Uint8*)card->pixels + (size_t)y*card->pitch);
+        for (int x = 0; x < shape.w; ++x) {
+            bool frame = x < thickness || y < thickness || x >= shape.w - thickness || y >= shape.h - thickness;
+            double down = fabs((double)x*shape.h - (double)y*shape.w)/diagonal;
+            double up = fabs((double)x*shape.h + (double)y*shape.w - (double)shape.w*shape.h)/diagonal;
+            if (frame)
+                row[x] = 0xFF808080;
+            else if (down < thickness/2.0 || up < thickness/2.0)
+                row[x] = 0xFFCC3333;
+            else
+                row[x] = 0xFFE0E0E0;
+        }
+    }
+    PLACEHOLDER_CARDS[index] = card;
+    return card;
+}
+
+void FreePlaceholderCards(void) {
+    for (int i = 0; i < 3; ++i) {
+        if (PLACEHOLDER_CARDS[i] != NULL)
+            SDL_FreeSurface(PLACEHOLDER_CARDS[i]);
+        PLACEHOLDER_CARDS[i] = NULL;
+    }
+}
+
+// The layers of one card, as acquired from the cache.
+typedef const CardCacheEntry* CardLayers[MAX_LAYERS];
+
+/**
+ * The cards of one page, shared by the threads compositing them.
+ * Each thread claims the next slot until none are left.
+ */
+typedef struct PageJob {
+    SDL_Surface* page;
+    CardCache* cache;
+    Prefetcher* prefetcher;
+    ScaledCache* scaledCache;
+    ShmCache* sharedCache;
+    PerfStats* perf;
+    Metrics* metrics;
+    int pageNumber;
+    const CardSpec* cards;
+    int cardCount;
+    SDL_Color bgcolor;
+    enum PPI ppi;
+    enum PaperSize paperSize;
+    SDL_Surface* placeholder;   // Stamped into failed slots; NULL leaves them blank
+    CardLayers* pinned;         // By slot, layers the loader holds; NULL without a loader
+    SDL_atomic_t nextSlot;
+    bool placed[CARDS_PER_PAGE];
+    bool failed[CARDS_PER_PAGE];
+} PageJob;
+
+int PageWorker(void* data) {
+    PageJob* job = (PageJob*)data;
+    CardLoadContext context = { .prefetcher = job->prefetcher, .scaledCache = job->scaledCache, .sharedCache = job->sharedCache, .perf = job->perf, .metrics = job->metrics, .page = job->pageNumber };
+    if (job->perf != NULL)
+        perf_counters_open(job->perf, &context.counters);
+
+    int slot;
+    while ((slot = SDL_AtomicAdd(&job->nextSlot, 1)) < job->cardCount) {
+        // Ganged sheets can have empty slots.
+        if (job->cards[slot].layerCount == 0) {
+            job->placed[slot] = false;
+            job->failed[slot] = false;
+            if (job->metrics != NULL)
+                metrics_gauge_add(job->metrics, metricComposeQueue, -1);
+            continue;
+        }
+        int failedLayer = 0;
+        context.pinned = job->pinned != NULL && job->pinned[slot][0] != NULL;
+        job->placed[slot] = AddCardToPage(job->page, job->cache, &context, &job->cards[slot], job->bgcolor, slot, job->ppi, job->paperSize, &failedLayer);
+        job->failed[slot] = !job->placed[slot];
+        if (job->failed[slot]) {
+            CardFailure* failure = &CARD_FAILURES[SDL_AtomicAdd(&CARD_FAILURE_COUNT, 1)];
+            failure->page = job->pageNumber;
+            failure->slot = slot;
+            strncpy(failure->path, job->cards[slot].layers[failedLayer].path, MAX_PATHLEN-1);
+            if (job->placeholder != NULL) {
+                CardShape shape = CardPlacement(slot, job->ppi, job->paperSize);
+                CompositeLayer(job->page, shape, job->placeholder, shape.x, shape.y);
+            }
+        }
+        if (job->metrics != NULL) {
+            metrics_add(job->metrics, job->placed[slot] ? metricCardsPlaced : metricCardsFailed, 1);
+            metrics_gauge_add(job->metrics, metricComposeQueue, -1);
+        }
+    }
+
+    if (job->perf != NULL)
+        perf_counters_close(&context.counters);
+    return 0;
+}
+
+/**
+ * Composite every card of a page into its slot, using up to
+ * threadCount threads. The calling thread does its share too.
+ */
+void ComposePage(PageJob* job, int threadCount) {
+    SDL_Thread* threads[CARDS_PER_PAGE];
+    int spawned = 0;
+
+    SDL_AtomicSet(&job->nextSlot, 0);
+    if (job->metrics != NULL)
+        metrics_gauge_set(job->metrics, metricComposeQueue, job->cardCount);
+    for (int i = 1; i < threadCount && i < job->cardCount; ++i) {
+        threads[spawned] = SDL_CreateThread(PageWorker, "compose", job);
+        if (threads[spawned] == NULL)
+            break;
+        spawned++;
+    }
+
+    PageWorker(job);
+    for (int i = 0; i < spawned; ++i) {
+        SDL_WaitThread(threads[i], NULL);
+    }
+}
+
+/**
+ * Size of a file, or 0 if it can't be read.
+ */
+uint64_t FileSize(const char* filename) {
+    struct stat st;
+    if (stat(filename, &st) != 0)
+        return 0;
+    return (uint64_t)st.st_size;
+}
+
+/**
+ * A card of a page being loaded ahead, see PageLoads.
+ */
+typedef struct CardLoadTask {
+    struct PageLoads* loads;
+    int slot;
+} CardLoadTask;
+
+/**
+ * The cards of a page, decoded and scaled into the cache by the
+ * work-stealing pool while earlier pages are composited. Each card is
+ * a task; its layers stay referenced until the page has been composited
+ * so they can't be evicted in between.
+ */
+typedef struct PageLoads {
+    struct CardLoader* loader;
+    int pageNumber;     // Counted from 1, 0 when unused
+    const CardSpec* cards;
+    int cardCount;
+    SDL_atomic_t remaining;
+    CardLoadTask tasks[CARDS_PER_PAGE];
+    const CardCacheEntry* pinned[CARDS_PER_PAGE][MAX_LAYERS];
+} PageLoads;
+
+/**
+ * Loads the cards of the page being composited and the next one. Cards
+ * differ wildly in cost, a 6000x8400 source next to a 750x1050 one, so
+ * they're separate tasks, the largest source files first, and a thread
+ * that runs out of work takes tasks from the others.
+ */
+typedef struct CardLoader {
+    StealPool pool;
+    CardCache* cache;
+    PerfStats* perf;
+    CardLoadContext contexts[STEAL_MAX_WORKERS];
+    bool countersOpen[STEAL_MAX_WORKERS];
+    enum PPI ppi;
+    enum PaperSize paperSize;
+    SDL_mutex* lock;
+    SDL_cond* pageDone;
+    PageLoads pages[2];     // By page parity
+    int tasksRun;
+} CardLoader;
+
+void RunCardLoadTask(void* arg, int worker) {
+    CardLoadTask* task = (CardLoadTask*)arg;
+    PageLoads* loads = task->loads;
+    CardLoader* loader = loads->loader;
+    CardLoadContext* context = &loader->contexts[worker];
+    if (loader->perf != NULL && !loader->countersOpen[worker]) {
+        perf_counters_open(loader->perf, &context->counters);
+        loader->countersOpen[worker] = true;
+    }
+    context->page = loads->pageNumber;
+
+    // Failures are left in the cache for AddCardToPage to report.
+    int failedLayer = 0;
+    CardShape targetRect = CardPlacement(task->slot, loader->ppi, loader->paperSize);
+    AcquireCardLayers(loader->cache, context, &loads->cards[task->slot], targetRect, loads->pinned[task->slot], &failedLayer);
+
+    SDL_LockMutex(loader->lock);
+    if (SDL_AtomicAdd(&loads->remaining, -1) == 1)
+        SDL_CondBroadcast(loader->pageDone);
+    SDL_UnlockMutex(loader->lock);
+}
+
+bool InitCardLoader(CardLoader* loader, int threadCount, CardCache* cache, CardLoadContext context, enum PPI ppi, enum PaperSize paperSize) {
+    memset(loader, 0, sizeof(*loader));
+    loader->cache = cache;
+    loader->perf = context.perf;
+    loader->ppi = ppi;
+    loader->paperSize = paperSize;
+    for (int i = 0; i < STEAL_MAX_WORKERS; ++i) {
+        loader->contexts[i] = context;
+    }
+    for (int i = 0; i < 2; ++i) {
+        loader->pages[i].loader = loader;
+    }
+    loader->lock = SDL_CreateMutex();
+    loader->pageDone = SDL_CreateCond();
+    return loader->lock != NULL && loader->pageDone != NULL && steal_pool_init(&loader->pool, threadCount) == 0;
+}
+
+/**
+ * Queue the cards of page (counted from 0) behind any already queued.
+ */
+void LoadPageAhead(CardLoader* loader, const CardSpec* cards, int cardCount, int page) {
+    PageLoads* loads = &loader->pages[page % 2];
+    if (loads->pageNumber == page+1)
+        return;
+    assert(loads->pageNumber == 0);
+
+    loads->pageNumber = page+1;
+    loads->cards = &cards[page*CARDS_PER_PAGE];
+    loads->cardCount = SDL_min(CARDS_PER_PAGE, cardCount - page*CARDS_PER_PAGE);
+    memset(loads->pinned, 0, sizeof(loads->pinned));
+
+    StealTask tasks[CARDS_PER_PAGE];
+    int taskCount = 0;
+    for (int slot = 0; slot < loads->cardCount; ++slot) {
+        if (loads->cards[slot].layerCount == 0)
+            continue;
+        uint64_t cost = 0;
+        for (int j = 0; j < loads->cards[slot].layerCount; ++j) {
+            cost += FileSize(loads->cards[slot].layers[j].path);
+        }
+        loads->tasks[slot].loads = loads;
+        loads->tasks[slot].slot = slot;
+        tasks[taskCount++] = (StealTask){ .run = RunCardLoadTask, .arg = &loads->tasks[slot], .cost = cost };
+    }
+    // Set before submitting, since the first tasks may finish right away.
+    SDL_AtomicSet(&loads->remaining, taskCount);
+    int queued = steal_pool_submit(&loader->pool, tasks, taskCount);
+    loader->tasksRun += queued;
+    if (queued < taskCount) {
+        // The cards that didn't make it in are loaded while compositing;
+        // WaitPageLoads still waits for the queued ones.
+        SDL_AtomicAdd(&loads->remaining, queued - taskCount);
+    }
+}
+
+/**
+ * Wait for the cards of page to be loaded, if they were queued.
+ */
+void WaitPageLoads(CardLoader* loader, int page) {
+    PageLoads* loads = &loader->pages[page % 2];
+    if (loads->pageNumber != page+1)
+        return;
+    SDL_LockMutex(loader->lock);
+    while (SDL_AtomicGet(&loads->remaining) > 0) {
+        SDL_CondWait(loader->pageDone, loader->lock);
+    }
+    SDL_UnlockMutex(loader->lock);
+}
+
+/**
+ * The layers the loader holds for page, by slot, or NULL if it wasn't queued.
+ */
+CardLayers* PinnedPageLayers(CardLoader* loader, int page) {
+    PageLoads* loads = &loader->pages[page % 2];
+    return loads->pageNumber == page+1 ? loads->pinned : NULL;
+}
+
+/**
+ * Let the cache evict the layers of a page once it's composited.
+ */
+void ReleasePageLoads(CardLoader* loader, int page) {
+    PageLoads* loads = &loader->pages[page % 2];
+    if (loads->pageNumber != page+1)
+        return;
+    for (int slot = 0; slot < loads->cardCount; ++slot) {
+        for (int j = 0; j < MAX_LAYERS; ++j) {
+            card_cache_release(loader->cache, loads->pinned[slot][j]);
+        }
+    }
+    loads->pageNumber = 0;
+}
 
-    SDL_BlitScaled(cardImage, &sourceRect, pageImage, &targetRect);
+void DestroyCardLoader(CardLoader* loader) {
+    steal_pool_destroy(&loader->pool);
+    for (int i = 0; i < STEAL_MAX_WORKERS; ++i) {
+        if (loader->countersOpen[i])
+            perf_counters_close(&loader->contexts[i].counters);
+    }
+    if (loader->pageDone != NULL)
+        SDL_DestroyCond(loader->pageDone);
+    if (loader->lock != NULL)
+        SDL_DestroyMutex(loader->lock);
 }
 
 /**
@@ -663,6 +1387,196 @@ bool ParsePaperSize(char* s, enum PaperSize* paperSize, size_t n) {
     
 }
 
+/**
+ * Parse a card line into its layers. A plain path is a one-layer card.
+ * Layers are separated by '|', bottom first, and can carry an offset
+ * in pixels of the base layer's source image:
+ *
+ *   frames/rare.png | art/dragon.png @ 60,120 | icons/fire.png @ 20,20
+ *
+ * Returns false if the line can't be parsed.
+ */
+bool ParseCardLayers(const char* line, CardSpec* card) {
+    char buf[MAX_LINELEN];
+    strncpy(buf, line, MAX_LINELEN - 1);
+    buf[MAX_LINELEN - 1] = '\0';
+
+    card->layerCount = 0;
+    char* layer = buf;
+    while (layer != NULL) {
+        char* sep = strchr(layer, '|');
+        if (sep != NULL)
+            (*sep) = '\0';
+
+        if (card->layerCount >= MAX_LAYERS) {
+            printf("Too many layers (max %d) in: [%s]\n", MAX_LAYERS, line);
+            return false;
+        }
+        CardLayer* l = &card->layers[card->layerCount];
+        l->x = 0;
+        l->y = 0;
+
+        // An offset is only taken from the last '@' if it parses as x,y.
+        // Otherwise the '@' is part of the path.
+        char* at = strrchr(layer, '@');
+        char rest;
+        if (at != NULL && sscanf(at + 1, " %d , %d %c", &l->x, &l->y, &rest) == 2) {
+            (*at) = '\0';
+        }
+        else {
+            l->x = 0;
+            l->y = 0;
+        }
+
+        Trim(layer, MAX_LINELEN);
+        if (strlen(layer) == 0 || strlen(layer) >= MAX_PATHLEN) {
+            printf("Invalid layer path in: [%s]\n", line);
+            return false;
+        }
+        strncpy(l->path, layer, MAX_PATHLEN);
+        card->layerCount++;
+
+        layer = sep != NULL ? sep + 1 : NULL;
+    }
+
+    return true;
+}
+
+/**
+ * Split one CSV record into fields in-place. Handles quoted fields
+ * with "" escapes. Returns the number of fields.
+ */
+int SplitCSVLine(char* line, char* fields[MAX_CSV_COLUMNS]) {
+    int count = 0;
+    char* in = line;
+    while (count < MAX_CSV_COLUMNS) {
+        char* out = in;
+        fields[count++] = in;
+        if (*in == '"') {
+            in++;
+            while (*in != '\0') {
+                if (in[0] == '"' && in[1] == '"') {
+                    *out++ = '"';
+                    in += 2;
+                }
+                else if (in[0] == '"') {
+                    in++;
+                    break;
+                }
+                else {
+                    *out++ = *in++;
+                }
+            }
+        }
+        while (*in != '\0' && *in != ',') {
+            *out++ = *in++;
+        }
+        bool more = *in == ',';
+        (*out) = '\0';
+        if (!more)
+            break;
+        in++;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        Trim(fields[i], strlen(fields[i]) + 1);
+    }
+    return count;
+}
+
+/**
+ * Replace each {column} in the template with that column's value.
+ * Returns false if a column is unknown or the result is too long.
+ */
+bool ExpandCardTemplate(const char* tmpl, char* names[], char* values[], int columns, char* out, size_t n) {
+    size_t len = 0;
+    const char* p = tmpl;
+    while (*p != '\0') {
+        const char* value = NULL;
+        size_t valueLen = 1;
+        if (*p == '{') {
+            const char* close = strchr(p, '}');
+            if (close == NULL) {
+                printf("Unterminated {column} in template: [%s]\n", tmpl);
+                return false;
+            }
+            for (int i = 0; i < columns; ++i) {
+                if (strlen(names[i]) == (size_t)(close - p - 1) && strncmp(names[i], p + 1, close - p - 1) == 0) {
+                    value = values[i];
+                    break;
+                }
+            }
+            if (value == NULL) {
+                printf("Unknown column %.*s in template: [%s]\n", (int)(close - p + 1), p, tmpl);
+                return false;
+            }
+            valueLen = strlen(value);
+            p = close + 1;
+        }
+        else {
+            value = p;
+            p++;
+        }
+
+        if (len + valueLen >= n) {
+            printf("Template expands past %d characters: [%s]\n", (int)n - 1, tmpl);
+            return false;
+        }
+        memcpy(out + len, value, valueLen);
+        len += valueLen;
+    }
+    out[len] = '\0';
+    return true;
+}
+
+/**
+ * Generate card variants from a CSV file. The first row names the columns
+ * and every other row fills in the {column} placeholders of the template.
+ * Returns the new card count, or -1 on error.
+ */
+int LoadCardCSV(const char* filename, const char* tmpl, CardSpec* cards, int currCard) {
+    FILE* f = fopen(filename, "r");
+    if (!f) {
+        printf("Couldn't read %s\n", filename);
+        return -1;
+    }
+
+    char header[MAX_LINELEN];
+    char* names[MAX_CSV_COLUMNS];
+    int columns = 0;
+    char line[MAX_LINELEN];
+    char* values[MAX_CSV_COLUMNS];
+    char expanded[MAX_LINELEN];
+
+    while (currCard < MAX_CARDS && fgets(line, MAX_LINELEN, f)) {
+        Trim(line, MAX_LINELEN);
+        if (strlen(line) == 0 || line[0] == '#')
+            continue;
+
+        if (columns == 0) {
+            strncpy(header, line, MAX_LINELEN);
+            columns = SplitCSVLine(header, names);
+            continue;
+        }
+
+        int count = SplitCSVLine(line, values);
+        if (count != columns) {
+            printf("Expected %d columns but found %d in %s: [%s]\n", columns, count, filename, line);
+            fclose(f);
+            return -1;
+        }
+        if (!ExpandCardTemplate(tmpl, names, values, columns, expanded, MAX_LINELEN) ||
+            !ParseCardLayers(expanded, &cards[currCard])) {
+            fclose(f);
+            return -1;
+        }
+        currCard++;
+    }
+
+    fclose(f);
+    return currCard;
+}
+
 int LoadConfig(
     char* filename, 
     enum PPI* ppi, 
@@ -670,7 +1584,7 @@ int LoadConfig(
     SDL_Color* cardLineColor,
     int* roundedcorners, 
     enum PaperSize* paperSize,
-    char cards[CARDS_PER_PAGE][MAX_PATHLEN]) {
+    CardSpec cards[MAX_CARDS]) {
 
     assert(strlen(filename) > 0);
 
@@ -754,10 +1668,39 @@ int LoadConfig(
         return -1;
     }
 
-    while (currCard < MAX_CARDS && fgets(line, MAX_PATHLEN, f)) {
-        Trim(line, MAX_PATHLEN);
-        if (strlen(line) > 0 && line[0] != '#') {
-            strncpy(cards[currCard], line, MAX_PATHLEN);
+    // Cards are either a path or a stack of layers (see ParseCardLayers).
+    // "@template" sets the layer stack with {column} placeholders
+    // and "@csv" adds one card per row of a CSV file using it.
+    char cardLine[MAX_LINELEN];
+    char cardTemplate[MAX_LINELEN] = "";
+    while (currCard < MAX_CARDS && fgets(cardLine, MAX_LINELEN, f)) {
+        Trim(cardLine, MAX_LINELEN);
+        if (strlen(cardLine) == 0 || cardLine[0] == '#')
+            continue;
+
+        if (strncmp(cardLine, "@template", 9) == 0) {
+            strncpy(cardTemplate, cardLine + 9, MAX_LINELEN);
+            Trim(cardTemplate, MAX_LINELEN);
+        }
+        else if (strncmp(cardLine, "@csv", 4) == 0) {
+            char* csvFilename = cardLine + 4;
+            Trim(csvFilename, MAX_LINELEN);
+            if (strlen(cardTemplate) == 0) {
+                printf("@csv %s needs an @template line before it\n", csvFilename);
+                fclose(f);
+                return -1;
+            }
+            currCard = LoadCardCSV(csvFilename, cardTemplate, cards, currCard);
+            if (currCard == -1) {
+                fclose(f);
+                return -1;
+            }
+        }
+        else {
+            if (!ParseCardLayers(cardLine, &cards[currCard])) {
+                fclose(f);
+                return -1;
+            }
             currCard++;
         }
     }
@@ -766,47 +1709,1410 @@ int LoadConfig(
     return currCard;
 }
 
-int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        printf("Create sheets of cards arranged 3x3.\n");
-        printf("Input is a text file. See the test.txt example.\n");
-        printf("Output will be png [OUTPUT_PREFIX]XX.png. XX is the page number.\n");
-        printf("PAPER_SIZE AND PPI override any values defined in the input file.\n\n");
-        printf("Usage: %s INPUT_FILE [OUTPUT_PREFIX (default \"page\")] [PPI (300|600|1200) (default 300)] [PAPER_SIZE (A4|US) (default US)]\n", APPNAME());
-        exit(1);
+/**
+ * Returns true if both cards stack the same layers at the same offsets.
+ */
+bool SameCard(const CardSpec* a, const CardSpec* b) {
+    if (a->layerCount != b->layerCount)
+        return false;
+
+    for (int i = 0; i < a->layerCount; ++i) {
+        if (a->layers[i].x != b->layers[i].x || a->layers[i].y != b->layers[i].y ||
+            strcmp(a->layers[i].path, b->layers[i].path) != 0) {
+            return false;
+        }
     }
+    return true;
+}
 
-    if (strlen(argv[1]) >= MAX_PATHLEN) {
-        printf("Path of input must be less than %d\n", MAX_PATHLEN);
-        exit(1);
+/**
+ * Order cards by their layer paths from the bottom up, so that
+ * cards sharing a frame end up next to each other.
+ */
+int CompareCardLayers(const CardSpec* a, const CardSpec* b) {
+    for (int i = 0; i < a->layerCount && i < b->layerCount; ++i) {
+        int c = strcmp(a->layers[i].path, b->layers[i].path);
+        if (c != 0)
+            return c;
     }
-    char* inputFilename = argv[1];
+    return a->layerCount - b->layerCount;
+}
 
-    char outputPrefix[OUTPUT_PATHLEN-1] = "page";
-    if (argc >= 3) {
-        if (strlen(argv[2]) >= OUTPUT_PATHLEN) {
+/**
+ * Write a card back out in the config's layer syntax.
+ */
+void FormatCardSpec(const CardSpec* card, char* out, size_t n) {
+    size_t len = 0;
+    out[0] = '\0';
+    for (int i = 0; i < card->layerCount && len < n; ++i) {
+        const CardLayer* l = &card->layers[i];
+        int written;
+        if (i == 0)
+            written = snprintf(out + len, n - len, "%s", l->path);
+        else if (l->x != 0 || l->y != 0)
+            written = snprintf(out + len, n - len, " | %s @ %d,%d", l->path, l->x, l->y);
+        else
+            written = snprintf(out + len, n - len, " | %s", l->path);
+        if (written < 0)
+            break;
+        len += (size_t)written;
+    }
+}
+
+/**
+ * A run of identical cards while reordering.
+ */
+typedef struct CardGroup {
+    int first;  // Index of the first card in the group
+    const CardSpec* card;  // That card, for sorting
+    int count;
+    int taken;
+} CardGroup;
+
+int CompareCardGroups(const void* a, const void* b) {
+    const CardGroup* ga = (const CardGroup*)a;
+    const CardGroup* gb = (const CardGroup*)b;
+    int c = CompareCardLayers(ga->card, gb->card);
+    return c != 0 ? c : ga->first - gb->first;
+}
+
+/**
+ * Reorder the cards for cache reuse when page order doesn't matter.
+ *
+ * Identical cards are grouped. Each group first fills as many whole pages
+ * as it can, which are then identical and only rendered once. The leftover
+ * cards follow, sorted by their layers so cards sharing a frame are decoded
+ * together and stay in the layer cache.
+ *
+ * order[newIndex] is set to the card's original index.
+ */
+void ReorderCards(CardSpec* cards, int cardCount, int order[MAX_CARDS]) {
+    static CardGroup groups[MAX_CARDS];
+    static int groupOf[MAX_CARDS];
+    int groupCount = 0;
+
+    for (int i = 0; i < cardCount; ++i) {
+        int g = 0;
+        while (g < groupCount && !SameCard(&cards[groups[g].first], &cards[i])) {
+            g++;
+        }
+        if (g == groupCount) {
+            groups[groupCount++] = (CardGroup){ .first = i, .card = &cards[i], .count = 0, .taken = 0 };
+        }
+        groups[g].count++;
+        groupOf[i] = g;
+    }
+
+    qsort(groups, groupCount, sizeof(CardGroup), CompareCardGroups);
+    for (int g = 0; g < groupCount; ++g) {
+        for (int i = groups[g].first; i < cardCount; ++i) {
+            if (SameCard(&cards[i], &cards[groups[g].first]))
+                groupOf[i] = g;
+        }
+    }
+
+    // Cards of a group are taken in their original order so the
+    // mapping stays stable for duplicates.
+    int next = 0;
+    for (int g = 0; g < groupCount; ++g) {
+        int whole = (groups[g].count / CARDS_PER_PAGE) * CARDS_PER_PAGE;
+        for (int i = 0; i < cardCount && groups[g].taken < whole; ++i) {
+            if (groupOf[i] == g) {
+                order[next++] = i;
+                groups[g].taken++;
+            }
+        }
+    }
+    for (int g = 0; g < groupCount; ++g) {
+        int skip = groups[g].taken;
+        for (int i = 0; i < cardCount; ++i) {
+            if (groupOf[i] != g)
+                continue;
+            if (skip > 0) {
+                skip--;
+                continue;
+            }
+            order[next++] = i;
+        }
+    }
+    assert(next == cardCount);
+
+    CardSpec* reordered = (CardSpec*)malloc(sizeof(CardSpec) * cardCount);
+    assert(reordered != NULL);
+    for (int i = 0; i < cardCount; ++i) {
+        reordered[i] = cards[order[i]];
+    }
+    memcpy(cards, reordered, sizeof(CardSpec) * cardCount);
+    free(reordered);
+}
+
+/**
+ * Write where each config entry ended up after ReorderCards
+ * as CSV: entry,page,slot,card. Entries and pages count from 1.
+ */
+bool WriteOrderMapping(const char* filename, const CardSpec* cards, const int order[], int cardCount) {
+    FILE* f = fopen(filename, "w");
+    if (!f) {
+        printf("Couldn't write %s\n", filename);
+        return false;
+    }
+
+    fprintf(f, "entry,page,slot,card\n");
+    for (int i = 0; i < cardCount; ++i) {
+        char description[MAX_LINELEN];
+        FormatCardSpec(&cards[i], description, MAX_LINELEN);
+
+        fprintf(f, "%d,%d,%d,\"", order[i]+1, i/CARDS_PER_PAGE + 1, i%CARDS_PER_PAGE);
+        for (const char* p = description; *p != '\0'; ++p) {
+            if (*p == '"')
+                fputc('"', f);
+            fputc(*p, f);
+        }
+        fprintf(f, "\"\n");
+    }
+
+    return fclose(f) == 0;
+}
+
+/**
+ * Returns the earliest page holding exactly the same cards
+ * in the same slots as page, or -1 if there is none.
+ */
+int FindIdenticalPage(const CardSpec* cards, int cardCount, int page) {
+    int first = page*CARDS_PER_PAGE;
+    int count = SDL_min(CARDS_PER_PAGE, cardCount - first);
+
+    for (int p = 0; p < page; ++p) {
+        int otherFirst = p*CARDS_PER_PAGE;
+        if (SDL_min(CARDS_PER_PAGE, cardCount - otherFirst) != count)
+            continue;
+
+        int i = 0;
+        while (i < count && SameCard(&cards[first + i], &cards[otherFirst + i])) {
+            i++;
+        }
+        if (i == count)
+            return p;
+    }
+    return -1;
+}
+
+/**
+ * Where a slot's card came from when orders are ganged.
+ * order is an index into the order list and entry counts from 0.
+ */
+typedef struct GangSlot {
+    int order;
+    int entry;
+} GangSlot;
+
+static char GANG_ORDER_FILES[MAX_GANG_ORDERS][MAX_PATHLEN];
+static GangSlot GANG_SLOTS[MAX_CARDS];
+
+/**
+ * Load every order listed in listFilename (one config file per line)
+ * and pack their cards onto shared sheets.
+ *
+ * Each order's whole pages come first, in list order, and stay its own.
+ * The cards left over at the end of each order are packed onto shared
+ * sheets largest first, each into the first sheet with room for all of
+ * them, so an order's leftovers never get split across sheets.
+ * Unused slots are left empty (layerCount 0) at the end of a sheet.
+ *
+ * All orders must use the same paper, PPI, colors and corners.
+ * Returns the number of slots used, or -1 on error.
+ */
+int LoadGang(
+    char* listFilename,
+    enum PPI* ppi,
+    SDL_Color* cardBGColor,
+    SDL_Color* cardLineColor,
+    int* roundedCorners,
+    enum PaperSize* paperSize,
+    CardSpec cards[MAX_CARDS],
+    int* orderCount) {
+
+    static CardSpec orderCards[MAX_CARDS];
+    static CardSpec leftovers[MAX_CARDS];
+    static GangSlot leftoverSlots[MAX_CARDS];
+    static int leftoverFirst[MAX_GANG_ORDERS];
+    static int leftoverCount[MAX_GANG_ORDERS];
+
+    FILE* f = fopen(listFilename, "r");
+    if (!f) {
+        printf("Couldn't read %s\n", listFilename);
+        return -1;
+    }
+
+    int slot = 0;
+    int leftoverTotal = 0;
+    char line[MAX_PATHLEN];
+    *orderCount = 0;
+    while (fgets(line, MAX_PATHLEN, f)) {
+        Trim(line, MAX_PATHLEN);
+        if (strlen(line) == 0 || line[0] == '#')
+            continue;
+        if (*orderCount >= MAX_GANG_ORDERS) {
+            printf("Too many orders in %s, at most %d\n", listFilename, MAX_GANG_ORDERS);
+            fclose(f);
+            return -1;
+        }
+
+        int o = (*orderCount)++;
+        strncpy(GANG_ORDER_FILES[o], line, MAX_PATHLEN-1);
+
+        enum PPI orderPPI;
+        SDL_Color orderBGColor, orderLineColor;
+        int orderCorners;
+        enum PaperSize orderPaperSize;
+        int count = LoadConfig(GANG_ORDER_FILES[o], &orderPPI, &orderBGColor, &orderLineColor, &orderCorners, &orderPaperSize, orderCards);
+        if (count == -1) {
+            printf("Config error. Check %s\n", GANG_ORDER_FILES[o]);
+            fclose(f);
+            return -1;
+        }
+
+        if (o == 0) {
+            *ppi = orderPPI;
+            *cardBGColor = orderBGColor;
+            *cardLineColor = orderLineColor;
+            *roundedCorners = orderCorners;
+            *paperSize = orderPaperSize;
+        }
+        else if (orderPPI != *ppi || orderPaperSize != *paperSize || orderCorners != *roundedCorners ||
+                memcmp(&orderBGColor, cardBGColor, sizeof(SDL_Color)) != 0 ||
+                memcmp(&orderLineColor, cardLineColor, sizeof(SDL_Color)) != 0) {
+            printf("%s doesn't use the same paper, PPI, colors and corners as %s, can't share sheets\n",
+                GANG_ORDER_FILES[o], GANG_ORDER_FILES[0]);
+            fclose(f);
+            return -1;
+        }
+
+        // Leftovers wait in their own list, which fills up as fast as
+        // the slots do: small orders are all leftovers.
+        int wholePages = count/CARDS_PER_PAGE*CARDS_PER_PAGE;
+        if (slot + wholePages + leftoverTotal + (count - wholePages) > MAX_CARDS) {
+            printf("Too many cards in the orders of %s, at most %d\n", listFilename, MAX_CARDS);
+            fclose(f);
+            return -1;
+        }
+        for (int i = 0; i < wholePages; ++i, ++slot) {
+            cards[slot] = orderCards[i];
+            GANG_SLOTS[slot].order = o;
+            GANG_SLOTS[slot].entry = i;
+        }
+
+        leftoverFirst[o] = leftoverTotal;
+        leftoverCount[o] = count - wholePages;
+        for (int i = wholePages; i < count; ++i, ++leftoverTotal) {
+            leftovers[leftoverTotal] = orderCards[i];
+            leftoverSlots[leftoverTotal].order = o;
+            leftoverSlots[leftoverTotal].entry = i;
+        }
+    }
+    fclose(f);
+
+    if (*orderCount == 0) {
+        printf("No orders listed in %s\n", listFilename);
+        return -1;
+    }
+
+    // First fit decreasing. Insertion sort keeps list order among equals.
+    static int byCount[MAX_GANG_ORDERS];
+    for (int o = 0; o < *orderCount; ++o) {
+        int i = o;
+        while (i > 0 && leftoverCount[byCount[i-1]] < leftoverCount[o]) {
+            byCount[i] = byCount[i-1];
+            i--;
+        }
+        byCount[i] = o;
+    }
+
+    static int sheetOf[MAX_GANG_ORDERS];
+    static int sheetFree[MAX_GANG_ORDERS];
+    int sheetCount = 0;
+    for (int k = 0; k < *orderCount; ++k) {
+        int o = byCount[k];
+        if (leftoverCount[o] == 0)
+            continue;
+        int sheet = 0;
+        while (sheet < sheetCount && sheetFree[sheet] < leftoverCount[o])
+            sheet++;
+        if (sheet == sheetCount)
+            sheetFree[sheetCount++] = CARDS_PER_PAGE;
+        sheetOf[o] = sheet;
+        sheetFree[sheet] -= leftoverCount[o];
+    }
+
+    if (slot + sheetCount*CARDS_PER_PAGE > MAX_CARDS) {
+        printf("Too many cards in the orders of %s, at most %d\n", listFilename, MAX_CARDS);
+        return -1;
+    }
+
+    // Lay the sheets out, orders in the order they were packed.
+    for (int sheet = 0; sheet < sheetCount; ++sheet) {
+        int first = slot;
+        for (int k = 0; k < *orderCount; ++k) {
+            int o = byCount[k];
+            if (leftoverCount[o] == 0 || sheetOf[o] != sheet)
+                continue;
+            for (int i = 0; i < leftoverCount[o]; ++i, ++slot) {
+                cards[slot] = leftovers[leftoverFirst[o] + i];
+                GANG_SLOTS[slot] = leftoverSlots[leftoverFirst[o] + i];
+            }
+        }
+        while (slot < first + CARDS_PER_PAGE && sheet+1 < sheetCount) {
+            cards[slot].layerCount = 0;
+            GANG_SLOTS[slot].order = -1;
+            GANG_SLOTS[slot].entry = -1;
+            slot++;
+        }
+    }
+    return slot;
+}
+
+/**
+ * Write which order and entry each slot of each page holds,
+ * for sorting the cut cards back into their orders.
+ */
+bool WriteGangManifest(const char* filename, const CardSpec* cards, int slotCount) {
+    FILE* f = fopen(filename, "w");
+    if (!f) {
+        printf("Couldn't write %s\n", filename);
+        return false;
+    }
+
+    fprintf(f, "page,slot,order,entry,card\n");
+    for (int i = 0; i < slotCount; ++i) {
+        if (cards[i].layerCount == 0)
+            continue;
+        char description[MAX_LINELEN];
+        FormatCardSpec(&cards[i], description, MAX_LINELEN);
+
+        fprintf(f, "%d,%d,\"", i/CARDS_PER_PAGE + 1, i%CARDS_PER_PAGE);
+        for (const char* p = GANG_ORDER_FILES[GANG_SLOTS[i].order]; *p != '\0'; ++p) {
+            if (*p == '"')
+                fputc('"', f);
+            fputc(*p, f);
+        }
+        fprintf(f, "\",%d,\"", GANG_SLOTS[i].entry+1);
+        for (const char* p = description; *p != '\0'; ++p) {
+            if (*p == '"')
+                fputc('"', f);
+            fputc(*p, f);
+        }
+        fprintf(f, "\"\n");
+    }
+
+    return fclose(f) == 0;
+}
+
+/**
+ * Name a page's output file. False if the name doesn't fit in n.
+ */
+bool PageFilename(char* out, size_t n, const char* prefix, int page, const char* extension) {
+    return snprintf(out, n, "%s%02d.%s", prefix, page, extension) < (int)n;
+}
+
+/**
+ * Copy a finished page instead of rendering and encoding it again.
+ */
+bool CopyPageFile(const char* from, const char* to) {
+    static char buffer[1 << 16];
+    FILE* in = fopen(from, "rb");
+    if (!in)
+        return false;
+    FILE* out = fopen(to, "wb");
+    if (!out) {
+        fclose(in);
+        return false;
+    }
+
+    bool ok = true;
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        if (fwrite(buffer, 1, n, out) != n) {
+            ok = false;
+            break;
+        }
+    }
+    ok = ok && !ferror(in);
+    fclose(in);
+    return fclose(out) == 0 && ok;
+}
+
+int ComparePaths(const void* a, const void* b) {
+    return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+/**
+ * Why a card file can't be used, or NULL if it looks fine: it has to
+ * open and have content, and the usual image types have to start with
+ * their signature. Catches missing, empty and mislabeled files without
+ * decoding anything.
+ */
+const char* CheckCardFile(const char* filename) {
+    static const struct { const char* ext; const char* magic; size_t offset; size_t len; const char* reason; } signatures[] = {
+        { "png", "\x89PNG\r\n\x1a\n", 0, 8, "isn't a PNG file" },
+        { "jpg", "\xff\xd8\xff", 0, 3, "isn't a JPEG file" },
+        { "jpeg", "\xff\xd8\xff", 0, 3, "isn't a JPEG file" },
+        { "gif", "GIF8", 0, 4, "isn't a GIF file" },
+        { "bmp", "BM", 0, 2, "isn't a BMP file" },
+        { "webp", "WEBP", 8, 4, "isn't a WebP file" }
+    };
+
+    FILE* f = fopen(filename, "rb");
+    if (!f)
+        return "can't be opened";
+    unsigned char head[16];
+    size_t n = fread(head, 1, sizeof(head), f);
+    fclose(f);
+    if (n == 0)
+        return "is empty";
+
+    const char* dot = strrchr(filename, '.');
+    if (dot == NULL)
+        return NULL;
+    char ext[8] = "";
+    for (int i = 0; i < 7 && dot[i+1] != '\0'; ++i) {
+        ext[i] = (char)tolower((unsigned char)dot[i+1]);
+    }
+    for (size_t i = 0; i < sizeof(signatures)/sizeof(signatures[0]); ++i) {
+        if (strcmp(ext, signatures[i].ext) != 0)
+            continue;
+        if (n < signatures[i].offset + signatures[i].len || memcmp(head + signatures[i].offset, signatures[i].magic, signatures[i].len) != 0)
+            return signatures[i].reason;
+    }
+    return NULL;
+}
+
+/**
+ * Check every distinct card file before the first page is rendered,
+ * listing all the bad ones so they can be fixed in one go.
+ * Returns how many are bad.
+ */
+int PreflightCardFiles(const CardSpec* cards, int cardCount) {
+    static const char* paths[MAX_CARDS*MAX_LAYERS];
+    int pathCount = 0;
+    for (int i = 0; i < cardCount; ++i) {
+        for (int j = 0; j < cards[i].layerCount; ++j) {
+            paths[pathCount++] = cards[i].layers[j].path;
+        }
+    }
+    qsort(paths, pathCount, sizeof(paths[0]), ComparePaths);
+
+    int badCount = 0;
+    for (int i = 0; i < pathCount; ++i) {
+        if (i > 0 && strcmp(paths[i], paths[i-1]) == 0)
+            continue;
+        const char* reason = CheckCardFile(paths[i]);
+        if (reason != NULL) {
+            printf("%s %s\n", paths[i], reason);
+            badCount++;
+        }
+    }
+    return badCount;
+}
+
+int CompareCardFailures(const void* a, const void* b) {
+    const CardFailure* fa = (const CardFailure*)a;
+    const CardFailure* fb = (const CardFailure*)b;
+    if (fa->page != fb->page)
+        return fa->page - fb->page;
+    return fa->slot - fb->slot;
+}
+
+/**
+ * List the cards that couldn't be built, by page and slot.
+ */
+void PrintCardFailures(void) {
+    int count = SDL_AtomicGet(&CARD_FAILURE_COUNT);
+    qsort(CARD_FAILURES, count, sizeof(CARD_FAILURES[0]), CompareCardFailures);
+    printf("Failed cards: %d\n", count);
+    for (int i = 0; i < count; ++i) {
+        printf("  page %02d slot %d: %s\n", CARD_FAILURES[i].page, CARD_FAILURES[i].slot + 1, CARD_FAILURES[i].path);
+    }
+}
+
+/**
+ * Size and hashes of a page file, taken from its bytes as they were written.
+ */
+typedef struct PageChecksum {
+    bool valid;
+    uint64_t bytes;
+    char xxh64[17];
+    char sha256[65];
+} PageChecksum;
+
+/**
+ * Files written for each page: the print PNG, the JPEG proof or both.
+ */
+enum OutputFormat {
+    outputPNG = 0,
+    outputJPEG,
+    outputFormatCount
+};
+
+static const char* OUTPUT_EXTENSIONS[outputFormatCount] = { "png", "jpg" };
+
+static PageChecksum PAGE_CHECKSUMS[MAX_NUM_PAGES][outputFormatCount];
+
+/**
+ * The raster of a page written to the PWG stream, kept
+ * while a later identical page is still to be sent.
+ */
+typedef struct PageBytes {
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+    bool failed;
+} PageBytes;
+
+static PageBytes PWG_PAGES[MAX_NUM_PAGES];
+
+/**
+ * PWG writer sink keeping each byte written.
+ */
+void KeepWrittenBytes(void* ctx, const void* data, size_t size) {
+    PageBytes* bytes = (PageBytes*)ctx;
+    if (bytes->failed)
+        return;
+    if (bytes->size + size > bytes->capacity) {
+        size_t capacity = SDL_max(bytes->capacity*2, bytes->size + size);
+        uint8_t* bigger = (uint8_t*)realloc(bytes->data, capacity);
+        if (!bigger) {
+            bytes->failed = true;
+            return;
+        }
+        bytes->data = bigger;
+        bytes->capacity = capacity;
+    }
+    memcpy(bytes->data + bytes->size, data, size);
+    bytes->size += size;
+}
+
+/**
+ * Whether a page after from is a copy of page.
+ */
+bool PageCopiedAfter(const CardSpec* cards, int cardCount, int pageCount, int page, int from) {
+    for (int later = from+1; later < pageCount; ++later) {
+        if (FindIdenticalPage(cards, cardCount, later) == page)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * PNG encoder sink feeding each byte written into a hash.
+ */
+void HashWrittenBytes(void* ctx, const void* data, size_t size) {
+    output_hash_update((OutputHash*)ctx, data, size);
+}
+
+/**
+ * Reads a file back to hash it, for when its bytes
+ * weren't seen on the way out.
+ */
+bool HashFile(const char* filename, OutputHash* hash) {
+    FILE* f = fopen(filename, "rb");
+    if (!f)
+        return false;
+
+    static unsigned char buffer[1 << 16];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+        output_hash_update(hash, buffer, n);
+    }
+    bool ok = !ferror(f);
+    fclose(f);
+    return ok;
+}
+
+/**
+ * Append a page to the checksum manifest. Files are listed
+ * by name only, since the manifest sits next to them.
+ */
+void WriteChecksumRow(FILE* f, const char* filename, const PageChecksum* sum, int width, int height, int ppi) {
+    const char* name = strrchr(filename, '/');
+    name = name ? name+1 : filename;
+    fprintf(f, "%s,%llu,%d,%d,%d,%s,%s\n", name, (unsigned long long)sum->bytes, width, height, ppi, sum->xxh64, sum->sha256);
+    fflush(f);
+}
+
+/**
+ * Finish the hash of a file just written, keep it
+ * for copies of the page and list it in the manifest.
+ */
+void RecordChecksum(FILE* f, PageChecksum* sum, OutputHash* hash, const char* filename, int width, int height, int ppi) {
+    sum->valid = true;
+    sum->bytes = hash->bytes;
+    output_hash_final(hash, sum->xxh64, sum->sha256);
+    WriteChecksumRow(f, filename, sum, width, height, ppi);
+}
+
+/**
+ * Width and height of an image from its header, without decoding it.
+ * Knows PNG, JPEG, GIF and BMP. Returns false for anything else.
+ */
+bool ReadImageSize(const char* filename, int* w, int* h) {
+    FILE* f = fopen(filename, "rb");
+    if (!f)
+        return false;
+    unsigned char head[32];
+    size_t n = fread(head, 1, sizeof(head), f);
+    bool found = false;
+    if (n >= 24 && memcmp(head, "\x89PNG\r\n\x1a\n", 8) == 0) {
+        *w = (int)((uint32_t)head[16] << 24 | (uint32_t)head[17] << 16 | (uint32_t)head[18] << 8 | head[19]);
+        *h = (int)((uint32_t)head[20] << 24 | (uint32_t)head[21] << 16 | (uint32_t)head[22] << 8 | head[23]);
+        found = true;
+    }
+    else if (n >= 10 && memcmp(head, "GIF8", 4) == 0) {
+        *w = head[6] | head[7] << 8;
+        *h = head[8] | head[9] << 8;
+        found = true;
+    }
+    else if (n >= 26 && head[0] == 'B' && head[1] == 'M') {
+        *w = (int)((uint32_t)head[18] | (uint32_t)head[19] << 8 | (uint32_t)head[20] << 16 | (uint32_t)head[21] << 24);
+        *h = abs((int)((uint32_t)head[22] | (uint32_t)head[23] << 8 | (uint32_t)head[24] << 16 | (uint32_t)head[25] << 24));
+        found = true;
+    }
+    else if (n >= 2 && head[0] == 0xff && head[1] == 0xd8) {
+        // Walk the markers up to the frame header.
+        fseek(f, 2, SEEK_SET);
+        unsigned char marker[9];
+        while (fread(marker, 1, 4, f) == 4 && marker[0] == 0xff) {
+            int type = marker[1];
+            int length = marker[2] << 8 | marker[3];
+            if (type >= 0xc0 && type <= 0xcf && type != 0xc4 && type != 0xc8 && type != 0xcc) {
+                if (fread(marker + 4, 1, 5, f) == 5) {
+                    *h = marker[5] << 8 | marker[6];
+                    *w = marker[7] << 8 | marker[8];
+                    found = true;
+                }
+                break;
+            }
+            if (length < 2 || fseek(f, length - 2, SEEK_CUR) != 0)
+                break;
+        }
+    }
+    fclose(f);
+    return found && *w > 0 && *h > 0;
+}
+
+/**
+ * Count the work of a job for the cost model, from the config and
+ * the card files' headers. Each distinct card file is assumed to be
+ * decoded once, which holds while the layer cache is large enough.
+ */
+void MeasureJob(CostJob* job, const CardSpec* cards, int cardCount, int pageCount, enum PPI ppi, enum PaperSize paperSize,
+    const bool outputs[outputFormatCount], int cacheMB, int prefetchPages) {
+    static const char* paths[MAX_CARDS*MAX_LAYERS];
+    int pathCount = 0;
+    CardShape card = GetCardShape(ppi);
+    double cardPixels = (double)card.w*card.h;
+    double pagePixels = (double)PageWidth(ppi, paperSize)*PageHeight(ppi, paperSize);
+
+    memset(job, 0, sizeof(*job));
+    for (int page = 0; page < pageCount; ++page) {
+        if (FindIdenticalPage(cards, cardCount, page) >= 0)
+            continue;
+        job->pages_rendered++;
+        for (int i = page*CARDS_PER_PAGE; i < cardCount && i < (page+1)*CARDS_PER_PAGE; ++i) {
+            job->px[costCompose] += cards[i].layerCount*cardPixels;
+            for (int j = 0; j < cards[i].layerCount; ++j) {
+                paths[pathCount++] = cards[i].layers[j].path;
+            }
+        }
+    }
+    qsort(paths, pathCount, sizeof(paths[0]), ComparePaths);
+
+    double fileBytes = 0;
+    double layerBytes = 0;
+    for (int i = 0; i < pathCount; ++i) {
+        if (i > 0 && strcmp(paths[i], paths[i-1]) == 0)
+            continue;
+        int w = 0, h = 0;
+        double bytes = (double)FileSize(paths[i]);
+        // Unknown formats: about as many pixels as bytes, like a PNG of card art.
+        double pixels = ReadImageSize(paths[i], &w, &h) ? (double)w*h : bytes;
+        job->px[costDecode] += pixels;
+        job->px[costScale] += pixels;
+        fileBytes += bytes;
+        layerBytes += cardPixels*4;
+
+        // The source and its ARGB copy, unless it's streamed into its mip level.
+        double loadBytes = pixels > STREAM_DECODE_PIXELS ? cardPixels*4*4 : pixels*4*2;
+        if (loadBytes > job->load_bytes)
+            job->load_bytes = loadBytes;
+    }
+
+    for (int f = 0; f < outputFormatCount; ++f) {
+        if (!outputs[f])
+            continue;
+        job->px[f == outputPNG ? costEncodePNG : costEncodeJPEG] = job->pages_rendered*pagePixels;
+        job->output_px[f == outputPNG ? costOutputPNG : costOutputJPEG] = pageCount*pagePixels;
+    }
+    job->max_parallel = CARDS_PER_PAGE;
+    job->page_bytes = pagePixels*4;
+    job->cache_bytes = SDL_min(layerBytes, (double)cacheMB*1024*1024);
+    // The prefetcher holds the batch being rendered and the next one.
+    if (job->pages_rendered > 0)
+        job->prefetch_bytes = SDL_min(fileBytes, fileBytes/job->pages_rendered*prefetchPages*2);
+}
+
+/**
+ * Print a cost estimate, one value per line for a scheduler to read.
+ */
+void PrintEstimate(const CostEstimate* estimate, const CostModel* model, const char* modelFilename, int threadCount) {
+    if (model->runs > 0)
+        printf("Estimate for %d threads, from %s (%d runs):\n", threadCount, modelFilename, model->runs);
+    else
+        printf("Estimate for %d threads, uncalibrated:\n", threadCount);
+    printf("wall_seconds %.2f\n", estimate->wall_s);
+    printf("cpu_seconds %.2f\n", estimate->cpu_s);
+    printf("peak_rss_mb %.0f\n", estimate->rss_mb);
+    printf("output_bytes %.0f\n", estimate->output_bytes);
+}
+
+/**
+ * How far off an estimate was, in percent of the actual value.
+ */
+double EstimateError(double estimated, double actual) {
+    return actual > 0 ? 100.0*(estimated - actual)/actual : 0.0;
+}
+
+static const int PNG_STRATEGIES[] = { Z_DEFAULT_STRATEGY, Z_FILTERED, Z_RLE };
+static const char* PNG_STRATEGY_NAMES[] = { "default", "filtered", "rle" };
+
+const char* PngStrategyName(int strategy) {
+    for (size_t i = 0; i < sizeof(PNG_STRATEGIES)/sizeof(PNG_STRATEGIES[0]); ++i) {
+        if (PNG_STRATEGIES[i] == strategy)
+            return PNG_STRATEGY_NAMES[i];
+    }
+    return "default";
+}
+
+/**
+ * Adds the settings of a calibration run to the base command line
+ * and runs it TUNE_REPEATS times. The fastest run is kept in result.
+ */
+bool TuneMeasure(const char* baseCommand, const TuneProfile* settings, int pages, TuneResult* result) {
+    char command[8192];
+    snprintf(command, sizeof(command), "%s --threads %d --prefetch-pages %d --jpeg-band-rows %d --png-level %d --png-strategy %s --pages %d",
+        baseCommand, settings->threads, settings->prefetch_pages, settings->jpeg_band_rows,
+        settings->png_level, PngStrategyName(settings->png_strategy), pages);
+    printf("threads %d, prefetch %d, JPEG band rows %d, PNG level %d %s: ", settings->threads, settings->prefetch_pages,
+        settings->jpeg_band_rows, settings->png_level, PngStrategyName(settings->png_strategy));
+    fflush(stdout);
+
+    bool measured = false;
+    for (int i = 0; i < TUNE_REPEATS; ++i) {
+        TuneResult run;
+        int runResult = tune_run(command, &run);
+        if (runResult != 0) {
+            printf("failed (code %d)\n", runResult);
+            return false;
+        }
+        if (!measured || run.pages_per_s > result->pages_per_s)
+            *result = run;
+        measured = true;
+    }
+    printf("%.2f pages/s, %llu bytes, peak RSS %.0f MB\n", result->pages_per_s, result->bytes, result->rss_mb);
+    return true;
+}
+
+/**
+ * Whether a calibration run did better than the best so far: it has to stay
+ * under the memory limit and, unless the best so far didn't, be faster.
+ * A couple of percent is within the noise between runs.
+ */
+bool TuneBetter(const TuneResult* candidate, const TuneResult* best, int memoryLimitMB) {
+    bool fits = candidate->rss_mb <= memoryLimitMB;
+    bool bestFits = best->rss_mb <= memoryLimitMB;
+    if (!fits)
+        return false;
+    return !bestFits || candidate->pages_per_s > best->pages_per_s * 1.02;
+}
+
+/**
+ * Runs short renders of the first few pages of the input with this binary,
+ * searching one setting at a time for the most pages per second under the
+ * memory limit, and saves the best settings as the host's tuning profile.
+ * The options given are passed on to every run, except those being tuned
+ * and those that only report on a run.
+ */
+int Autotune(int argc, char* argv[], char* params[], int paramCount, const char* outputPrefix, const TuneProfile* defaults,
+    const bool outputs[outputFormatCount], bool bandEncoder, bool pwgOutput, int pages, int memoryLimitMB, const char* profileFilename) {
+    static const char* skippedWithValue[] = {
+        "--threads", "--prefetch-pages", "--jpeg-band-rows", "--png-level", "--png-strategy", "--pages",
+        "--tune-profile", "--memory-limit-mb", "--metrics-listen", "--cost-model", "--pwg-raster"
+    };
+    static const char* skipped[] = { "--autotune", "--stats", "--perf-counters", "--checksums", "--sha256" };
+
+    char tunePrefix[MAX_PATHLEN];
+    snprintf(tunePrefix, sizeof(tunePrefix), "%s_tune", outputPrefix);
+    if (strlen(tunePrefix) >= OUTPUT_PATHLEN) {
+        printf("Path of output must be less than %d for --autotune\n", OUTPUT_PATHLEN - 5);
+        return 1;
+    }
+
+    char baseCommand[8192] = "";
+    bool quoted = tune_append_arg(baseCommand, sizeof(baseCommand), argv[0]) == 0
+        && tune_append_arg(baseCommand, sizeof(baseCommand), params[1]) == 0
+        && tune_append_arg(baseCommand, sizeof(baseCommand), tunePrefix) == 0;
+    for (int i = 3; i < paramCount && quoted; ++i) {
+        quoted = tune_append_arg(baseCommand, sizeof(baseCommand), params[i]) == 0;
+    }
+    for (int i = 1; i < argc && quoted; ++i) {
+        bool positional = false;
+        for (int j = 1; j < paramCount; ++j) {
+            positional = positional || argv[i] == params[j];
+        }
+        bool skip = positional;
+        for (size_t j = 0; j < sizeof(skippedWithValue)/sizeof(skippedWithValue[0]) && !skip; ++j) {
+            if (strcmp(argv[i], skippedWithValue[j]) == 0) {
+                skip = true;
+                i++;
+            }
+        }
+        for (size_t j = 0; j < sizeof(skipped)/sizeof(skipped[0]) && !skip; ++j) {
+            skip = strcmp(argv[i], skipped[j]) == 0;
+        }
+        if (!skip)
+            quoted = tune_append_arg(baseCommand, sizeof(baseCommand), argv[i]) == 0;
+    }
+    // The runs are measured from defaults, not from an older profile,
+    // and raster goes to a file rather than the printer.
+    quoted = quoted && tune_append_arg(baseCommand, sizeof(baseCommand), "--tune-profile") == 0
+        && tune_append_arg(baseCommand, sizeof(baseCommand), "none") == 0;
+    char pwgFilename[MAX_PATHLEN + 16];
+    sprintf(pwgFilename, "%s.pwg", tunePrefix);
+    if (pwgOutput) {
+        quoted = quoted && tune_append_arg(baseCommand, sizeof(baseCommand), "--pwg-raster") == 0
+            && tune_append_arg(baseCommand, sizeof(baseCommand), pwgFilename) == 0;
+    }
+    if (!quoted) {
+        printf("Command line too long for --autotune\n");
+        return 1;
+    }
+
+    printf("Tuning on %d page%s, peak RSS limit %d MB\n", pages, pages == 1 ? "" : "s", memoryLimitMB);
+
+    // The defaults first. The first run also reads the card files into
+    // the page cache, and only the fastest of a setting's runs counts.
+    TuneProfile best = *defaults;
+    TuneResult bestResult;
+    if (!TuneMeasure(baseCommand, &best, pages, &bestResult)) {
+        printf("Couldn't run %s\n", argv[0]);
+        return 1;
+    }
+
+    // One setting at a time, each from the best of the ones before.
+    // Threads: powers of two and the CPU count, up to twice that.
+    int cpuCount = SDL_GetCPUCount();
+    for (int t = 1; t <= 2*cpuCount; t = t < cpuCount && t*2 > cpuCount ? cpuCount : t*2) {
+        TuneProfile candidate = best;
+        TuneResult result;
+        candidate.threads = t;
+        if (t != best.threads && TuneMeasure(baseCommand, &candidate, pages, &result) && TuneBetter(&result, &bestResult, memoryLimitMB)) {
+            best = candidate;
+            bestResult = result;
+        }
+    }
+
+    static const int prefetchDepths[] = { 0, 1, 2, 4, 8 };
+    for (size_t i = 0; i < sizeof(prefetchDepths)/sizeof(prefetchDepths[0]); ++i) {
+        TuneProfile candidate = best;
+        TuneResult result;
+        candidate.prefetch_pages = prefetchDepths[i];
+        if (prefetchDepths[i] != best.prefetch_pages && TuneMeasure(baseCommand, &candidate, pages, &result) && TuneBetter(&result, &bestResult, memoryLimitMB)) {
+            best = candidate;
+            bestResult = result;
+        }
+    }
+
+    if (outputs[outputJPEG]) {
+        static const int bandRows[] = { 1, 2, 4, 8, 16 };
+        for (size_t i = 0; i < sizeof(bandRows)/sizeof(bandRows[0]); ++i) {
+            TuneProfile candidate = best;
+            TuneResult result;
+            candidate.jpeg_band_rows = bandRows[i];
+            if (bandRows[i] != best.jpeg_band_rows && TuneMeasure(baseCommand, &candidate, pages, &result) && TuneBetter(&result, &bestResult, memoryLimitMB)) {
+                best = candidate;
+                bestResult = result;
+            }
+        }
+    }
+
+    // Faster deflate settings make larger files; at most 10%
+    // more than the default level is worth the speed.
+    if (outputs[outputPNG] && bandEncoder) {
+        static const int profiles[][2] = {
+            { 1, Z_DEFAULT_STRATEGY }, { 2, Z_DEFAULT_STRATEGY }, { 3, Z_DEFAULT_STRATEGY },
+            { 4, Z_DEFAULT_STRATEGY }, { 1, Z_FILTERED }, { 1, Z_RLE }
+        };
+        unsigned long long maxBytes = bestResult.bytes + bestResult.bytes/10;
+        for (size_t i = 0; i < sizeof(profiles)/sizeof(profiles[0]); ++i) {
+            TuneProfile candidate = best;
+            TuneResult result;
+            candidate.png_level = profiles[i][0];
+            candidate.png_strategy = profiles[i][1];
+            if (candidate.png_level == best.png_level && candidate.png_strategy == best.png_strategy)
+                continue;
+            if (TuneMeasure(baseCommand, &candidate, pages, &result) && result.bytes <= maxBytes && TuneBetter(&result, &bestResult, memoryLimitMB)) {
+                best = candidate;
+                bestResult = result;
+            }
+        }
+    }
+
+    // Only the calibration pages were written.
+    char filename[MAX_PATHLEN + 16];
+    for (int page = 1; page <= pages; ++page) {
+        for (int f = 0; f < outputFormatCount; ++f) {
+            sprintf(filename, "%s%02d.%s", tunePrefix, page, OUTPUT_EXTENSIONS[f]);
+            remove(filename);
+        }
+    }
+    sprintf(filename, "%s_manifest.csv", tunePrefix);
+    remove(filename);
+    sprintf(filename, "%s_order.csv", tunePrefix);
+    remove(filename);
+    if (pwgOutput)
+        remove(pwgFilename);
+
+    if (bestResult.rss_mb > memoryLimitMB) {
+        printf("No settings stayed under %d MB, no tuning profile written\n", memoryLimitMB);
+        return 1;
+    }
+    best.pages_per_s = bestResult.pages_per_s;
+    best.rss_mb = bestResult.rss_mb;
+    if (tune_profile_save(&best, profileFilename) != 0) {
+        printf("Couldn't write the tuning profile to %s\n", profileFilename);
+        return 1;
+    }
+    printf("Best: threads %d, prefetch %d, JPEG band rows %d, PNG level %d %s, %.2f pages/s, peak RSS %.0f MB\n",
+        best.threads, best.prefetch_pages, best.jpeg_band_rows, best.png_level, PngStrategyName(best.png_strategy),
+        best.pages_per_s, best.rss_mb);
+    printf("Tuning profile written to %s\n", profileFilename);
+    return 0;
+}
+
+/**
+ * Samples memory after a page for --memory-check. Layers in the card cache
+ * and rasters kept for later copies are allowed to grow up to their limits,
+ * so they are left out, at the most the cache has held since what it evicts
+ * stays with the allocator; shared cache layers aren't anonymous memory anyway.
+ */
+void SampleMemory(MemWatch* watch, CardCache* cache, bool sharedCaching, int page, bool print) {
+    uint64_t excluded = sharedCaching ? 0 : card_cache_peak_bytes(cache);
+    for (int i = 0; i < MAX_NUM_PAGES; ++i) {
+        excluded += PWG_PAGES[i].size;
+    }
+    mem_watch_sample(watch, excluded);
+    if (print) {
+        const MemSample* sample = &watch->samples[watch->count-1];
+        printf("Page %02d memory: RSS %.1f MB, anonymous %.1f MB, %.1f MB less caches, heap %.1f MB used, %.1f MB free\n",
+            page, sample->rss_mb, sample->anon_mb, sample->level_mb, sample->heap_used_mb, sample->heap_free_mb);
+    }
+}
+
+/**
+ * Print the wall time of each stage and, when hardware
+ * counters were read, what they say about it.
+ */
+void PrintPerfTotals(const char* label, const PerfTotals totals[perfStageCount], bool counters) {
+    printf("%s:", label);
+    for (int s = 0; s < perfStageCount; ++s) {
+        printf(" %s %.1f ms%s", perf_stage_name(s), totals[s].wall_ns/1e6, s+1 < perfStageCount ? "," : "\n");
+    }
+    if (!counters)
+        return;
+
+    for (int s = 0; s < perfStageCount; ++s) {
+        const PerfTotals* t = &totals[s];
+        if (t->calls == 0)
+            continue;
+
+        double cycles = (double)t->counts[perfCycles];
+        double instructions = (double)t->counts[perfInstructions];
+        printf("  %-8s calls %-6llu cycles %-14llu instructions %-14llu IPC %.2f  cache-misses %-12llu (%.2f/kinstr)  branch-misses %llu\n",
+            perf_stage_name(s),
+            (unsigned long long)t->calls,
+            (unsigned long long)t->counts[perfCycles],
+            (unsigned long long)t->counts[perfInstructions],
+            cycles > 0 ? instructions/cycles : 0.0,
+            (unsigned long long)t->counts[perfCacheMisses],
+            instructions > 0 ? 1000.0*t->counts[perfCacheMisses]/instructions : 0.0,
+            (unsigned long long)t->counts[perfBranchMisses]);
+    }
+}
+
+void PrintUsage(void) {
+    printf("Create sheets of cards arranged 3x3.\n");
+    printf("Input is a text file. See the test.txt example.\n");
+    printf("Output will be png [OUTPUT_PREFIX]XX.png. XX is the page number.\n");
+    printf("PAPER_SIZE AND PPI override any values defined in the input file.\n\n");
+    printf("Usage: %s INPUT_FILE [OUTPUT_PREFIX (default \"page\")] [PPI (300|600|1200) (default 300)] [PAPER_SIZE (A4|US) (default US)] [OPTIONS]\n\n", APPNAME());
+    printf("Options:\n");
+    printf("  --threads N     Threads compositing cards (default: number of CPUs)\n");
+    printf("  --cache-mb N    Memory for decoded card layers (default %d)\n", DEFAULT_CACHE_MB);
+    printf("  --prefetch-pages N  Pages of card files read ahead in storage order (default %d, 0 = off)\n", DEFAULT_PREFETCH_PAGES);
+    printf("  --stats         Print the time spent in each stage per page and for the job\n");
+    printf("  --perf-counters Add hardware counters (cycles, instructions, cache and branch misses) to --stats\n");
+    printf("  --gang          INPUT_FILE lists order files, one per line. Their cards share sheets;\n");
+    printf("                  writes [OUTPUT_PREFIX]_manifest.csv mapping each slot to its order.\n");
+    printf("  --reorder       Group identical cards for cache reuse when page order doesn't matter.\n");
+    printf("                  Writes [OUTPUT_PREFIX]_order.csv mapping each entry to its page and slot.\n");
+    printf("  --disk-cache DIR  Keep decoded and scaled card layers in DIR for later runs\n");
+    printf("  --disk-cache-format auto|raw|qoi  How layers are stored in --disk-cache (default auto,\n");
+    printf("                  picked from the measured disk bandwidth and decode speed)\n");
+    printf("  --disk-cache-mb N  Delete the least recently used layers after the run to keep\n");
+    printf("                  --disk-cache under N MB (default %d, 0 = no limit)\n", DEFAULT_DISK_CACHE_MB);
+    printf("  --shared-cache PATH|shm:NAME  Share decoded and scaled card layers with the other\n");
+    printf("                  cardprint processes on this host through a mapped file or shared memory\n");
+    printf("  --shared-cache-mb N  Size of --shared-cache when this run creates it (default %d)\n", DEFAULT_SHARED_CACHE_MB);
+    printf("  --png-encoder bands|sdl  bands (default) compresses the margins above and below the\n");
+    printf("                  cards once and reuses them on every page; sdl uses SDL_image\n");
+    printf("  --output png|jpeg|both|none  Write print PNGs (default), JPEG proofs [OUTPUT_PREFIX]XX.jpg,\n");
+    printf("                  both from the same composed pages, or no files (with --pwg-raster)\n");
+    printf("  --jpeg-quality N  Quality of JPEG proofs, 1-100 (default %d)\n", DEFAULT_JPEG_QUALITY);
+    printf("  --pwg-raster PATH|fd:N|'|COMMAND'  Also stream the pages as PWG raster for a CUPS queue,\n");
+    printf("                  to a file or FIFO, an open file descriptor or a command's input\n");
+    printf("  --on-error lenient|strict  lenient (default) stamps a placeholder into the slot of a card\n");
+    printf("                  that can't be built and lists the failures at the end; strict checks\n");
+    printf("                  every card file before rendering and stops at the first failure\n");
+    printf("  --checksums     Hash each page as it is written and list the hashes, sizes, dimensions\n");
+    printf("                  and PPI in [OUTPUT_PREFIX]_pages.csv\n");
+    printf("  --sha256        Add SHA-256 to --checksums (slower than the default xxh64)\n");
+    printf("  --estimate      Print the predicted wall time, CPU time, peak memory and output size\n");
+    printf("                  from the config and card headers, and exit without rendering\n");
+    printf("  --cost-model FILE  Coefficients for --estimate. A run with it compares the estimate\n");
+    printf("                  to what it measured and folds the measurements into FILE\n");
+    printf("  --memory-check MB  Sample memory after every page and exit with status 2 if it grew\n");
+    printf("                  more than MB after the first quarter of the pages, caches aside\n");
+    printf("  --halftone 1|2  Write print PNGs and PWG raster as 1-bit (or 2-bit PNG) gray for\n");
+    printf("                  monochrome printers; JPEG proofs stay in color\n");
+    printf("  --dither ordered|diffusion  How --halftone thresholds: an 8x8 Bayer matrix (default)\n");
+    printf("                  or error diffusion in bands of %d rows\n", HALFTONE_BAND_ROWS);
+    printf("  --png-level N   Deflate level of print PNGs, 0-9 (default %d, bands encoder only)\n", DEFAULT_PNG_LEVEL);
+    printf("  --png-strategy default|filtered|rle  Deflate strategy of print PNGs (default default)\n");
+    printf("  --jpeg-band-rows N  Rows of 16 pixel blocks per JPEG band handed to a thread (default %d)\n", JPEG_BAND_ROWS);
+    printf("  --pages N       Render only the first N pages\n");
+    printf("  --autotune      Time short renders of the first pages (--pages, default %d) with different\n", DEFAULT_TUNE_PAGES);
+    printf("                  threads, prefetch, JPEG bands and PNG level, and save the fastest as\n");
+    printf("                  this host's tuning profile, which later runs start from\n");
+    printf("  --memory-limit-mb N  Peak memory --autotune keeps under (default half the RAM)\n");
+    printf("  --tune-profile FILE|none  Tuning profile to use or write (default ~/.%s-HOST.tune)\n", APPNAME());
+    printf("  --metrics-listen ADDR  Serve Prometheus metrics while running, on PORT, 127.0.0.1:PORT or unix:PATH\n");
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t startNs = perf_now_ns();
+    clock_t startClock = clock();
+
+    // Options start with "--" and may appear anywhere.
+    // Everything else is a positional parameter.
+    int threadCount = SDL_GetCPUCount();
+    int cacheMB = DEFAULT_CACHE_MB;
+    bool reorder = false;
+    bool gang = false;
+    bool bandEncoder = true;
+    int prefetchPages = DEFAULT_PREFETCH_PAGES;
+    bool stats = false;
+    bool perfCounters = false;
+    bool checksums = false;
+    bool sha256 = false;
+    bool strict = false;
+    bool outputs[outputFormatCount] = { true, false };
+    int jpegQuality = DEFAULT_JPEG_QUALITY;
+    const char* metricsAddress = NULL;
+    bool estimateOnly = false;
+    const char* costModelFilename = NULL;
+    const char* diskCacheDir = NULL;
+    ScaledCacheFormat diskCacheFormat = scaledCacheAuto;
+    int diskCacheMB = DEFAULT_DISK_CACHE_MB;
+    const char* sharedCacheName = NULL;
+    int sharedCacheMB = DEFAULT_SHARED_CACHE_MB;
+    const char* pwgDestination = NULL;
+    int memoryCheckMB = -1;
+    int halftoneBits = 0;
+    HalftoneMethod ditherMethod = halftoneOrdered;
+    int pngLevel = DEFAULT_PNG_LEVEL;
+    int pngStrategy = Z_DEFAULT_STRATEGY;
+    int jpegBandRows = JPEG_BAND_ROWS;
+    int pageLimit = 0;
+    bool autotune = false;
+    int memoryLimitMB = SDL_GetSystemRAM()/2;
+
+    // This host's tuning profile replaces the defaults above,
+    // and options on the command line replace it in turn.
+    const char* tuneProfileFilename = NULL;
+    char defaultTuneFilename[512];
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--tune-profile") == 0 && i+1 < argc)
+            tuneProfileFilename = argv[++i];
+        else if (strcmp(argv[i], "--autotune") == 0)
+            autotune = true;
+    }
+    if (tuneProfileFilename == NULL && tune_default_path(defaultTuneFilename, sizeof(defaultTuneFilename), APPNAME()) == 0)
+        tuneProfileFilename = defaultTuneFilename;
+    if (tuneProfileFilename != NULL && strcmp(tuneProfileFilename, "none") == 0)
+        tuneProfileFilename = NULL;
+    TuneProfile tuneProfile = { threadCount, prefetchPages, jpegBandRows, pngLevel, pngStrategy, 0, 0 };
+    if (!autotune && tuneProfileFilename != NULL && tune_profile_load(&tuneProfile, tuneProfileFilename) == 0) {
+        printf("Using tuning profile %s\n", tuneProfileFilename);
+        threadCount = tuneProfile.threads;
+        prefetchPages = tuneProfile.prefetch_pages;
+        jpegBandRows = tuneProfile.jpeg_band_rows;
+        pngLevel = tuneProfile.png_level;
+        pngStrategy = tuneProfile.png_strategy;
+    }
+
+    char* params[5] = { argv[0] };
+    int paramCount = 1;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--threads") == 0 && i+1 < argc) {
+            threadCount = strtol(argv[++i], NULL, 10);
+            if (threadCount < 1) {
+                printf("--threads must be at least 1\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--cache-mb") == 0 && i+1 < argc) {
+            cacheMB = strtol(argv[++i], NULL, 10);
+            if (cacheMB < 0) {
+                printf("--cache-mb can't be negative\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--prefetch-pages") == 0 && i+1 < argc) {
+            prefetchPages = strtol(argv[++i], NULL, 10);
+            if (prefetchPages < 0) {
+                printf("--prefetch-pages can't be negative\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--stats") == 0) {
+            stats = true;
+        }
+        else if (strcmp(argv[i], "--perf-counters") == 0) {
+            stats = true;
+            perfCounters = true;
+        }
+        else if (strcmp(argv[i], "--reorder") == 0) {
+            reorder = true;
+        }
+        else if (strcmp(argv[i], "--gang") == 0) {
+            gang = true;
+        }
+        else if (strcmp(argv[i], "--png-encoder") == 0 && i+1 < argc) {
+            const char* encoder = argv[++i];
+            if (strcmp(encoder, "bands") == 0)
+                bandEncoder = true;
+            else if (strcmp(encoder, "sdl") == 0)
+                bandEncoder = false;
+            else {
+                printf("--png-encoder must be bands or sdl\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--disk-cache") == 0 && i+1 < argc) {
+            diskCacheDir = argv[++i];
+        }
+        else if (strcmp(argv[i], "--disk-cache-format") == 0 && i+1 < argc) {
+            const char* format = argv[++i];
+            if (strcmp(format, "auto") == 0)
+                diskCacheFormat = scaledCacheAuto;
+            else if (strcmp(format, "raw") == 0)
+                diskCacheFormat = scaledCacheRaw;
+            else if (strcmp(format, "qoi") == 0)
+                diskCacheFormat = scaledCacheQOI;
+            else {
+                printf("--disk-cache-format must be auto, raw or qoi\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--disk-cache-mb") == 0 && i+1 < argc) {
+            diskCacheMB = strtol(argv[++i], NULL, 10);
+            if (diskCacheMB < 0) {
+                printf("--disk-cache-mb can't be negative\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--estimate") == 0) {
+            estimateOnly = true;
+        }
+        else if (strcmp(argv[i], "--cost-model") == 0 && i+1 < argc) {
+            costModelFilename = argv[++i];
+        }
+        else if (strcmp(argv[i], "--shared-cache") == 0 && i+1 < argc) {
+            sharedCacheName = argv[++i];
+        }
+        else if (strcmp(argv[i], "--shared-cache-mb") == 0 && i+1 < argc) {
+            sharedCacheMB = strtol(argv[++i], NULL, 10);
+            if (sharedCacheMB < 8) {
+                printf("--shared-cache-mb must be at least 8\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--output") == 0 && i+1 < argc) {
+            const char* output = argv[++i];
+            outputs[outputPNG] = strcmp(output, "png") == 0 || strcmp(output, "both") == 0;
+            outputs[outputJPEG] = strcmp(output, "jpeg") == 0 || strcmp(output, "both") == 0;
+            if (!outputs[outputPNG] && !outputs[outputJPEG] && strcmp(output, "none") != 0) {
+                printf("--output must be png, jpeg, both or none\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--jpeg-quality") == 0 && i+1 < argc) {
+            jpegQuality = strtol(argv[++i], NULL, 10);
+            if (jpegQuality < 1 || jpegQuality > 100) {
+                printf("--jpeg-quality must be between 1 and 100\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--on-error") == 0 && i+1 < argc) {
+            const char* mode = argv[++i];
+            if (strcmp(mode, "lenient") == 0)
+                strict = false;
+            else if (strcmp(mode, "strict") == 0)
+                strict = true;
+            else {
+                printf("--on-error must be lenient or strict\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--checksums") == 0) {
+            checksums = true;
+        }
+        else if (strcmp(argv[i], "--sha256") == 0) {
+            checksums = true;
+            sha256 = true;
+        }
+        else if (strcmp(argv[i], "--metrics-listen") == 0 && i+1 < argc) {
+            metricsAddress = argv[++i];
+        }
+        else if (strcmp(argv[i], "--pwg-raster") == 0 && i+1 < argc) {
+            pwgDestination = argv[++i];
+        }
+        else if (strcmp(argv[i], "--memory-check") == 0 && i+1 < argc) {
+            memoryCheckMB = strtol(argv[++i], NULL, 10);
+            if (memoryCheckMB < 0) {
+                printf("--memory-check can't be negative\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--halftone") == 0 && i+1 < argc) {
+            halftoneBits = strtol(argv[++i], NULL, 10);
+            if (halftoneBits != 1 && halftoneBits != 2) {
+                printf("--halftone must be 1 or 2\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--dither") == 0 && i+1 < argc) {
+            const char* method = argv[++i];
+            if (strcmp(method, "ordered") == 0)
+                ditherMethod = halftoneOrdered;
+            else if (strcmp(method, "diffusion") == 0)
+                ditherMethod = halftoneDiffusion;
+            else {
+                printf("--dither must be ordered or diffusion\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--png-level") == 0 && i+1 < argc) {
+            pngLevel = strtol(argv[++i], NULL, 10);
+            if (pngLevel < 0 || pngLevel > 9) {
+                printf("--png-level must be between 0 and 9\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--png-strategy") == 0 && i+1 < argc) {
+            const char* strategy = argv[++i];
+            size_t s = 0;
+            while (s < sizeof(PNG_STRATEGY_NAMES)/sizeof(PNG_STRATEGY_NAMES[0]) && strcmp(strategy, PNG_STRATEGY_NAMES[s]) != 0)
+                s++;
+            if (s == sizeof(PNG_STRATEGY_NAMES)/sizeof(PNG_STRATEGY_NAMES[0])) {
+                printf("--png-strategy must be default, filtered or rle\n");
+                exit(1);
+            }
+            pngStrategy = PNG_STRATEGIES[s];
+        }
+        else if (strcmp(argv[i], "--jpeg-band-rows") == 0 && i+1 < argc) {
+            jpegBandRows = strtol(argv[++i], NULL, 10);
+            if (jpegBandRows < 1) {
+                printf("--jpeg-band-rows must be at least 1\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--pages") == 0 && i+1 < argc) {
+            pageLimit = strtol(argv[++i], NULL, 10);
+            if (pageLimit < 1) {
+                printf("--pages must be at least 1\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--autotune") == 0) {
+            autotune = true;
+        }
+        else if (strcmp(argv[i], "--memory-limit-mb") == 0 && i+1 < argc) {
+            memoryLimitMB = strtol(argv[++i], NULL, 10);
+            if (memoryLimitMB < 1) {
+                printf("--memory-limit-mb must be at least 1\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--tune-profile") == 0 && i+1 < argc) {
+            // Read before the other options.
+            i++;
+        }
+        else if (strncmp(argv[i], "--", 2) == 0) {
+            printf("Unknown or incomplete option: %s\n\n", argv[i]);
+            PrintUsage();
+            exit(1);
+        }
+        else if (paramCount < 5) {
+            params[paramCount++] = argv[i];
+        }
+    }
+
+    if (paramCount < 2) {
+        PrintUsage();
+        exit(1);
+    }
+
+    if (strlen(params[1]) >= MAX_PATHLEN) {
+        printf("Path of input must be less than %d\n", MAX_PATHLEN);
+        exit(1);
+    }
+    char* inputFilename = params[1];
+
+    char outputPrefix[OUTPUT_PATHLEN-1] = "page";
+    if (paramCount >= 3) {
+        if (strlen(params[2]) >= OUTPUT_PATHLEN) {
             printf("Path of output must be less than %d\n", OUTPUT_PATHLEN);
             exit(1);
         }
-        strncpy(outputPrefix, argv[2], OUTPUT_PATHLEN-1);
+        strncpy(outputPrefix, params[2], OUTPUT_PATHLEN-1);
     }
     
     char globalPPI[PPI_PARAM_LEN] = "";
-    if (argc >= 4) {
-        if (strlen(argv[3]) >= PPI_PARAM_LEN) {
-            printf("PPI is invalid: %s.\nOnly 300, 600, 1200 are accepted.", argv[3]);
+    if (paramCount >= 4) {
+        if (strlen(params[3]) >= PPI_PARAM_LEN) {
+            printf("PPI is invalid: %s.\nOnly 300, 600, 1200 are accepted.", params[3]);
             exit(1);
         }
-        strncpy(globalPPI, argv[3], PPI_PARAM_LEN);
+        strncpy(globalPPI, params[3], PPI_PARAM_LEN);
     }
 
     char globalPaperSize[PAPERSIZE_PARAM_LEN] = "";
-    if (argc >= 5) {
-        if (strlen(argv[4]) >= PAPERSIZE_PARAM_LEN) {
-            printf("Paper size is invalid: %s.\nOnly US and A4 are accepted.", argv[4]);
+    if (paramCount >= 5) {
+        if (strlen(params[4]) >= PAPERSIZE_PARAM_LEN) {
+            printf("Paper size is invalid: %s.\nOnly US and A4 are accepted.", params[4]);
             exit(1);
         }
-        strncpy(globalPaperSize, argv[4], PAPERSIZE_PARAM_LEN);
+        strncpy(globalPaperSize, params[4], PAPERSIZE_PARAM_LEN);
     }
     
     enum PPI ppi = ppi600;
@@ -815,13 +3121,49 @@ int main(int argc, char *argv[]) {
     int roundedCorners = 0;
     enum PaperSize paperSize = paperUS;
 
+    if (gang && reorder) {
+        printf("--gang and --reorder can't be used together\n");
+        exit(1);
+    }
+    if (!outputs[outputPNG] && !outputs[outputJPEG] && pwgDestination == NULL) {
+        printf("--output none needs --pwg-raster\n");
+        exit(1);
+    }
+    if (halftoneBits > 0 && !outputs[outputPNG] && pwgDestination == NULL) {
+        printf("--halftone applies to PNG and PWG raster output\n");
+        exit(1);
+    }
+    if (halftoneBits > 0 && outputs[outputPNG] && !bandEncoder) {
+        printf("--halftone needs --png-encoder bands\n");
+        exit(1);
+    }
+    if (halftoneBits == 2 && pwgDestination != NULL) {
+        printf("PWG raster has no 2-bit gray; use --halftone 1 with --pwg-raster\n");
+        exit(1);
+    }
+    if (autotune && estimateOnly) {
+        printf("--autotune and --estimate can't be used together\n");
+        exit(1);
+    }
+    if (autotune && tuneProfileFilename == NULL) {
+        printf("--autotune needs a --tune-profile file to write\n");
+        exit(1);
+    }
+
     printf("Loading %s\n", inputFilename);
-    int cardCount = LoadConfig(inputFilename, &ppi, &cardBGColor, &cardLines, &roundedCorners, &paperSize, CARD_IMAGE_FILENAMES);
+    int cardCount;
+    int orderCount = 0;
+    if (gang)
+        cardCount = LoadGang(inputFilename, &ppi, &cardBGColor, &cardLines, &roundedCorners, &paperSize, CARD_SPECS, &orderCount);
+    else
+        cardCount = LoadConfig(inputFilename, &ppi, &cardBGColor, &cardLines, &roundedCorners, &paperSize, CARD_SPECS);
     assert(cardCount <= MAX_CARDS);
     if (cardCount == -1) {
         printf("Config error. Check %s\n", inputFilename);
         exit(1);
     }
+    if (pageLimit > 0 && cardCount > pageLimit*CARDS_PER_PAGE)
+        cardCount = pageLimit*CARDS_PER_PAGE;
 
     // Override paper size with command-line parameter.
     if (strlen(globalPaperSize) > 0) {
@@ -855,17 +3197,358 @@ int main(int argc, char *argv[]) {
     int pageCount = cardCount/CARDS_PER_PAGE + (cardCount%CARDS_PER_PAGE == 0 ? 0 : 1);
     printf("Generating %d pages\n", pageCount);
 
-    SDL_Surface* page = SDL_CreateRGBSurface(0, PageWidth(ppi,paperSize), PageHeight(ppi,paperSize), 32, 0, 0, 0, 0);
+    if (autotune) {
+        TuneProfile defaults = { threadCount, prefetchPages, jpegBandRows, pngLevel, pngStrategy, 0, 0 };
+        int tunePages = SDL_min(pageLimit > 0 ? pageLimit : DEFAULT_TUNE_PAGES, pageCount);
+        exit(Autotune(argc, argv, params, paramCount, outputPrefix, &defaults, outputs, bandEncoder, pwgDestination != NULL, tunePages, memoryLimitMB, tuneProfileFilename));
+    }
+
+    if (gang && !estimateOnly) {
+        char manifestFilename[MAX_PATHLEN + 16];
+        sprintf(manifestFilename, "%s_manifest.csv", outputPrefix);
+        if (!WriteGangManifest(manifestFilename, CARD_SPECS, cardCount)) {
+            exit(1);
+        }
+        printf("Ganged %d orders onto %d pages. Manifest written to %s\n", orderCount, pageCount, manifestFilename);
+    }
+
+    if (reorder) {
+        static int order[MAX_CARDS];
+        ReorderCards(CARD_SPECS, cardCount, order);
+
+        if (!estimateOnly) {
+            char mappingFilename[MAX_PATHLEN + 16];
+            sprintf(mappingFilename, "%s_order.csv", outputPrefix);
+            if (!WriteOrderMapping(mappingFilename, CARD_SPECS, order, cardCount)) {
+                exit(1);
+            }
+            printf("Reordered cards. Mapping written to %s\n", mappingFilename);
+        }
+    }
+
+    // Predicted before anything is rendered, so the run
+    // can say afterwards how far off the prediction was.
+    CostModel costModel;
+    CostJob costJob;
+    CostEstimate estimate;
+    if (estimateOnly || costModelFilename != NULL) {
+        if (costModelFilename == NULL || cost_model_load(&costModel, costModelFilename) != 0)
+            cost_model_defaults(&costModel);
+        MeasureJob(&costJob, CARD_SPECS, cardCount, pageCount, ppi, paperSize, outputs, cacheMB, prefetchPages);
+        cost_estimate(&costModel, &costJob, threadCount, &estimate);
+        if (estimateOnly) {
+            PrintEstimate(&estimate, &costModel, costModelFilename, threadCount);
+            exit(0);
+        }
+    }
+
+    if (strict) {
+        int badCount = PreflightCardFiles(CARD_SPECS, cardCount);
+        if (badCount > 0) {
+            printf("%d card file%s can't be used, nothing rendered\n", badCount, badCount == 1 ? "" : "s");
+            exit(1);
+        }
+    }
+
+    // Errors from here on exit(1) without undoing the setup before them:
+    // memory, threads and open files go with the process, a PWG command
+    // sees the end of its input, and a socket left at a metrics Unix path
+    // is replaced by the next run. --memory-check and leak checks are
+    // about runs that get to the end, which free everything.
+
+    // Transfers check pages against these hashes instead of reading
+    // every file again; rows are flushed as each page is done.
+    FILE* checksumFile = NULL;
+    char checksumFilename[MAX_PATHLEN + 16];
+    if (checksums) {
+        sprintf(checksumFilename, "%s_pages.csv", outputPrefix);
+        checksumFile = fopen(checksumFilename, "w");
+        if (!checksumFile) {
+            printf("Couldn't write %s\n", checksumFilename);
+            exit(1);
+        }
+        fprintf(checksumFile, "file,bytes,width,height,ppi,xxh64,sha256\n");
+    }
+
+    // Cards are composited straight into the page pixels,
+    // which expects the page to be RGB888.
+    SDL_Surface* page = SDL_CreateRGBSurfaceWithFormat(0, PageWidth(ppi,paperSize), PageHeight(ppi,paperSize), 32, SDL_PIXELFORMAT_RGB888);
     SDL_Renderer* renderer = SDL_CreateSoftwareRenderer(page);
+
+    // Monochrome pages are thresholded once, in bands over the
+    // threads, for both the PNG and the raster.
+    Halftone halftone;
+    bool halftoning = halftoneBits > 0;
+    if (halftoning && halftone_init(&halftone, page->w, page->h, halftoneBits, ditherMethod, threadCount) != 0) {
+        printf("Couldn't set up halftoning\n");
+        exit(1);
+    }
+
+    // Rows above the first card row and below the last one only hold
+    // margins and guide lines, the same on every page. Two rows are left
+    // to the cards for the rounded corners drawn just outside them.
+    // The encoder writes the DPI itself and hashes what it writes.
+    PngBandEncoder pngBands;
+    OutputHash pageHash;
+    bandEncoder = bandEncoder && outputs[outputPNG];
+    if (bandEncoder) {
+        CardShape firstCard = CardPlacement(0, ppi, paperSize);
+        CardShape lastCard = CardPlacement(CARDS_PER_PAGE-1, ppi, paperSize);
+        int top = firstCard.y - 2;
+        int bottom = lastCard.y + lastCard.h + 2;
+        int initResult = halftoning
+            ? png_bands_init_gray(&pngBands, page->w, page->h, top, bottom, ppi, pngLevel, halftoneBits)
+            : png_bands_init(&pngBands, page->w, page->h, top, bottom, ppi, pngLevel);
+        if (initResult != 0) {
+            printf("Couldn't set up the PNG encoder\n");
+            exit(1);
+        }
+        pngBands.strategy = pngStrategy;
+        if (checksums) {
+            pngBands.sink = HashWrittenBytes;
+            pngBands.sink_ctx = &pageHash;
+        }
+    }
+
+    // Proofs are encoded from the same page pixels, in bands
+    // of rows spread over the compositing threads.
+    JpegEncoder jpeg;
+    OutputHash proofHash;
+    if (outputs[outputJPEG]) {
+        if (jpeg_init(&jpeg, page->w, page->h, jpegQuality, ppi, threadCount, jpegBandRows) != 0) {
+            printf("Couldn't set up the JPEG encoder\n");
+            exit(1);
+        }
+        if (checksums) {
+            jpeg.sink = HashWrittenBytes;
+            jpeg.sink_ctx = &proofHash;
+        }
+    }
+
+    // The raster for the print queue is one stream of every page,
+    // written from the same page pixels as each page is done.
+    PwgWriter pwg;
+    bool pwgOutput = pwgDestination != NULL;
+    const char* pwgSizeName = paperSize == paperA4 ? "iso_a4_210x297mm" : "na_letter_8.5x11in";
+    if (pwgOutput && pwg_open(&pwg, pwgDestination, pageCount) != 0) {
+        printf("Couldn't write PWG raster to %s\n", pwgDestination);
+        exit(1);
+    }
+
+    CardCache cardCache;
+    if (card_cache_init(&cardCache, (size_t)cacheMB*1024*1024) != 0) {
+        printf("Couldn't create the card cache: %s\n", SDL_GetError());
+        exit(1);
+    }
     
+    ScaledCache scaledCache;
+    bool diskCaching = diskCacheDir != NULL;
+    if (diskCaching && scaled_cache_init(&scaledCache, diskCacheDir, diskCacheFormat) != 0) {
+        printf("Couldn't use %s as the disk cache\n", diskCacheDir);
+        exit(1);
+    }
+
+    // Layers scaled by any cardprint process on this host, for all of them.
+    ShmCache sharedCache;
+    bool sharedCaching = sharedCacheName != NULL;
+    int sharedResult = sharedCaching ? shm_cache_open(&sharedCache, sharedCacheName, (size_t)sharedCacheMB*1024*1024) : 0;
+    if (sharedResult == 4) {
+        printf("Couldn't use %s as the shared cache: not one this version of cardprint made; remove it to start afresh\n", sharedCacheName);
+        exit(1);
+    }
+    else if (sharedResult != 0) {
+        printf("Couldn't use %s as the shared cache: %s\n", sharedCacheName, strerror(errno));
+        exit(1);
+    }
+
+    // Read the card files of the next few pages in the order they are
+    // stored on disk, while the pages are still rendered in order.
+    Prefetcher prefetcher;
+    bool prefetching = prefetchPages > 0 && prefetch_init(&prefetcher, prefetchPages) == 0;
+    if (prefetching) {
+        for (int page = 0; page < pageCount; ++page) {
+            if (FindIdenticalPage(CARD_SPECS, cardCount, page) >= 0)
+                continue;
+            for (int i = page*CARDS_PER_PAGE; i < cardCount && i < (page+1)*CARDS_PER_PAGE; ++i) {
+                for (int j = 0; j < CARD_SPECS[i].layerCount; ++j) {
+                    prefetch_add(&prefetcher, CARD_SPECS[i].layers[j].path, page);
+                }
+            }
+        }
+        prefetching = prefetch_start(&prefetcher) == 0;
+    }
+
+    // Counters for a scraper to follow the run. Stage names
+    // match --stats so the two can be read side by side.
+    static const char* metricsStageNames[perfStageCount];
+    Metrics metrics;
+    bool serveMetrics = metricsAddress != NULL;
+    if (serveMetrics) {
+        for (int s = 0; s < perfStageCount; ++s) {
+            metricsStageNames[s] = perf_stage_name(s);
+        }
+        metrics_init(&metrics, metricsStageNames, perfStageCount);
+        if (prefetching)
+            metrics_gauge_source(&metrics, metricPrefetchQueue, &prefetcher.queued);
+        int listenResult = metrics_listen(&metrics, metricsAddress);
+        if (listenResult != 0) {
+            if (listenResult == 4)
+                printf("Couldn't serve metrics on %s: address in use\n", metricsAddress);
+            else
+                printf("Couldn't serve metrics on %s (code %d)\n", metricsAddress, listenResult);
+            exit(1);
+        }
+        printf("Serving metrics on %s\n", metricsAddress);
+    }
+
+    // The main thread draws the page around the cards and encodes it.
+    // The cost model needs the stage times too, printed or not.
+    PerfStats perfStats;
+    CardLoadContext mainContext = { .prefetcher = NULL, .perf = NULL, .metrics = serveMetrics ? &metrics : NULL };
+    bool measuring = stats || costModelFilename != NULL;
+    uint64_t encodeNs[outputFormatCount] = { 0 };
+    uint64_t outputBytes[outputFormatCount] = { 0 };
+    if (measuring) {
+        if (perf_stats_init(&perfStats, perfCounters) != 0) {
+            printf("Couldn't set up --stats\n");
+            exit(1);
+        }
+        if (perfCounters && !perfStats.use_counters) {
+            printf("Hardware counters unavailable (%s), reporting wall time only\n", strerror(perfStats.open_error));
+        }
+        mainContext.perf = &perfStats;
+        perf_counters_open(&perfStats, &mainContext.counters);
+    }
+    PerfSample sample;
+
+    CardLoader loader;
+    CardLoadContext loaderContext = {
+        .prefetcher = prefetching ? &prefetcher : NULL,
+        .scaledCache = diskCaching ? &scaledCache : NULL,
+        .sharedCache = sharedCaching ? &sharedCache : NULL,
+        .perf = mainContext.perf,
+        .metrics = mainContext.metrics
+    };
+    bool loading = InitCardLoader(&loader, threadCount, &cardCache, loaderContext, ppi, paperSize);
+    if (!loading) {
+        printf("Couldn't start the card loading threads, loading while compositing\n");
+        DestroyCardLoader(&loader);
+    }
+
+    // What's still growing after the first quarter of the
+    // pages is a leak or fragmentation.
+    MemWatch memWatch;
+    bool memoryChecking = memoryCheckMB >= 0;
+    int memoryWarmup = SDL_max(1, pageCount/4);
+    if (memoryChecking)
+        mem_watch_init(&memWatch);
+
+    int dedupedPageCount = 0;
     int currPage = 0;
     while (currPage < pageCount) {
+        if (memoryChecking && currPage > 0)
+            SampleMemory(&memWatch, &cardCache, sharedCaching, currPage, stats);
         printf("Building page %02d with:\n", currPage+1);
         for (int i = currPage*CARDS_PER_PAGE; i < cardCount && i < (currPage+1)*CARDS_PER_PAGE ; i++) {
-            printf("%d. %s\n", i+1, CARD_IMAGE_FILENAMES[i]);
+            if (CARD_SPECS[i].layerCount == 0)
+                printf("%d. (empty)\n", i+1);
+            else if (CARD_SPECS[i].layerCount > 1)
+                printf("%d. %s (+%d layers)\n", i+1, CARD_SPECS[i].layers[0].path, CARD_SPECS[i].layerCount - 1);
+            else
+                printf("%d. %s\n", i+1, CARD_SPECS[i].layers[0].path);
+        }
+
+        // A page with the same cards in the same slots as an earlier
+        // page comes out identical, so copy that file instead.
+        int identicalPage = FindIdenticalPage(CARD_SPECS, cardCount, currPage);
+        if (identicalPage >= 0) {
+            char identicalFilename[MAX_PATHLEN];
+            char outputFilename[MAX_PATHLEN];
+            bool copied = true;
+            for (int f = 0; f < outputFormatCount && copied; ++f) {
+                if (!outputs[f])
+                    continue;
+                copied = PageFilename(identicalFilename, sizeof(identicalFilename), outputPrefix, identicalPage+1, OUTPUT_EXTENSIONS[f]) &&
+                    PageFilename(outputFilename, sizeof(outputFilename), outputPrefix, currPage+1, OUTPUT_EXTENSIONS[f]) &&
+                    CopyPageFile(identicalFilename, outputFilename);
+            }
+            if (copied) {
+                for (int f = 0; f < outputFormatCount; ++f) {
+                    if (!outputs[f])
+                        continue;
+                    PageFilename(identicalFilename, sizeof(identicalFilename), outputPrefix, identicalPage+1, OUTPUT_EXTENSIONS[f]);
+                    PageFilename(outputFilename, sizeof(outputFilename), outputPrefix, currPage+1, OUTPUT_EXTENSIONS[f]);
+                    printf("Same as page %02d, copied %s\n", identicalPage+1, identicalFilename);
+                    if (checksums) {
+                        PageChecksum* sum = &PAGE_CHECKSUMS[currPage][f];
+                        *sum = PAGE_CHECKSUMS[identicalPage][f];
+                        if (sum->valid) {
+                            WriteChecksumRow(checksumFile, outputFilename, sum, page->w, page->h, ppi);
+                        }
+                        else {
+                            output_hash_init(&pageHash, sha256);
+                            if (HashFile(outputFilename, &pageHash))
+                                RecordChecksum(checksumFile, sum, &pageHash, outputFilename, page->w, page->h, ppi);
+                        }
+                    }
+                    uint64_t bytes = FileSize(outputFilename);
+                    outputBytes[f] += bytes;
+                    if (serveMetrics)
+                        metrics_add(&metrics, metricBytesWritten, bytes);
+                }
+                // The copy has the same placeholders.
+                int failureCount = SDL_AtomicGet(&CARD_FAILURE_COUNT);
+                for (int i = 0; i < failureCount; ++i) {
+                    if (CARD_FAILURES[i].page != identicalPage+1)
+                        continue;
+                    CardFailure* failure = &CARD_FAILURES[SDL_AtomicAdd(&CARD_FAILURE_COUNT, 1)];
+                    *failure = CARD_FAILURES[i];
+                    failure->page = currPage+1;
+                }
+                // The stream gets the earlier page's raster again.
+                if (pwgOutput) {
+                    PageBytes* kept = &PWG_PAGES[identicalPage];
+                    uint64_t before = pwg.bytes;
+                    if (kept->failed || pwg_write_raw(&pwg, kept->data, kept->size) != 0) {
+                        printf("Error writing page %02d to %s\n", currPage+1, pwgDestination);
+                        exit(1);
+                    }
+                    printf("Same as page %02d, sent its raster again\n", identicalPage+1);
+                    if (serveMetrics)
+                        metrics_add(&metrics, metricBytesWritten, pwg.bytes - before);
+                    // Kept no longer than the last copy needs it.
+                    if (!PageCopiedAfter(CARD_SPECS, cardCount, pageCount, identicalPage, currPage)) {
+                        free(kept->data);
+                        memset(kept, 0, sizeof(*kept));
+                    }
+                }
+                if (serveMetrics)
+                    metrics_add(&metrics, metricPagesCopied, 1);
+                dedupedPageCount++;
+                currPage++;
+                continue;
+            }
+            printf("Couldn't copy %s, rendering page %02d instead\n", identicalFilename, currPage+1);
+        }
+
+        if (prefetching)
+            prefetch_advance(&prefetcher, currPage);
+
+        // Load this page's cards, if not queued already, and the next
+        // page's behind them. The prefetcher reads the next batch at
+        // most, so the loads go no further ahead. A file the next page's
+        // loads are still decoding outlives the advance above, until
+        // they release it.
+        if (loading) {
+            LoadPageAhead(&loader, CARD_SPECS, cardCount, currPage);
+            int nextPage = currPage+1;
+            if (nextPage < pageCount && FindIdenticalPage(CARD_SPECS, cardCount, nextPage) < 0)
+                LoadPageAhead(&loader, CARD_SPECS, cardCount, nextPage);
         }
 
         // Start with a background
+        TRACE_PAGE_COMPOSE_START(currPage+1);
+        StageBegin(&mainContext, &sample);
         SDL_Rect pageBGRect = { .x = 0, .y = 0, .w = PageWidth(ppi,paperSize), .h = PageHeight(ppi,paperSize) };
         SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
         SDL_RenderFillRect(renderer, &pageBGRect);
@@ -878,48 +3561,345 @@ int main(int argc, char *argv[]) {
         // Simple gray lines for basic alignment helpers (registers)
         SDL_Color bgLines = { .r = 64, .g = 64, .b = 64, .a = 255 };
         DrawBackgroundLines(renderer, bgLines, ppi, paperSize);
+        StageEnd(&mainContext, &sample, perfStageCompose);
+
+        PageJob job = {
+            .page = page,
+            .cache = &cardCache,
+            .prefetcher = prefetching ? &prefetcher : NULL,
+            .scaledCache = diskCaching ? &scaledCache : NULL,
+            .sharedCache = sharedCaching ? &sharedCache : NULL,
+            .perf = mainContext.perf,
+            .metrics = mainContext.metrics,
+            .pageNumber = currPage+1,
+            .cards = &CARD_SPECS[currPage*CARDS_PER_PAGE],
+            .cardCount = SDL_min(CARDS_PER_PAGE, cardCount - currPage*CARDS_PER_PAGE),
+            .bgcolor = cardBGColor,
+            .ppi = ppi,
+            .paperSize = paperSize,
+            .placeholder = strict ? NULL : PlaceholderCard(ppi)
+        };
+        if (loading) {
+            WaitPageLoads(&loader, currPage);
+            job.pinned = PinnedPageLayers(&loader, currPage);
+        }
+        ComposePage(&job, threadCount);
+        if (loading)
+            ReleasePageLoads(&loader, currPage);
 
         int cardsOnPageCount = 0;
-        for (int i = currPage*CARDS_PER_PAGE; i < cardCount && i < (currPage+1)*CARDS_PER_PAGE ; i++) {
-            SDL_Surface* cardImage = LoadCardImage(CARD_IMAGE_FILENAMES[i], cardBGColor, ppi);
-            if (cardImage == NULL) {
-                printf("Error reading %s\n", CARD_IMAGE_FILENAMES[i]);
-                printf("%s\n", SDL_GetError());
-                continue;
+        for (int j = 0; j < job.cardCount; ++j) {
+            if (job.placed[j]) {
+                printf("Adding %s to page %02d\n", job.cards[j].layers[0].path, currPage+1);
+                cardsOnPageCount++;
             }
-            else {
-                printf("Adding %s to page %02d\n", CARD_IMAGE_FILENAMES[i], currPage+1);
+            else if (job.failed[j] && job.placeholder != NULL) {
+                printf("Placeholder for %s on page %02d\n", job.cards[j].layers[0].path, currPage+1);
             }
-
-            AddCardToPage(page, cardImage, i%CARDS_PER_PAGE, ppi, paperSize);
-            cardsOnPageCount++;
-            SDL_FreeSurface(cardImage);
         }
+        if (strict && SDL_AtomicGet(&CARD_FAILURE_COUNT) > 0) {
+            PrintCardFailures();
+            printf("Stopped at page %02d\n", currPage+1);
+            exit(1);
+        }
+
+        StageBegin(&mainContext, &sample);
 
         // Fill all blank card positions with an inner border
         // equal to the card background color chosen.
         // Similarly to the margin border, this is
         // to help make cutting easier.
-        for (int j = cardsOnPageCount; j < 9; ++j) {
-            DrawBlankCardBorder(renderer, cardBGColor, j, ppi, paperSize);
+        for (int j = 0; j < CARDS_PER_PAGE; ++j) {
+            bool filled = j < job.cardCount && (job.placed[j] || (job.failed[j] && job.placeholder != NULL));
+            if (!filled)
+                DrawBlankCardBorder(renderer, cardBGColor, j, ppi, paperSize);
         }
 
         DrawGutterLines(renderer, cardLines, ppi, paperSize);
 
         if (roundedCorners) {
             for (int i = currPage*CARDS_PER_PAGE; i < cardCount && i < (currPage+1)*CARDS_PER_PAGE ; i++) {
+                if (CARD_SPECS[i].layerCount == 0)
+                    continue;
                 DrawRoundedCorners(renderer, cardLines, i%CARDS_PER_PAGE, ppi, paperSize);
             }
         }
 
-        char outputFilename[MAX_PATHLEN];
-        sprintf(outputFilename, "%s%02d.png", outputPrefix, currPage+1);
-        IMG_SavePNG(page, outputFilename);
-        update_png_dpi(outputFilename, ppi);
+        StageEnd(&mainContext, &sample, perfStageCompose);
+
+        if (halftoning) {
+            StageBegin(&mainContext, &sample);
+            int halftoneResult = halftone_page(&halftone, page->pixels, page->pitch);
+            StageEnd(&mainContext, &sample, perfStageCompose);
+            if (halftoneResult != 0) {
+                printf("Couldn't halftone page %02d\n", currPage+1);
+                exit(1);
+            }
+        }
+        TRACE_PAGE_COMPOSE_END(currPage+1, cardsOnPageCount);
+
+        bool written = true;
+        if (outputs[outputPNG]) {
+            char outputFilename[MAX_PATHLEN];
+            sprintf(outputFilename, "%s%02d.png", outputPrefix, currPage+1);
+            TRACE_ENCODE_START(outputFilename, currPage+1);
+            uint64_t encodeStart = perf_now_ns();
+            StageBegin(&mainContext, &sample);
+            if (checksums)
+                output_hash_init(&pageHash, sha256);
+            int encodeResult = bandEncoder
+                ? (halftoning
+                    ? png_bands_write(&pngBands, halftone.data, halftone.stride, outputFilename)
+                    : png_bands_write(&pngBands, page->pixels, page->pitch, outputFilename))
+                : IMG_SavePNG(page, outputFilename);
+            StageEnd(&mainContext, &sample, perfStageEncode);
+            TRACE_ENCODE_END(outputFilename, currPage+1, encodeResult);
+            if (encodeResult != 0) {
+                printf("Error writing %s\n", outputFilename);
+                if (bandEncoder)
+                    printf("PNG encoder error %d\n", encodeResult);
+                else
+                    printf("%s\n", SDL_GetError());
+                written = false;
+            }
+            bool hashed = checksums && encodeResult == 0;
+            if (!bandEncoder) {
+                TRACE_DPI_UPDATE_START(outputFilename, currPage+1);
+                StageBegin(&mainContext, &sample);
+                int dpiResult = update_png_dpi(outputFilename, ppi);
+                StageEnd(&mainContext, &sample, perfStageDpi);
+                TRACE_DPI_UPDATE_END(outputFilename, currPage+1, dpiResult);
+                if (dpiResult != 0) {
+                    printf("Couldn't set the DPI of %s (code %d)\n", outputFilename, dpiResult);
+                }
+                // The rewritten file is still in memory; hash it from there.
+                if (hashed) {
+                    if (dpiResult == 0)
+                        output_hash_update(&pageHash, PNG_OUT_BUF, PNG_OUT_SIZE);
+                    else
+                        hashed = HashFile(outputFilename, &pageHash);
+                }
+            }
+            encodeNs[outputPNG] += perf_now_ns() - encodeStart;
+            if (hashed)
+                RecordChecksum(checksumFile, &PAGE_CHECKSUMS[currPage][outputPNG], &pageHash, outputFilename, page->w, page->h, ppi);
+            if (encodeResult == 0) {
+                uint64_t bytes = FileSize(outputFilename);
+                outputBytes[outputPNG] += bytes;
+                if (serveMetrics)
+                    metrics_add(&metrics, metricBytesWritten, bytes);
+            }
+        }
+
+        // The proof is encoded from the same pixels,
+        // so it has to be done before the page is cleared.
+        if (outputs[outputJPEG]) {
+            char proofFilename[MAX_PATHLEN];
+            sprintf(proofFilename, "%s%02d.jpg", outputPrefix, currPage+1);
+            TRACE_ENCODE_START(proofFilename, currPage+1);
+            uint64_t encodeStart = perf_now_ns();
+            StageBegin(&mainContext, &sample);
+            if (checksums)
+                output_hash_init(&proofHash, sha256);
+            int jpegResult = jpeg_write(&jpeg, page->pixels, page->pitch, proofFilename);
+            StageEnd(&mainContext, &sample, perfStageEncode);
+            encodeNs[outputJPEG] += perf_now_ns() - encodeStart;
+            TRACE_ENCODE_END(proofFilename, currPage+1, jpegResult);
+            if (jpegResult != 0) {
+                printf("Error writing %s\n", proofFilename);
+                printf("JPEG encoder error %d\n", jpegResult);
+                written = false;
+            }
+            else {
+                if (checksums)
+                    RecordChecksum(checksumFile, &PAGE_CHECKSUMS[currPage][outputJPEG], &proofHash, proofFilename, page->w, page->h, ppi);
+                uint64_t bytes = FileSize(proofFilename);
+                outputBytes[outputJPEG] += bytes;
+                if (serveMetrics)
+                    metrics_add(&metrics, metricBytesWritten, bytes);
+            }
+        }
+
+        // Sent as soon as it's done, so the printer can start on it. A stream
+        // missing a page is no use, so a failed write stops the run.
+        if (pwgOutput) {
+            PageBytes* kept = &PWG_PAGES[currPage];
+            bool keep = PageCopiedAfter(CARD_SPECS, cardCount, pageCount, currPage, currPage);
+            pwg.sink = keep ? KeepWrittenBytes : NULL;
+            pwg.sink_ctx = kept;
+            uint64_t before = pwg.bytes;
+            StageBegin(&mainContext, &sample);
+            int pwgResult = halftoning
+                ? pwg_write_bilevel(&pwg, halftone.data, halftone.stride, page->w, page->h, ppi, pwgSizeName)
+                : pwg_write_page(&pwg, page->pixels, page->pitch, page->w, page->h, ppi, pwgSizeName);
+            StageEnd(&mainContext, &sample, perfStageEncode);
+            // Resending a kept page mustn't append it to itself.
+            pwg.sink = NULL;
+            if (pwgResult != 0) {
+                printf("Error writing page %02d to %s (code %d)\n", currPage+1, pwgDestination, pwgResult);
+                exit(1);
+            }
+            printf("Sent page %02d to %s\n", currPage+1, pwgDestination);
+            if (serveMetrics)
+                metrics_add(&metrics, metricBytesWritten, pwg.bytes - before);
+        }
         SDL_RenderClear(renderer);
+
+        if (serveMetrics && written)
+            metrics_add(&metrics, metricPagesRendered, 1);
+
+        if (measuring) {
+            PerfTotals pageTotals[perfStageCount];
+            char label[32];
+            perf_page_take(&perfStats, pageTotals);
+            sprintf(label, "Page %02d stats", currPage+1);
+            if (stats)
+                PrintPerfTotals(label, pageTotals, perfStats.use_counters);
+        }
         currPage++;
     }
+    if (memoryChecking)
+        SampleMemory(&memWatch, &cardCache, sharedCaching, currPage, stats);
     
+    printf("Identical pages copied: %d\n", dedupedPageCount);
+    if (loading) {
+        // Before the prefetcher and caches its tasks use go away.
+        int steals = SDL_AtomicGet(&loader.pool.steals);
+        DestroyCardLoader(&loader);
+        printf("Card loads: %d tasks on %d threads, %d stolen\n", loader.tasksRun, threadCount, steals);
+    }
+    if (SDL_AtomicGet(&CARD_FAILURE_COUNT) > 0)
+        PrintCardFailures();
+    if (checksums) {
+        if (fclose(checksumFile) != 0)
+            printf("Error writing %s\n", checksumFilename);
+        else
+            printf("Page checksums written to %s\n", checksumFilename);
+    }
+    if (serveMetrics) {
+        // Stop before the prefetcher its queue gauge points into goes away.
+        metrics_stop(&metrics);
+    }
+    if (prefetching) {
+        printf("Prefetch: read %llu files, %.1f MB in %s order at %.1f MB/s\n",
+            (unsigned long long)prefetcher.files_read,
+            prefetcher.bytes_read/(1024.0*1024.0),
+            prefetch_order_name(prefetcher.order),
+            prefetch_throughput(&prefetcher));
+        prefetch_destroy(&prefetcher);
+    }
+    printf("Layer cache: %llu hits, %llu misses\n", (unsigned long long)cardCache.hits, (unsigned long long)cardCache.misses);
+    if (diskCaching) {
+        printf("Disk cache: %llu hits, %llu misses, wrote %llu raw and %llu qoi layers (%.1f MB), disk %.1f MB/s, qoi decode %.1f MB/s\n",
+            (unsigned long long)scaledCache.hits,
+            (unsigned long long)scaledCache.misses,
+            (unsigned long long)scaledCache.raw_stored,
+            (unsigned long long)scaledCache.qoi_stored,
+            scaledCache.bytes_stored/(1024.0*1024.0),
+            scaled_cache_bandwidth(&scaledCache),
+            scaled_cache_decode_rate(&scaledCache));
+        int removed;
+        uint64_t removedBytes;
+        if (diskCacheMB > 0 && scaled_cache_prune(&scaledCache, (uint64_t)diskCacheMB*1024*1024, &removed, &removedBytes) == 0 && removed > 0)
+            printf("Disk cache: deleted %d least recently used layers (%.1f MB) to stay under %d MB\n", removed, removedBytes/(1024.0*1024.0), diskCacheMB);
+        scaled_cache_destroy(&scaledCache);
+    }
+    if (sharedCaching) {
+        uint64_t used, capacity;
+        shm_cache_usage(&sharedCache, &used, &capacity);
+        printf("Shared cache: %d hits, %d filled here, waited on %d, took over %d, %d not shared, %.1f of %.1f MB used\n",
+            SDL_AtomicGet(&sharedCache.hits),
+            SDL_AtomicGet(&sharedCache.fills),
+            SDL_AtomicGet(&sharedCache.waits),
+            SDL_AtomicGet(&sharedCache.takeovers),
+            SDL_AtomicGet(&sharedCache.unshared),
+            used/(1024.0*1024.0),
+            capacity/(1024.0*1024.0));
+    }
+    if (costModelFilename != NULL) {
+        CostMeasured measured = {
+            .ns = {
+                [costDecode] = (double)perfStats.job[perfStageDecode].wall_ns,
+                [costScale] = (double)perfStats.job[perfStageScale].wall_ns,
+                [costCompose] = (double)perfStats.job[perfStageCompose].wall_ns,
+                [costEncodePNG] = (double)encodeNs[outputPNG],
+                [costEncodeJPEG] = (double)encodeNs[outputJPEG]
+            },
+            .output_bytes = { (double)outputBytes[outputPNG], (double)outputBytes[outputJPEG] },
+            .wall_s = (perf_now_ns() - startNs)/1e9,
+            .rss_mb = cost_peak_rss_mb()
+        };
+        double cpuSeconds = (double)(clock() - startClock)/CLOCKS_PER_SEC;
+        double bytes = (double)(outputBytes[outputPNG] + outputBytes[outputJPEG]);
+        printf("Estimate vs actual: wall %.2f s vs %.2f s (%+.0f%%), CPU %.2f s vs %.2f s (%+.0f%%), ",
+            estimate.wall_s, measured.wall_s, EstimateError(estimate.wall_s, measured.wall_s),
+            estimate.cpu_s, cpuSeconds, EstimateError(estimate.cpu_s, cpuSeconds));
+        printf("peak RSS %.0f MB vs %.0f MB (%+.0f%%), output %.1f MB vs %.1f MB (%+.0f%%)\n",
+            estimate.rss_mb, measured.rss_mb, EstimateError(estimate.rss_mb, measured.rss_mb),
+            estimate.output_bytes/(1024.0*1024.0), bytes/(1024.0*1024.0), EstimateError(estimate.output_bytes, bytes));
+        cost_model_update(&costModel, &costJob, threadCount, &measured);
+        if (cost_model_save(&costModel, costModelFilename) != 0)
+            printf("Couldn't write the cost model to %s\n", costModelFilename);
+        else
+            printf("Cost model updated in %s (%d runs)\n", costModelFilename, costModel.runs);
+    }
+    if (stats)
+        PrintPerfTotals("Job stats", perfStats.job, perfStats.use_counters);
+    if (measuring) {
+        perf_counters_close(&mainContext.counters);
+        perf_stats_destroy(&perfStats);
+    }
+    if (bandEncoder) {
+        printf("PNG margin bands: compressed %llu times, reused %llu times\n",
+            (unsigned long long)pngBands.bands_compressed, (unsigned long long)pngBands.bands_reused);
+        png_bands_destroy(&pngBands);
+    }
+    if (outputs[outputJPEG])
+        jpeg_destroy(&jpeg);
+    if (halftoning)
+        halftone_destroy(&halftone);
+    uint64_t pwgBytes = 0;
+    if (pwgOutput) {
+        pwgBytes = pwg.bytes;
+        int pages = pwg.pages;
+        if (pwg_close(&pwg) != 0)
+            printf("Error finishing the PWG raster to %s\n", pwgDestination);
+        else
+            printf("PWG raster: %d pages, %.1f MB to %s\n", pages, pwgBytes/(1024.0*1024.0), pwgDestination);
+        for (int i = 0; i < pageCount; ++i) {
+            free(PWG_PAGES[i].data);
+        }
+    }
+    FreePlaceholderCards();
+    card_cache_destroy(&cardCache);
+    if (sharedCaching) {
+        // Cached layers point into the mapping.
+        shm_cache_close(&sharedCache);
+    }
     SDL_DestroyRenderer(renderer);
     SDL_FreeSurface(page);    
+
+    int exitCode = 0;
+    if (memoryChecking) {
+        MemGrowth growth;
+        if (mem_watch_growth(&memWatch, memoryWarmup, &growth) != 0) {
+            printf("Memory check: needs more than %d page%s\n", memoryWarmup, memoryWarmup == 1 ? "" : "s");
+        }
+        else {
+            printf("Memory check: %.1f MB after %d warm-up page%s, %.1f MB at the end (%+.1f MB, %+.2f MB per page), heap %.1f MB free\n",
+                growth.warmup_mb, memoryWarmup, memoryWarmup == 1 ? "" : "s", growth.last_mb,
+                growth.growth_mb, growth.slope_mb, growth.heap_free_mb);
+            if (growth.growth_mb > memoryCheckMB && growth.slope_mb > 0) {
+                printf("Memory kept growing after warm-up, more than %d MB\n", memoryCheckMB);
+                exitCode = 2;
+            }
+        }
+        mem_watch_destroy(&memWatch);
+    }
+
+    // Last, for --autotune to read back from its calibration runs.
+    double seconds = (perf_now_ns() - startNs)/1e9;
+    printf(TUNE_RESULT_PRINT, pageCount, seconds, pageCount/seconds,
+        (unsigned long long)(outputBytes[outputPNG] + outputBytes[outputJPEG] + pwgBytes), cost_peak_rss_mb());
+    return exitCode;
 }
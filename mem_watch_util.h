@@ -0,0 +1,149 @@
+// mem_watch_util.h
+// Samples memory use over a long run and tells growth from warm-up.
+//
+// A run that renders page after page should level off once its caches and
+// buffers are full. What keeps growing after that is a leak or heap
+// fragmentation. Each sample records the resident set, the part of it not
+// backed by files or shared memory (anonymous), and the heap's bytes in use
+// and free, which glibc reports (mallinfo2). The caller subtracts memory it
+// is allowed to keep adding to, like a cache still filling up to its limit,
+// to get the level that should stay flat. What it excludes is taken at its
+// highest so far: memory a cache frees by evicting mostly stays with the
+// allocator for reuse, and would otherwise show up as growth.
+//
+// After the warm-up samples, growth is the last level less the highest level
+// seen during warm-up, and the trend is the least-squares slope of the levels
+// after warm-up, so a single spike at the end isn't mistaken for a trend.
+//
+// Usage:
+//   #include "mem_watch_util.h"
+//   MemWatch watch;
+//   mem_watch_init(&watch);
+//   mem_watch_sample(&watch, cache_bytes);    // after every page
+//   MemGrowth growth;
+//   mem_watch_growth(&watch, warmup, &growth);
+//   mem_watch_destroy(&watch);
+
+#ifndef MEM_WATCH_UTIL_H
+#define MEM_WATCH_UTIL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__linux__)
+#include <unistd.h>
+#endif
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+#include <malloc.h>
+#define MEM_WATCH_MALLINFO2
+#endif
+
+typedef struct MemSample {
+    double rss_mb;
+    double anon_mb;           // Resident, not file-backed or shared
+    double heap_used_mb;      // 0 where the allocator doesn't say
+    double heap_free_mb;      // Held by the allocator but not in use
+    double level_mb;          // anon_mb less what the caller excluded
+} MemSample;
+
+typedef struct MemWatch {
+    MemSample *samples;
+    int count, capacity;
+    uint64_t excluded_peak;   // Most the caller has excluded
+} MemWatch;
+
+typedef struct MemGrowth {
+    double warmup_mb;         // Highest level during warm-up
+    double last_mb;
+    double growth_mb;         // last_mb - warmup_mb
+    double slope_mb;          // Per sample after warm-up
+    double heap_free_mb;      // At the last sample
+} MemGrowth;
+
+// API: returns 0 on success; nonzero on failure.
+void mem_watch_init(MemWatch *watch);
+void mem_watch_destroy(MemWatch *watch);
+// Current memory use; zeros where it can't be read.
+int mem_sample(MemSample *sample);
+int mem_watch_sample(MemWatch *watch, uint64_t excluded_bytes);
+// Needs at least one sample after the warm-up ones.
+int mem_watch_growth(const MemWatch *watch, int warmup, MemGrowth *growth);
+
+// ===== Implementation (header-only) =====
+
+void mem_watch_init(MemWatch *watch) {
+    memset(watch, 0, sizeof(*watch));
+}
+
+void mem_watch_destroy(MemWatch *watch) {
+    free(watch->samples);
+    memset(watch, 0, sizeof(*watch));
+}
+
+int mem_sample(MemSample *sample) {
+    memset(sample, 0, sizeof(*sample));
+#if defined(MEM_WATCH_MALLINFO2)
+    struct mallinfo2 info = mallinfo2();
+    sample->heap_used_mb = (info.uordblks + info.hblkhd) / (1024.0 * 1024.0);
+    sample->heap_free_mb = info.fordblks / (1024.0 * 1024.0);
+#endif
+#if defined(__linux__)
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f) return 1;
+    long size = 0, resident = 0, shared = 0;
+    int ok = fscanf(f, "%ld %ld %ld", &size, &resident, &shared) == 3;
+    fclose(f);
+    if (!ok) return 1;
+    double page_mb = sysconf(_SC_PAGESIZE) / (1024.0 * 1024.0);
+    sample->rss_mb = resident * page_mb;
+    sample->anon_mb = (resident - shared) * page_mb;
+    sample->level_mb = sample->anon_mb;
+    return 0;
+#else
+    return 1;
+#endif
+}
+
+int mem_watch_sample(MemWatch *watch, uint64_t excluded_bytes) {
+    if (watch->count == watch->capacity) {
+        int capacity = watch->capacity ? watch->capacity * 2 : 64;
+        MemSample *bigger = (MemSample *)realloc(watch->samples, sizeof(MemSample) * (size_t)capacity);
+        if (!bigger) return 1;
+        watch->samples = bigger;
+        watch->capacity = capacity;
+    }
+    MemSample *sample = &watch->samples[watch->count];
+    int result = mem_sample(sample);
+    if (excluded_bytes > watch->excluded_peak) watch->excluded_peak = excluded_bytes;
+    sample->level_mb = sample->anon_mb - watch->excluded_peak / (1024.0 * 1024.0);
+    watch->count++;
+    return result;
+}
+
+int mem_watch_growth(const MemWatch *watch, int warmup, MemGrowth *growth) {
+    memset(growth, 0, sizeof(*growth));
+    if (warmup < 1 || warmup >= watch->count) return 1;
+    growth->warmup_mb = watch->samples[0].level_mb;
+    for (int i = 1; i < warmup; i++) {
+        if (watch->samples[i].level_mb > growth->warmup_mb) growth->warmup_mb = watch->samples[i].level_mb;
+    }
+    const MemSample *last = &watch->samples[watch->count - 1];
+    growth->last_mb = last->level_mb;
+    growth->growth_mb = growth->last_mb - growth->warmup_mb;
+    growth->heap_free_mb = last->heap_free_mb;
+
+    int n = watch->count - warmup;
+    double mean_x = (n - 1) / 2.0, mean_y = 0;
+    for (int i = 0; i < n; i++) mean_y += watch->samples[warmup + i].level_mb;
+    mean_y /= n;
+    double sxy = 0, sxx = 0;
+    for (int i = 0; i < n; i++) {
+        sxy += (i - mean_x) * (watch->samples[warmup + i].level_mb - mean_y);
+        sxx += (i - mean_x) * (i - mean_x);
+    }
+    growth->slope_mb = sxx > 0 ? sxy / sxx : 0;
+    return 0;
+}
+
+#endif // MEM_WATCH_UTIL_H
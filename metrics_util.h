@@ -0,0 +1,375 @@
+// metrics_util.h
+// Live counters, gauges and latency histograms served in the Prometheus
+// text format over a local HTTP listener.
+//
+// Render threads only ever do relaxed atomic adds and stores, so recording
+// a metric never takes a lock or waits on the listener. The listener thread
+// reads the values when scraped; a scrape may see a histogram a few
+// observations apart from its count, which Prometheus tolerates.
+//
+// The listener binds to loopback ("9464" or "127.0.0.1:9464") or to a Unix
+// socket ("unix:/run/cardprint.sock"). It is POSIX-only.
+//
+// Usage:
+//   #include "metrics_util.h"
+//   Metrics m;
+//   metrics_init(&m, stage_names, stage_count);
+//   metrics_listen(&m, "127.0.0.1:9464");
+//   metrics_add(&m, metricPagesRendered, 1);
+//   metrics_observe(&m, stage, elapsed_ns);
+//   metrics_stop(&m);
+
+#ifndef METRICS_UTIL_H
+#define METRICS_UTIL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+
+#if !defined(_WIN32)
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#define METRICS_HAVE_SOCKETS 1
+#endif
+
+#define METRICS_MAX_STAGES 8
+#define METRICS_BUCKETS 14
+
+typedef enum MetricsCounter {
+    metricPagesRendered = 0,
+    metricPagesCopied,
+    metricCardsPlaced,
+    metricCardsFailed,
+    metricBytesWritten,
+    metricCacheHits,
+    metricCacheMisses,
+    metricCounterCount
+} MetricsCounter;
+
+typedef enum MetricsGauge {
+    metricComposeQueue = 0,    // Cards of the current page not composited yet
+    metricPrefetchQueue,       // Files read ahead and not yet released
+    metricGaugeCount
+} MetricsGauge;
+
+typedef struct MetricsHistogram {
+    uint64_t buckets[METRICS_BUCKETS + 1];   // Per bucket, last is +Inf
+    uint64_t count;
+    uint64_t sum_ns;
+} MetricsHistogram;
+
+typedef struct Metrics {
+    uint64_t counters[metricCounterCount];
+    int64_t gauges[metricGaugeCount];
+    SDL_atomic_t *gauge_sources[metricGaugeCount];   // Read instead of gauges[] when set
+    MetricsHistogram stages[METRICS_MAX_STAGES];
+    const char *const *stage_names;
+    int stage_count;
+
+    int listen_fd;
+    char unix_path[108];
+    SDL_Thread *server;
+    SDL_atomic_t stop;
+} Metrics;
+
+// API: returns 0 on success; nonzero on failure.
+int metrics_init(Metrics *m, const char *const *stage_names, int stage_count);
+// 4 means the address is in use, or a Unix path is taken by something that
+// isn't a stale socket.
+int metrics_listen(Metrics *m, const char *address);
+void metrics_stop(Metrics *m);
+void metrics_add(Metrics *m, MetricsCounter counter, uint64_t n);
+void metrics_gauge_add(Metrics *m, MetricsGauge gauge, int64_t n);
+void metrics_gauge_set(Metrics *m, MetricsGauge gauge, int64_t value);
+void metrics_observe(Metrics *m, int stage, uint64_t elapsed_ns);
+// Report a gauge kept by someone else, read when scraped.
+void metrics_gauge_source(Metrics *m, MetricsGauge gauge, SDL_atomic_t *source);
+// Write the Prometheus exposition text. Returns bytes written, like snprintf.
+size_t metrics_format(Metrics *m, char *out, size_t n);
+
+// ===== Implementation (header-only) =====
+
+// Bucket upper bounds in seconds.
+static const double _mt_bounds[METRICS_BUCKETS] = {
+    0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0
+};
+
+#if defined(__GNUC__) || defined(__clang__)
+#define _MT_ADD(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#define _MT_LOAD(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define _MT_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#else
+// Other compilers get a spinlock; still never blocks on the listener.
+static SDL_SpinLock _mt_spin;
+#define _MT_ADD(p, v) (SDL_AtomicLock(&_mt_spin), *(p) += (v), SDL_AtomicUnlock(&_mt_spin))
+#define _MT_LOAD(p) (*(p))
+#define _MT_STORE(p, v) (SDL_AtomicLock(&_mt_spin), *(p) = (v), SDL_AtomicUnlock(&_mt_spin))
+#endif
+
+int metrics_init(Metrics *m, const char *const *stage_names, int stage_count) {
+    memset(m, 0, sizeof(*m));
+    if (stage_count > METRICS_MAX_STAGES) return 1;
+    m->stage_names = stage_names;
+    m->stage_count = stage_count;
+    m->listen_fd = -1;
+    return 0;
+}
+
+void metrics_add(Metrics *m, MetricsCounter counter, uint64_t n) {
+    _MT_ADD(&m->counters[counter], n);
+}
+
+void metrics_gauge_add(Metrics *m, MetricsGauge gauge, int64_t n) {
+    _MT_ADD(&m->gauges[gauge], n);
+}
+
+void metrics_gauge_set(Metrics *m, MetricsGauge gauge, int64_t value) {
+    _MT_STORE(&m->gauges[gauge], value);
+}
+
+void metrics_gauge_source(Metrics *m, MetricsGauge gauge, SDL_atomic_t *source) {
+    m->gauge_sources[gauge] = source;
+}
+
+void metrics_observe(Metrics *m, int stage, uint64_t elapsed_ns) {
+    MetricsHistogram *h = &m->stages[stage];
+    double seconds = (double)elapsed_ns / 1e9;
+    int b = 0;
+    while (b < METRICS_BUCKETS && seconds > _mt_bounds[b]) b++;
+    _MT_ADD(&h->buckets[b], 1);
+    _MT_ADD(&h->sum_ns, elapsed_ns);
+    _MT_ADD(&h->count, 1);
+}
+
+static uint64_t _mt_resident_bytes(void) {
+#if defined(__linux__)
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f) return 0;
+    long size = 0, resident = 0;
+    int ok = fscanf(f, "%ld %ld", &size, &resident) == 2;
+    fclose(f);
+    return ok ? (uint64_t)resident * (uint64_t)sysconf(_SC_PAGESIZE) : 0;
+#else
+    return 0;
+#endif
+}
+
+size_t metrics_format(Metrics *m, char *out, size_t n) {
+    static const char *counter_names[metricCounterCount] = {
+        "cardprint_pages_rendered_total",
+        "cardprint_pages_copied_total",
+        "cardprint_cards_placed_total",
+        "cardprint_cards_failed_total",
+        "cardprint_bytes_written_total",
+        "cardprint_layer_cache_hits_total",
+        "cardprint_layer_cache_misses_total"
+    };
+    static const char *counter_help[metricCounterCount] = {
+        "Pages rendered and encoded.",
+        "Pages copied from an identical earlier page.",
+        "Cards composited onto pages.",
+        "Cards that couldn't be loaded.",
+        "Bytes of page output written.",
+        "Card layers found in the layer cache.",
+        "Card layers decoded and scaled."
+    };
+    static const char *gauge_names[metricGaugeCount] = {
+        "cardprint_compose_queue_cards",
+        "cardprint_prefetch_queue_files"
+    };
+    static const char *gauge_help[metricGaugeCount] = {
+        "Cards of the current page waiting to be composited.",
+        "Card files read ahead and waiting to be decoded."
+    };
+
+    size_t len = 0;
+#define _MT_PRINT(...) do { \
+        int w = snprintf(out + (len < n ? len : n), len < n ? n - len : 0, __VA_ARGS__); \
+        if (w > 0) len += (size_t)w; \
+    } while (0)
+
+    for (int i = 0; i < metricCounterCount; i++) {
+        _MT_PRINT("# HELP %s %s\n# TYPE %s counter\n%s %llu\n", counter_names[i], counter_help[i],
+            counter_names[i], counter_names[i], (unsigned long long)_MT_LOAD(&m->counters[i]));
+    }
+
+    uint64_t hits = _MT_LOAD(&m->counters[metricCacheHits]);
+    uint64_t misses = _MT_LOAD(&m->counters[metricCacheMisses]);
+    _MT_PRINT("# HELP cardprint_layer_cache_hit_ratio Share of layer lookups served from the cache.\n"
+              "# TYPE cardprint_layer_cache_hit_ratio gauge\ncardprint_layer_cache_hit_ratio %g\n",
+              hits + misses > 0 ? (double)hits / (double)(hits + misses) : 0.0);
+
+    for (int i = 0; i < metricGaugeCount; i++) {
+        long long value = m->gauge_sources[i] ? SDL_AtomicGet(m->gauge_sources[i]) : (long long)_MT_LOAD(&m->gauges[i]);
+        _MT_PRINT("# HELP %s %s\n# TYPE %s gauge\n%s %lld\n", gauge_names[i], gauge_help[i],
+            gauge_names[i], gauge_names[i], value);
+    }
+
+    _MT_PRINT("# HELP process_resident_memory_bytes Resident memory size in bytes.\n"
+              "# TYPE process_resident_memory_bytes gauge\nprocess_resident_memory_bytes %llu\n",
+              (unsigned long long)_mt_resident_bytes());
+
+    _MT_PRINT("# HELP cardprint_stage_seconds Time spent in each pipeline stage.\n"
+              "# TYPE cardprint_stage_seconds histogram\n");
+    for (int s = 0; s < m->stage_count; s++) {
+        MetricsHistogram *h = &m->stages[s];
+        uint64_t cumulative = 0;
+        for (int b = 0; b <= METRICS_BUCKETS; b++) {
+            cumulative += _MT_LOAD(&h->buckets[b]);
+            if (b < METRICS_BUCKETS)
+                _MT_PRINT("cardprint_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n", m->stage_names[s], _mt_bounds[b], (unsigned long long)cumulative);
+            else
+                _MT_PRINT("cardprint_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n", m->stage_names[s], (unsigned long long)cumulative);
+        }
+        _MT_PRINT("cardprint_stage_seconds_sum{stage=\"%s\"} %.9f\n", m->stage_names[s], (double)_MT_LOAD(&h->sum_ns) / 1e9);
+        _MT_PRINT("cardprint_stage_seconds_count{stage=\"%s\"} %llu\n", m->stage_names[s], (unsigned long long)cumulative);
+    }
+#undef _MT_PRINT
+    return len;
+}
+
+#ifdef METRICS_HAVE_SOCKETS
+static void _mt_write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, buf, len);
+        if (w <= 0) return;
+        buf += w;
+        len -= (size_t)w;
+    }
+}
+
+static int _mt_serve(void *data) {
+    Metrics *m = (Metrics *)data;
+    size_t cap = 1 << 16;
+    char *body = (char *)malloc(cap);
+    if (!body) return 1;
+
+    while (!SDL_AtomicGet(&m->stop)) {
+        // Wake up now and then to notice metrics_stop.
+        struct pollfd p = { m->listen_fd, POLLIN, 0 };
+        if (poll(&p, 1, 200) <= 0) continue;
+
+        int client = accept(m->listen_fd, NULL, NULL);
+        if (client < 0) continue;
+
+        // Whatever was asked, the answer is the metrics page.
+        char request[1024];
+        struct pollfd c = { client, POLLIN, 0 };
+        if (poll(&c, 1, 1000) > 0 && read(client, request, sizeof(request)) < 0) {
+            close(client);
+            continue;
+        }
+
+        size_t len = metrics_format(m, body, cap);
+        if (len >= cap) {
+            char *bigger = (char *)realloc(body, len + 1);
+            if (bigger) {
+                body = bigger;
+                cap = len + 1;
+                len = metrics_format(m, body, cap);
+            }
+            if (len >= cap) len = cap - 1;
+        }
+
+        char header[160];
+        int header_len = snprintf(header, sizeof(header),
+            "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %lu\r\nConnection: close\r\n\r\n",
+            (unsigned long)len);
+        _mt_write_all(client, header, (size_t)header_len);
+        _mt_write_all(client, body, len);
+        close(client);
+    }
+
+    free(body);
+    return 0;
+}
+#endif
+
+int metrics_listen(Metrics *m, const char *address) {
+#ifndef METRICS_HAVE_SOCKETS
+    (void)m; (void)address;
+    return 1;
+#else
+    int fd = -1;
+    if (strncmp(address, "unix:", 5) == 0) {
+        struct sockaddr_un sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        if (strlen(address + 5) >= sizeof(sa.sun_path)) return 2;
+        strncpy(sa.sun_path, address + 5, sizeof(sa.sun_path) - 1);
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) return 3;
+        // Only a socket left over from a previous run is removed; a live
+        // one still accepts, and any other file is never touched.
+        struct stat st;
+        if (lstat(sa.sun_path, &st) == 0) {
+            if (!S_ISSOCK(st.st_mode) || connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0) { close(fd); return 4; }
+            close(fd);
+            fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd < 0) return 3;
+            unlink(sa.sun_path);
+        }
+        if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) { close(fd); return 4; }
+        strncpy(m->unix_path, sa.sun_path, sizeof(m->unix_path) - 1);
+    }
+    else {
+        // "PORT" or "HOST:PORT"; HOST must be a loopback address.
+        char host[64] = "127.0.0.1";
+        const char *colon = strrchr(address, ':');
+        const char *port = address;
+        if (colon) {
+            size_t host_len = (size_t)(colon - address);
+            if (host_len == 0 || host_len >= sizeof(host)) return 2;
+            memcpy(host, address, host_len);
+            host[host_len] = '\0';
+            port = colon + 1;
+        }
+
+        struct sockaddr_in sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sin_family = AF_INET;
+        sa.sin_port = htons((uint16_t)strtol(port, NULL, 10));
+        if (sa.sin_port == 0 || inet_pton(AF_INET, host, &sa.sin_addr) != 1) return 2;
+        if ((ntohl(sa.sin_addr.s_addr) >> 24) != 127) return 5;
+
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) return 3;
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) { close(fd); return 4; }
+    }
+
+    if (listen(fd, 8) != 0) { close(fd); return 4; }
+    m->listen_fd = fd;
+    SDL_AtomicSet(&m->stop, 0);
+    m->server = SDL_CreateThread(_mt_serve, "metrics", m);
+    if (!m->server) {
+        close(fd);
+        m->listen_fd = -1;
+        return 6;
+    }
+    return 0;
+#endif
+}
+
+void metrics_stop(Metrics *m) {
+    if (!m->server) return;
+    SDL_AtomicSet(&m->stop, 1);
+    SDL_WaitThread(m->server, NULL);
+    m->server = NULL;
+#ifdef METRICS_HAVE_SOCKETS
+    close(m->listen_fd);
+    if (m->unix_path[0]) unlink(m->unix_path);
+#endif
+    m->listen_fd = -1;
+}
+
+#endif // METRICS_UTIL_H
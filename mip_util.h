@@ -0,0 +1,246 @@
+// mip_util.h
+// Half-resolution levels (a mip pyramid) of card art, and a resampler that
+// scales from the nearest level at or above the target size.
+//
+// Level 0 is the source; each level after it is half the size of the one
+// before, each pixel the average of a 2x2 block. A target is resampled with
+// a bilinear filter from the smallest level that is still at least as large,
+// so the filter never shrinks by more than 2x and lower PPIs alias less than
+// scaling straight from the full-size source. When the levels are kept, a
+// smaller target only touches a level a fraction of the source's size.
+//
+// All surfaces are ARGB8888 with straight alpha; averages are weighted by
+// alpha so transparent pixels don't bleed their color into the edges.
+//
+// Usage:
+//   #include "mip_util.h"
+//   SDL_Surface *level = source;
+//   for (int k = 0; k < mip_pick_level(source->w, source->h, w, h); k++)
+//       level = mip_half(level);   // free the intermediate ones
+//   SDL_Surface *scaled = mip_resample(level, w, h);
+//
+//   MipStream ms;                      // or a row at a time, while decoding
+//   mip_stream_init(&ms, src_w, src_h, mip_pick_level(src_w, src_h, w, h));
+//   mip_stream_push(&ms, row);         // every source row
+//   level = mip_stream_finish(&ms);
+
+#ifndef MIP_UTIL_H
+#define MIP_UTIL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+
+// Levels stop once either side would drop below this.
+#define MIP_MIN_SIZE 8
+#define MIP_MAX_LEVELS 12
+
+// Size of a side at level k.
+int mip_level_size(int size, int level);
+// Number of levels after the source that can be made.
+int mip_level_count(int src_w, int src_h);
+// Smallest level still at least w x h; 0 when the target is larger than the source.
+int mip_pick_level(int src_w, int src_h, int w, int h);
+// Returns a new surface half the size of level, or NULL if out of memory.
+SDL_Surface *mip_half(SDL_Surface *level);
+// Returns a new w x h surface resampled from level, or NULL if out of memory.
+SDL_Surface *mip_resample(SDL_Surface *level, int w, int h);
+
+// Builds one level from the source's rows as they're decoded, keeping a row
+// or two per level in between, so the full-size source is never in memory.
+// The result is the same as calling mip_half on the whole source.
+typedef struct MipStream {
+    int levels;
+    int w[MIP_MAX_LEVELS + 1], h[MIP_MAX_LEVELS + 1];
+    uint32_t *pending[MIP_MAX_LEVELS];   // First row of a pair, per level
+    uint32_t *half[MIP_MAX_LEVELS];      // The next level's row made from a pair
+    int have[MIP_MAX_LEVELS];
+    SDL_Surface *out;
+    int rows_out;
+} MipStream;
+
+int mip_stream_init(MipStream *ms, int src_w, int src_h, int levels);
+// Adds the next source row, src_w pixels.
+void mip_stream_push(MipStream *ms, const uint32_t *row);
+// Returns the level once every source row has been pushed, else NULL; frees the rest.
+SDL_Surface *mip_stream_finish(MipStream *ms);
+void mip_stream_destroy(MipStream *ms);
+
+// ===== Implementation (header-only) =====
+
+int mip_level_size(int size, int level) {
+    size >>= level;
+    return size < 1 ? 1 : size;
+}
+
+int mip_level_count(int src_w, int src_h) {
+    int k = 0;
+    while (k < MIP_MAX_LEVELS && mip_level_size(src_w, k + 1) >= MIP_MIN_SIZE && mip_level_size(src_h, k + 1) >= MIP_MIN_SIZE) k++;
+    return k;
+}
+
+int mip_pick_level(int src_w, int src_h, int w, int h) {
+    int k = 0;
+    int count = mip_level_count(src_w, src_h);
+    while (k < count && mip_level_size(src_w, k + 1) >= w && mip_level_size(src_h, k + 1) >= h) k++;
+    return k;
+}
+
+// One row of the next level from two rows src_w pixels wide.
+static void _mip_half_row(const uint32_t *row0, const uint32_t *row1, int src_w, uint32_t *out) {
+    int w = mip_level_size(src_w, 1);
+    for (int x = 0; x < w; x++) {
+        int x1 = SDL_min(2 * x + 1, src_w - 1);
+        uint32_t p[4] = { row0[2 * x], row0[x1], row1[2 * x], row1[x1] };
+        uint32_t a = 0, r = 0, g = 0, b = 0;
+        for (int i = 0; i < 4; i++) {
+            uint32_t pa = p[i] >> 24;
+            a += pa;
+            r += ((p[i] >> 16) & 0xff) * pa;
+            g += ((p[i] >> 8) & 0xff) * pa;
+            b += (p[i] & 0xff) * pa;
+        }
+        if (a == 0) {
+            out[x] = 0;
+            continue;
+        }
+        out[x] = ((a + 2) / 4) << 24 | ((r + a / 2) / a) << 16 | ((g + a / 2) / a) << 8 | ((b + a / 2) / a);
+    }
+}
+
+SDL_Surface *mip_half(SDL_Surface *level) {
+    int w = mip_level_size(level->w, 1);
+    int h = mip_level_size(level->h, 1);
+    SDL_Surface *half = SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_ARGB8888);
+    if (!half) return NULL;
+
+    for (int y = 0; y < h; y++) {
+        const uint32_t *row0 = (const uint32_t *)((const uint8_t *)level->pixels + (size_t)(2 * y) * level->pitch);
+        const uint32_t *row1 = (const uint32_t *)((const uint8_t *)level->pixels + (size_t)SDL_min(2 * y + 1, level->h - 1) * level->pitch);
+        _mip_half_row(row0, row1, level->w, (uint32_t *)((uint8_t *)half->pixels + (size_t)y * half->pitch));
+    }
+    return half;
+}
+
+int mip_stream_init(MipStream *ms, int src_w, int src_h, int levels) {
+    memset(ms, 0, sizeof(*ms));
+    ms->levels = levels;
+    for (int k = 0; k <= levels; k++) {
+        ms->w[k] = mip_level_size(src_w, k);
+        ms->h[k] = mip_level_size(src_h, k);
+    }
+    ms->out = SDL_CreateRGBSurfaceWithFormat(0, ms->w[levels], ms->h[levels], 32, SDL_PIXELFORMAT_ARGB8888);
+    if (!ms->out) return 1;
+    for (int k = 0; k < levels; k++) {
+        ms->pending[k] = (uint32_t *)malloc(sizeof(uint32_t) * (size_t)ms->w[k]);
+        ms->half[k] = (uint32_t *)malloc(sizeof(uint32_t) * (size_t)ms->w[k + 1]);
+        if (!ms->pending[k] || !ms->half[k]) {
+            mip_stream_destroy(ms);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void mip_stream_push(MipStream *ms, const uint32_t *row) {
+    // Each level holds a row until its pair arrives, then passes their half
+    // on; an odd last row is dropped, as mip_half drops it.
+    for (int k = 0; k < ms->levels; k++) {
+        if (!ms->have[k]) {
+            memcpy(ms->pending[k], row, sizeof(uint32_t) * (size_t)ms->w[k]);
+            ms->have[k] = 1;
+            return;
+        }
+        _mip_half_row(ms->pending[k], row, ms->w[k], ms->half[k]);
+        ms->have[k] = 0;
+        row = ms->half[k];
+    }
+    if (ms->rows_out < ms->h[ms->levels]) {
+        memcpy((uint8_t *)ms->out->pixels + (size_t)ms->rows_out * ms->out->pitch, row, sizeof(uint32_t) * (size_t)ms->w[ms->levels]);
+        ms->rows_out++;
+    }
+}
+
+SDL_Surface *mip_stream_finish(MipStream *ms) {
+    SDL_Surface *out = ms->rows_out == ms->h[ms->levels] ? ms->out : NULL;
+    if (out) ms->out = NULL;
+    mip_stream_destroy(ms);
+    return out;
+}
+
+void mip_stream_destroy(MipStream *ms) {
+    for (int k = 0; k < MIP_MAX_LEVELS; k++) {
+        free(ms->pending[k]);
+        free(ms->half[k]);
+        ms->pending[k] = ms->half[k] = NULL;
+    }
+    if (ms->out) SDL_FreeSurface(ms->out);
+    ms->out = NULL;
+}
+
+// Source position and weight (0..128 towards the next pixel) of each output
+// column or row, sampling at pixel centers.
+static void _mip_taps(int src, int dst, int *index, uint32_t *weight) {
+    for (int i = 0; i < dst; i++) {
+        int64_t pos = ((int64_t)(2 * i + 1) * src * 128) / (2 * dst) - 64;   // In 1/128ths
+        if (pos < 0) pos = 0;
+        index[i] = (int)(pos >> 7);
+        weight[i] = (uint32_t)(pos & 127);
+        if (index[i] >= src - 1) {
+            index[i] = src - 1;
+            weight[i] = 0;
+        }
+    }
+}
+
+SDL_Surface *mip_resample(SDL_Surface *level, int w, int h) {
+    SDL_Surface *out = SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_ARGB8888);
+    int *xs = (int *)malloc(sizeof(int) * (size_t)(w + h));
+    uint32_t *xw = (uint32_t *)malloc(sizeof(uint32_t) * (size_t)(w + h));
+    if (!out || !xs || !xw) {
+        if (out) SDL_FreeSurface(out);
+        free(xs);
+        free(xw);
+        return NULL;
+    }
+    int *ys = xs + w;
+    uint32_t *yw = xw + w;
+    _mip_taps(level->w, w, xs, xw);
+    _mip_taps(level->h, h, ys, yw);
+
+    for (int y = 0; y < h; y++) {
+        const uint32_t *row0 = (const uint32_t *)((const uint8_t *)level->pixels + (size_t)ys[y] * level->pitch);
+        const uint32_t *row1 = (const uint32_t *)((const uint8_t *)level->pixels + (size_t)SDL_min(ys[y] + 1, level->h - 1) * level->pitch);
+        uint32_t *dst = (uint32_t *)((uint8_t *)out->pixels + (size_t)y * out->pitch);
+        for (int x = 0; x < w; x++) {
+            int x0 = xs[x];
+            int x1 = SDL_min(x0 + 1, level->w - 1);
+            uint32_t p[4] = { row0[x0], row0[x1], row1[x0], row1[x1] };
+            uint32_t wt[4] = {
+                (128 - xw[x]) * (128 - yw[y]), xw[x] * (128 - yw[y]),
+                (128 - xw[x]) * yw[y], xw[x] * yw[y]
+            };
+            // Weights add up to 1 << 14.
+            uint32_t a = 0, r = 0, g = 0, b = 0;
+            for (int i = 0; i < 4; i++) {
+                uint32_t aw = (p[i] >> 24) * wt[i];
+                a += aw;
+                r += ((p[i] >> 16) & 0xff) * aw;
+                g += ((p[i] >> 8) & 0xff) * aw;
+                b += (p[i] & 0xff) * aw;
+            }
+            if (a == 0) {
+                dst[x] = 0;
+                continue;
+            }
+            dst[x] = ((a + (1 << 13)) >> 14) << 24 | ((r + a / 2) / a) << 16 | ((g + a / 2) / a) << 8 | ((b + a / 2) / a);
+        }
+    }
+
+    free(xs);
+    free(xw);
+    return out;
+}
+
+#endif // MIP_UTIL_H
@@ -0,0 +1,220 @@
+// perf_stats_util.h
+// Per-stage wall time and hardware performance counters.
+//
+// Each thread that does measured work opens its own PerfCounters; on Linux
+// these are perf_event_open counters for cycles, instructions, cache misses
+// and branch misses of the calling thread only. Work is bracketed with
+// perf_stage_begin/perf_stage_end and the deltas are added to the current
+// page and to the job. When counters can't be opened (not Linux, no
+// permission, no PMU in a VM) only wall time is recorded.
+//
+// Usage:
+//   #include "perf_stats_util.h"
+//   PerfStats stats;
+//   perf_stats_init(&stats, 1);           // 1 = try hardware counters
+//   PerfCounters counters;
+//   perf_counters_open(&stats, &counters);
+//   PerfSample s;
+//   perf_stage_begin(&counters, &s);
+//   ... decode ...
+//   perf_stage_end(&stats, &counters, &s, perfStageDecode);
+//   perf_page_take(&stats, page_totals);  // after each page
+//   perf_counters_close(&counters);
+//   perf_stats_destroy(&stats);
+
+#ifndef PERF_STATS_UTIL_H
+#define PERF_STATS_UTIL_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <SDL2/SDL.h>
+
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+// Hidden by strict -std=c99; same declaration as glibc's.
+long syscall(long number, ...);
+#endif
+
+typedef enum PerfStage {
+    perfStageDecode = 0,
+    perfStageScale,
+    perfStageCompose,
+    perfStageEncode,
+    perfStageDpi,
+    perfStageCount
+} PerfStage;
+
+typedef enum PerfCounter {
+    perfCycles = 0,
+    perfInstructions,
+    perfCacheMisses,
+    perfBranchMisses,
+    perfCounterCount
+} PerfCounter;
+
+typedef struct PerfTotals {
+    uint64_t calls;
+    uint64_t wall_ns;
+    uint64_t counts[perfCounterCount];
+} PerfTotals;
+
+typedef struct PerfStats {
+    int use_counters;         // Hardware counters were asked for and work
+    int counters_missing;     // Bitmask of PerfCounter that couldn't be opened
+    int open_error;           // errno from the first failed open, 0 if none
+    SDL_mutex *lock;
+    PerfTotals page[perfStageCount];
+    PerfTotals job[perfStageCount];
+} PerfStats;
+
+typedef struct PerfCounters {
+    int fds[perfCounterCount];
+} PerfCounters;
+
+typedef struct PerfSample {
+    uint64_t start_ns;
+    uint64_t counts[perfCounterCount];
+} PerfSample;
+
+// API: returns 0 on success; nonzero on failure.
+int perf_stats_init(PerfStats *stats, int use_counters);
+void perf_stats_destroy(PerfStats *stats);
+// Open this thread's counters. Never fails; missing counters read as 0.
+void perf_counters_open(PerfStats *stats, PerfCounters *counters);
+void perf_counters_close(PerfCounters *counters);
+void perf_stage_begin(PerfCounters *counters, PerfSample *sample);
+void perf_stage_end(PerfStats *stats, PerfCounters *counters, const PerfSample *sample, PerfStage stage);
+// Copy out and reset the totals of the page just finished.
+void perf_page_take(PerfStats *stats, PerfTotals totals[perfStageCount]);
+const char *perf_stage_name(PerfStage stage);
+const char *perf_counter_name(PerfCounter counter);
+// Monotonic time, for timing outside a stage.
+uint64_t perf_now_ns(void);
+
+// ===== Implementation (header-only) =====
+
+uint64_t perf_now_ns(void) {
+    return (uint64_t)((double)SDL_GetPerformanceCounter() * 1e9 / (double)SDL_GetPerformanceFrequency());
+}
+
+static void _perf_read(PerfCounters *counters, uint64_t counts[perfCounterCount]) {
+    for (int i = 0; i < perfCounterCount; i++) {
+        counts[i] = 0;
+#if defined(__linux__)
+        if (counters->fds[i] >= 0 && read(counters->fds[i], &counts[i], sizeof(counts[i])) != sizeof(counts[i])) {
+            counts[i] = 0;
+        }
+#else
+        (void)counters;
+#endif
+    }
+}
+
+int perf_stats_init(PerfStats *stats, int use_counters) {
+    memset(stats, 0, sizeof(*stats));
+    stats->use_counters = use_counters;
+    stats->lock = SDL_CreateMutex();
+    if (!stats->lock) return 1;
+
+#if !defined(__linux__)
+    stats->use_counters = 0;
+    stats->open_error = ENOSYS;
+#else
+    // Probe once so a run without permission falls back up front.
+    if (stats->use_counters) {
+        PerfCounters probe;
+        perf_counters_open(stats, &probe);
+        if (probe.fds[perfCycles] < 0 && probe.fds[perfInstructions] < 0) stats->use_counters = 0;
+        perf_counters_close(&probe);
+    }
+#endif
+    return 0;
+}
+
+void perf_stats_destroy(PerfStats *stats) {
+    if (stats->lock) SDL_DestroyMutex(stats->lock);
+    memset(stats, 0, sizeof(*stats));
+}
+
+void perf_counters_open(PerfStats *stats, PerfCounters *counters) {
+    for (int i = 0; i < perfCounterCount; i++) counters->fds[i] = -1;
+    if (!stats->use_counters) return;
+
+#if defined(__linux__)
+    static const uint64_t configs[perfCounterCount] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES
+    };
+    for (int i = 0; i < perfCounterCount; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[i];
+        attr.exclude_kernel = 1;   // Allowed at perf_event_paranoid 2
+        attr.exclude_hv = 1;
+
+        // pid 0, cpu -1: this thread on any CPU.
+        counters->fds[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        if (counters->fds[i] < 0) {
+            SDL_LockMutex(stats->lock);
+            if (!stats->open_error) stats->open_error = errno;
+            stats->counters_missing |= 1 << i;
+            SDL_UnlockMutex(stats->lock);
+        }
+    }
+#endif
+}
+
+void perf_counters_close(PerfCounters *counters) {
+    for (int i = 0; i < perfCounterCount; i++) {
+#if defined(__linux__)
+        if (counters->fds[i] >= 0) close(counters->fds[i]);
+#endif
+        counters->fds[i] = -1;
+    }
+}
+
+void perf_stage_begin(PerfCounters *counters, PerfSample *sample) {
+    _perf_read(counters, sample->counts);
+    sample->start_ns = perf_now_ns();
+}
+
+void perf_stage_end(PerfStats *stats, PerfCounters *counters, const PerfSample *sample, PerfStage stage) {
+    uint64_t end_ns = perf_now_ns();
+    uint64_t counts[perfCounterCount];
+    _perf_read(counters, counts);
+
+    SDL_LockMutex(stats->lock);
+    PerfTotals *totals[2] = { &stats->page[stage], &stats->job[stage] };
+    for (int t = 0; t < 2; t++) {
+        totals[t]->calls++;
+        totals[t]->wall_ns += end_ns - sample->start_ns;
+        for (int i = 0; i < perfCounterCount; i++) totals[t]->counts[i] += counts[i] - sample->counts[i];
+    }
+    SDL_UnlockMutex(stats->lock);
+}
+
+void perf_page_take(PerfStats *stats, PerfTotals totals[perfStageCount]) {
+    SDL_LockMutex(stats->lock);
+    memcpy(totals, stats->page, sizeof(stats->page));
+    memset(stats->page, 0, sizeof(stats->page));
+    SDL_UnlockMutex(stats->lock);
+}
+
+const char *perf_stage_name(PerfStage stage) {
+    static const char *names[perfStageCount] = { "decode", "scale", "compose", "encode", "dpi" };
+    return names[stage];
+}
+
+const char *perf_counter_name(PerfCounter counter) {
+    static const char *names[perfCounterCount] = { "cycles", "instructions", "cache-misses", "branch-misses" };
+    return names[counter];
+}
+
+#endif // PERF_STATS_UTIL_H
@@ -0,0 +1,345 @@
+// png_band_util.h
+// PNG writer for pages whose top and bottom bands never change.
+//
+// The margins above and below the card grid come out the same on every page
+// of a job, yet a general PNG encoder filters and deflates them again each
+// time. Here those bands are filtered and deflated once, as raw deflate data
+// ending in a full flush, with their Adler-32 kept alongside. Each page only
+// deflates its card rows; the zlib stream is the cached top band, the card
+// rows and the cached bottom band spliced together, and the Adler-32 of the
+// whole is combined from the parts.
+//
+// A full flush leaves the deflate stream byte aligned with no references to
+// earlier data, so a band can follow anything. PNG row filters can look at
+// the row above, so the first row of a cached band only uses the None or Sub
+// filter. The rows of a cached band are compared to the page each time and
+// the band is compressed again if they differ, so a wrong band is only slower.
+//
+// Writes 8-bit RGB from XRGB8888 pixels, or 1, 2, 4 or 8-bit gray from rows
+// already packed that way (png_bands_init_gray), with a pHYs chunk when given
+// a DPI, so the file needs no second pass. Every byte written is also handed to the
+// optional sink, which lets a caller hash the file as it goes out.
+// Needs zlib (-lz).
+//
+// Usage:
+//   #include "png_band_util.h"
+//   PngBandEncoder enc;
+//   png_bands_init(&enc, width, height, top_rows, bottom_first_row, 300, 6);
+//   png_bands_write(&enc, pixels, pitch, "page01.png");   // every page
+//   png_bands_destroy(&enc);
+
+#ifndef PNG_BAND_UTIL_H
+#define PNG_BAND_UTIL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+typedef struct PngBand {
+    int first_row, rows;
+    uint8_t *pixels;          // The band's XRGB rows when it was compressed
+    uint8_t *deflated;        // Raw deflate data ending in a full flush
+    size_t deflated_size;
+    uLong adler;              // Of the filtered bytes, from 1
+    size_t filtered_size;
+    int ready;
+} PngBand;
+
+typedef struct PngBandEncoder {
+    int width, height, level;
+    int gray_bits;            // 0 for RGB from XRGB rows, else packed gray rows
+    size_t src_row;           // Bytes of a source row
+    size_t stride;            // Bytes of a PNG row, without its filter byte
+    int bpp;                  // Bytes to the pixel on the left for filters, at least 1
+    int strategy;             // zlib strategy, Z_DEFAULT_STRATEGY unless set after init
+    PngBand top, bottom;
+    uint8_t *filtered;        // Scratch for the rows being compressed
+    uint8_t *deflated;
+    size_t deflated_cap;
+    uint32_t ppm;             // pHYs pixels per meter, 0 for none
+    void (*sink)(void *ctx, const void *data, size_t size);
+    void *sink_ctx;
+    uint64_t bands_reused;
+    uint64_t bands_compressed;
+} PngBandEncoder;
+
+// API: returns 0 on success; nonzero on failure.
+// Rows [0, top_rows) and [bottom_first_row, height) are cached. dpi 0 leaves out pHYs.
+int png_bands_init(PngBandEncoder *enc, int width, int height, int top_rows, int bottom_first_row, int dpi, int level);
+// Pixels given to png_bands_write are then rows of gray packed at bits per pixel.
+int png_bands_init_gray(PngBandEncoder *enc, int width, int height, int top_rows, int bottom_first_row, int dpi, int level, int bits);
+void png_bands_destroy(PngBandEncoder *enc);
+int png_bands_write(PngBandEncoder *enc, const void *pixels, int pitch, const char *filename);
+
+// ===== Implementation (header-only) =====
+
+static void _pb_put32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24); p[1] = (uint8_t)(v >> 16); p[2] = (uint8_t)(v >> 8); p[3] = (uint8_t)v;
+}
+
+static int _pb_paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    return pb <= pc ? b : c;
+}
+
+// Filter rows [first, first + count) into out, each row a filter byte and
+// stride bytes. With independent set the first row doesn't look above.
+static size_t _pb_filter(const PngBandEncoder *enc, const uint8_t *pixels, int pitch, int first, int count, int independent, uint8_t *out) {
+    size_t stride = enc->stride;
+    size_t bpp = (size_t)enc->bpp;
+    uint8_t *scratch = (uint8_t *)malloc(stride * 7);
+    if (!scratch) return 0;
+    uint8_t *cur = scratch;
+    uint8_t *above = scratch + stride;
+    uint8_t *tries[5];
+    for (int f = 0; f < 5; f++) tries[f] = scratch + stride * (2 + f);
+
+    int row = independent ? first : first - 1;
+    int have_above = row < first && row >= 0;
+    for (; row < first + count; row++) {
+        const uint32_t *src = (const uint32_t *)(pixels + (size_t)row * pitch);
+        if (enc->gray_bits) {
+            memcpy(cur, pixels + (size_t)row * pitch, stride);
+        }
+        else {
+            for (int x = 0; x < enc->width; x++) {
+                cur[3*x] = (uint8_t)(src[x] >> 16);
+                cur[3*x + 1] = (uint8_t)(src[x] >> 8);
+                cur[3*x + 2] = (uint8_t)src[x];
+            }
+        }
+        if (row < first) {
+            uint8_t *t = above; above = cur; cur = t;
+            continue;
+        }
+
+        const uint8_t *prev = have_above ? above : NULL;
+        int filters = prev ? 5 : 2;   // Up, Average and Paeth need the row above
+        int best = 0;
+        unsigned long best_sum = (unsigned long)-1;
+        for (int f = 0; f < filters; f++) {
+            unsigned long sum = 0;
+            for (size_t i = 0; i < stride; i++) {
+                int a = i >= bpp ? cur[i - bpp] : 0;
+                int b = prev ? prev[i] : 0;
+                int c = (prev && i >= bpp) ? prev[i - bpp] : 0;
+                int v = cur[i];
+                switch (f) {
+                    case 1: v -= a; break;
+                    case 2: v -= b; break;
+                    case 3: v -= (a + b) / 2; break;
+                    case 4: v -= _pb_paeth(a, b, c); break;
+                }
+                tries[f][i] = (uint8_t)v;
+                sum += (unsigned long)abs((int)(signed char)tries[f][i]);
+            }
+            if (sum < best_sum) {
+                best_sum = sum;
+                best = f;
+            }
+        }
+        *out++ = (uint8_t)best;
+        memcpy(out, tries[best], stride);
+        out += stride;
+
+        uint8_t *t = above; above = cur; cur = t;
+        have_above = 1;
+    }
+    free(scratch);
+    return (size_t)count * (stride + 1);
+}
+
+// Raw deflate of data into enc->deflated, ending with flush.
+static int _pb_deflate(PngBandEncoder *enc, const uint8_t *data, size_t size, int flush, size_t *out_size) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, enc->level, Z_DEFLATED, -15, 8, enc->strategy) != Z_OK) return 1;
+
+    size_t need = deflateBound(&zs, (uLong)size) + 64;
+    if (need > enc->deflated_cap) {
+        uint8_t *bigger = (uint8_t *)realloc(enc->deflated, need);
+        if (!bigger) { deflateEnd(&zs); return 2; }
+        enc->deflated = bigger;
+        enc->deflated_cap = need;
+    }
+    zs.next_in = (Bytef *)data;
+    zs.avail_in = (uInt)size;
+    zs.next_out = enc->deflated;
+    zs.avail_out = (uInt)enc->deflated_cap;
+    int result = deflate(&zs, flush);
+    *out_size = enc->deflated_cap - zs.avail_out;
+    deflateEnd(&zs);
+    if (zs.avail_in != 0 || (flush == Z_FINISH ? result != Z_STREAM_END : result != Z_OK)) return 3;
+    return 0;
+}
+
+static int _pb_band_matches(const PngBandEncoder *enc, const PngBand *band, const uint8_t *pixels, int pitch) {
+    size_t row = enc->src_row;
+    for (int r = 0; r < band->rows; r++) {
+        if (memcmp(band->pixels + r * row, pixels + (size_t)(band->first_row + r) * pitch, row) != 0) return 0;
+    }
+    return 1;
+}
+
+static int _pb_band_compress(PngBandEncoder *enc, PngBand *band, const uint8_t *pixels, int pitch, int flush) {
+    size_t row = enc->src_row;
+    for (int r = 0; r < band->rows; r++) {
+        memcpy(band->pixels + r * row, pixels + (size_t)(band->first_row + r) * pitch, row);
+    }
+    band->filtered_size = _pb_filter(enc, pixels, pitch, band->first_row, band->rows, 1, enc->filtered);
+    if (band->filtered_size == 0) return 1;
+    band->adler = adler32(1L, enc->filtered, (uInt)band->filtered_size);
+
+    size_t size;
+    if (_pb_deflate(enc, enc->filtered, band->filtered_size, flush, &size) != 0) return 2;
+    uint8_t *copy = (uint8_t *)realloc(band->deflated, size ? size : 1);
+    if (!copy) return 3;
+    memcpy(copy, enc->deflated, size);
+    band->deflated = copy;
+    band->deflated_size = size;
+    band->ready = 1;
+    enc->bands_compressed++;
+    return 0;
+}
+
+int png_bands_init(PngBandEncoder *enc, int width, int height, int top_rows, int bottom_first_row, int dpi, int level) {
+    return png_bands_init_gray(enc, width, height, top_rows, bottom_first_row, dpi, level, 0);
+}
+
+int png_bands_init_gray(PngBandEncoder *enc, int width, int height, int top_rows, int bottom_first_row, int dpi, int level, int bits) {
+    memset(enc, 0, sizeof(*enc));
+    if (width <= 0 || height <= 0) return 1;
+    if (bits != 0 && bits != 1 && bits != 2 && bits != 4 && bits != 8) return 1;
+    if (top_rows < 0) top_rows = 0;
+    if (bottom_first_row > height) bottom_first_row = height;
+    if (bottom_first_row < top_rows) bottom_first_row = top_rows;
+
+    enc->width = width;
+    enc->height = height;
+    enc->level = level;
+    enc->gray_bits = bits;
+    enc->stride = bits ? ((size_t)width * bits + 7) / 8 : (size_t)width * 3;
+    enc->src_row = bits ? enc->stride : (size_t)width * 4;
+    enc->bpp = bits ? 1 : 3;
+    enc->strategy = Z_DEFAULT_STRATEGY;
+    enc->ppm = dpi > 0 ? (uint32_t)(dpi * 39.37007874 + 0.5) : 0;   // 1/0.0254
+    enc->top.first_row = 0;
+    enc->top.rows = top_rows;
+    enc->bottom.first_row = bottom_first_row;
+    enc->bottom.rows = height - bottom_first_row;
+
+    size_t row = enc->src_row;
+    enc->filtered = (uint8_t *)malloc((enc->stride + 1) * (size_t)height);
+    enc->top.pixels = (uint8_t *)malloc(row * (size_t)(top_rows ? top_rows : 1));
+    enc->bottom.pixels = (uint8_t *)malloc(row * (size_t)(enc->bottom.rows ? enc->bottom.rows : 1));
+    if (!enc->filtered || !enc->top.pixels || !enc->bottom.pixels) {
+        png_bands_destroy(enc);
+        return 2;
+    }
+    return 0;
+}
+
+void png_bands_destroy(PngBandEncoder *enc) {
+    free(enc->filtered);
+    free(enc->deflated);
+    free(enc->top.pixels);
+    free(enc->top.deflated);
+    free(enc->bottom.pixels);
+    free(enc->bottom.deflated);
+    memset(enc, 0, sizeof(*enc));
+}
+
+static int _pb_fwrite(const PngBandEncoder *enc, FILE *f, const void *data, size_t size) {
+    if (size == 0) return 1;
+    if (fwrite(data, 1, size, f) != size) return 0;
+    if (enc->sink) enc->sink(enc->sink_ctx, data, size);
+    return 1;
+}
+
+static int _pb_write_chunk(const PngBandEncoder *enc, FILE *f, const char *type, const uint8_t *head, size_t head_size, const uint8_t *data, size_t size, const uint8_t *tail, size_t tail_size) {
+    uint8_t buf[8];
+    _pb_put32(buf, (uint32_t)(head_size + size + tail_size));
+    memcpy(buf + 4, type, 4);
+    uLong crc = crc32(0L, (const Bytef *)type, 4);
+    if (head_size) crc = crc32(crc, head, (uInt)head_size);
+    if (size) crc = crc32(crc, data, (uInt)size);
+    if (tail_size) crc = crc32(crc, tail, (uInt)tail_size);
+    uint8_t crc_bytes[4];
+    _pb_put32(crc_bytes, (uint32_t)crc);
+    return _pb_fwrite(enc, f, buf, 8) &&
+        _pb_fwrite(enc, f, head, head_size) &&
+        _pb_fwrite(enc, f, data, size) &&
+        _pb_fwrite(enc, f, tail, tail_size) &&
+        _pb_fwrite(enc, f, crc_bytes, 4);
+}
+
+int png_bands_write(PngBandEncoder *enc, const void *pixels, int pitch, const char *filename) {
+    const uint8_t *px = (const uint8_t *)pixels;
+    int has_bottom = enc->bottom.rows > 0;
+    int middle_first = enc->top.rows;
+    int middle_rows = enc->bottom.first_row - middle_first;
+
+    if (enc->top.rows > 0 && !(enc->top.ready && _pb_band_matches(enc, &enc->top, px, pitch))) {
+        int flush = (middle_rows > 0 || has_bottom) ? Z_FULL_FLUSH : Z_FINISH;
+        if (_pb_band_compress(enc, &enc->top, px, pitch, flush) != 0) return 1;
+    }
+    else if (enc->top.rows > 0) {
+        enc->bands_reused++;
+    }
+    if (has_bottom && !(enc->bottom.ready && _pb_band_matches(enc, &enc->bottom, px, pitch))) {
+        if (_pb_band_compress(enc, &enc->bottom, px, pitch, Z_FINISH) != 0) return 1;
+    }
+    else if (has_bottom) {
+        enc->bands_reused++;
+    }
+
+    // The card rows, done last so enc->deflated holds them.
+    size_t middle_filtered = 0, middle_size = 0;
+    uLong middle_adler = 1L;
+    if (middle_rows > 0) {
+        middle_filtered = _pb_filter(enc, px, pitch, middle_first, middle_rows, 0, enc->filtered);
+        if (middle_filtered == 0) return 1;
+        middle_adler = adler32(1L, enc->filtered, (uInt)middle_filtered);
+        if (_pb_deflate(enc, enc->filtered, middle_filtered, has_bottom ? Z_FULL_FLUSH : Z_FINISH, &middle_size) != 0) return 2;
+    }
+
+    uLong adler = enc->top.rows > 0 ? enc->top.adler : 1L;
+    if (middle_rows > 0) adler = adler32_combine(adler, middle_adler, (z_off_t)middle_filtered);
+    if (has_bottom) adler = adler32_combine(adler, enc->bottom.adler, (z_off_t)enc->bottom.filtered_size);
+
+    FILE *f = fopen(filename, "wb");
+    if (!f) return 3;
+
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    uint8_t ihdr[13];
+    _pb_put32(ihdr, (uint32_t)enc->width);
+    _pb_put32(ihdr + 4, (uint32_t)enc->height);
+    ihdr[8] = (uint8_t)(enc->gray_bits ? enc->gray_bits : 8);   // Bit depth
+    ihdr[9] = enc->gray_bits ? 0 : 2;                             // Gray or RGB
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+    uint8_t phys[9];
+    _pb_put32(phys, enc->ppm);
+    _pb_put32(phys + 4, enc->ppm);
+    phys[8] = 1;    // Meters
+
+    // zlib header for the default window; FLEVEL is only a hint.
+    static const uint8_t zlib_header[2] = { 0x78, 0x9c };
+    uint8_t zlib_trailer[4];
+    _pb_put32(zlib_trailer, (uint32_t)adler);
+
+    int ok = _pb_fwrite(enc, f, signature, 8) &&
+        _pb_write_chunk(enc, f, "IHDR", NULL, 0, ihdr, 13, NULL, 0) &&
+        (enc->ppm == 0 || _pb_write_chunk(enc, f, "pHYs", NULL, 0, phys, 9, NULL, 0)) &&
+        _pb_write_chunk(enc, f, "IDAT", zlib_header, 2, enc->top.deflated, enc->top.rows > 0 ? enc->top.deflated_size : 0, NULL, 0) &&
+        (middle_rows <= 0 || _pb_write_chunk(enc, f, "IDAT", NULL, 0, enc->deflated, middle_size, NULL, 0)) &&
+        _pb_write_chunk(enc, f, "IDAT", NULL, 0, enc->bottom.deflated, has_bottom ? enc->bottom.deflated_size : 0, zlib_trailer, 4) &&
+        _pb_write_chunk(enc, f, "IEND", NULL, 0, NULL, 0, NULL, 0);
+    if (fclose(f) != 0) ok = 0;
+    return ok ? 0 : 4;
+}
+
+#endif // PNG_BAND_UTIL_H
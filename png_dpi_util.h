@@ -61,6 +61,9 @@ static const uint8_t PNG_SIG[PNG_SIG_BYTES] = {0x89,'P','N','G',0x0D,0x0A,0x1A,0
 // Fixed global buffers (no heap). OUT has small headroom for inserting a pHYs.
 static unsigned char PNG_IN_BUF [MAX_PNG_SIZE];
 static unsigned char PNG_OUT_BUF[MAX_PNG_SIZE + 64];  // +64 to accommodate a new pHYs
+// Bytes of PNG_OUT_BUF written by the last successful update_png_dpi,
+// which are exactly the file's contents.
+static size_t PNG_OUT_SIZE = 0;
 
 // CRC32 (same polynomial as libpng/zlib)
 static uint32_t _png_crc_table[256];
@@ -188,10 +191,12 @@ int update_png_dpi(const char *path, int dpi) {
     // If file had no IDAT (malformed), we didn't inject; that's fine. Otherwise pHYs was injected.
 
     // Now write OUT buffer back to the same path (truncate+write)
+    PNG_OUT_SIZE = 0;
     f = fopen(path, "wb");
     if (!f) return 2;
     if (fwrite(PNG_OUT_BUF, 1, out_off, f) != out_off) { fclose(f); return 24; }
     if (fclose(f) != 0) return 30;
+    PNG_OUT_SIZE = out_off;
     return 0;
 }
 
@@ -0,0 +1,334 @@
+// png_stream_util.h
+// PNG reader that hands out one row at a time, for sources too large to
+// decode whole.
+//
+// IDAT data is inflated only as far as the next row needs, and only the row
+// and the one above it (for unfiltering) are kept, so memory doesn't depend
+// on the image height. Rows come out as ARGB8888 with straight alpha, the
+// way SDL_image's loader and SDL_ConvertSurfaceFormat would leave them:
+// 16-bit samples keep their high byte, low-bit gray is scaled up to 8 bits,
+// and tRNS turns the matching color transparent. Ancillary chunks (gamma,
+// ICC profiles) are ignored, as SDL_image does. Interlaced images aren't
+// supported and fail to open, so the caller can decode them in full.
+// Needs zlib (-lz).
+//
+// Usage:
+//   #include "png_stream_util.h"
+//   PngStream ps;
+//   if (png_stream_open(&ps, "scan.png", NULL, 0) == 0) {   // or a buffer
+//       uint32_t *row = malloc(ps.width * 4);
+//       for (int y = 0; y < ps.height; y++) png_stream_read_row(&ps, row);
+//       png_stream_close(&ps);
+//   }
+
+#ifndef PNG_STREAM_UTIL_H
+#define PNG_STREAM_UTIL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#define PNG_STREAM_INPUT 65536
+
+typedef struct PngStream {
+    int width, height;
+    int bit_depth, color_type;
+    FILE *file;                   // Input is the file, or else data
+    const unsigned char *data;
+    size_t size, pos;
+
+    int channels;
+    size_t row_bytes;             // Without the filter byte
+    int bpp;                      // Bytes per complete pixel, at least 1
+    uint32_t palette[256];        // ARGB, tRNS alpha applied
+    int has_trns;
+    uint16_t trns[3];             // Gray, or R G B, at the image's bit depth
+
+    z_stream z;
+    int z_ready;
+    uint32_t idat_left;           // Of the IDAT chunk being read
+    unsigned char *rows;          // prev and cur
+    unsigned char *prev, *cur;    // Unfiltered rows, each after a filter byte
+    unsigned char input[PNG_STREAM_INPUT];
+    int rows_read;
+} PngStream;
+
+// API: returns 0 on success; nonzero on failure.
+// Reads the file at path, or size bytes of data when path is NULL, up to the
+// first IDAT chunk. Fails with 2 for a valid PNG this reader doesn't handle.
+int png_stream_open(PngStream *ps, const char *path, const unsigned char *data, size_t size);
+// Reads the next row into width ARGB8888 pixels.
+int png_stream_read_row(PngStream *ps, uint32_t *argb);
+void png_stream_close(PngStream *ps);
+
+// ===== Implementation (header-only) =====
+
+static int _ps_read(PngStream *ps, void *buf, size_t n) {
+    if (ps->file) return fread(buf, 1, n, ps->file) == n ? 0 : 1;
+    if (ps->size - ps->pos < n) return 1;
+    memcpy(buf, ps->data + ps->pos, n);
+    ps->pos += n;
+    return 0;
+}
+
+static int _ps_skip(PngStream *ps, uint32_t n) {
+    if (ps->file) return fseek(ps->file, (long)n, SEEK_CUR) != 0;
+    if (ps->size - ps->pos < n) return 1;
+    ps->pos += n;
+    return 0;
+}
+
+static uint32_t _ps_be32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+// Reads a chunk's length and type.
+static int _ps_chunk(PngStream *ps, uint32_t *length, char type[5]) {
+    unsigned char header[8];
+    if (_ps_read(ps, header, 8) != 0) return 1;
+    *length = _ps_be32(header);
+    memcpy(type, header + 4, 4);
+    type[4] = '\0';
+    return *length > 0x7fffffffu;
+}
+
+static int _ps_check_format(int bit_depth, int color_type) {
+    switch (color_type) {
+    case 0: return bit_depth == 1 || bit_depth == 2 || bit_depth == 4 || bit_depth == 8 || bit_depth == 16;
+    case 3: return bit_depth == 1 || bit_depth == 2 || bit_depth == 4 || bit_depth == 8;
+    case 2: case 4: case 6: return bit_depth == 8 || bit_depth == 16;
+    default: return 0;
+    }
+}
+
+int png_stream_open(PngStream *ps, const char *path, const unsigned char *data, size_t size) {
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    memset(ps, 0, sizeof(*ps));
+    if (path) {
+        ps->file = fopen(path, "rb");
+        if (!ps->file) return 1;
+    }
+    else {
+        ps->data = data;
+        ps->size = size;
+    }
+
+    unsigned char buf[768];
+    uint32_t length;
+    char type[5];
+    if (_ps_read(ps, buf, 8) != 0 || memcmp(buf, signature, 8) != 0 ||
+        _ps_chunk(ps, &length, type) != 0 || strcmp(type, "IHDR") != 0 || length != 13 ||
+        _ps_read(ps, buf, 13 + 4) != 0) {
+        png_stream_close(ps);
+        return 1;
+    }
+    ps->width = (int)_ps_be32(buf);
+    ps->height = (int)_ps_be32(buf + 4);
+    ps->bit_depth = buf[8];
+    ps->color_type = buf[9];
+    if (ps->width <= 0 || ps->height <= 0 || !_ps_check_format(ps->bit_depth, ps->color_type) || buf[10] != 0 || buf[11] != 0) {
+        png_stream_close(ps);
+        return 1;
+    }
+    if (buf[12] != 0) {
+        png_stream_close(ps);
+        return 2;
+    }
+
+    static const int channels[7] = { 1, 0, 3, 1, 2, 0, 4 };
+    ps->channels = channels[ps->color_type];
+    ps->row_bytes = ((size_t)ps->width * (size_t)(ps->channels * ps->bit_depth) + 7) / 8;
+    ps->bpp = ps->channels * ps->bit_depth >= 8 ? ps->channels * ps->bit_depth / 8 : 1;
+    for (int i = 0; i < 256; i++) ps->palette[i] = 0xff000000u;
+
+    // Up to the first IDAT: the palette and transparency are all we need.
+    for (;;) {
+        if (_ps_chunk(ps, &length, type) != 0) {
+            png_stream_close(ps);
+            return 1;
+        }
+        if (strcmp(type, "IDAT") == 0) break;
+        int failed = 0;
+        if (strcmp(type, "PLTE") == 0 && length <= 768 && length % 3 == 0) {
+            failed = _ps_read(ps, buf, length) != 0;
+            for (uint32_t i = 0; !failed && i < length / 3; i++) {
+                ps->palette[i] = 0xff000000u | (uint32_t)buf[3*i] << 16 | (uint32_t)buf[3*i + 1] << 8 | buf[3*i + 2];
+            }
+            failed = failed || _ps_skip(ps, 4) != 0;
+        }
+        else if (strcmp(type, "tRNS") == 0 && length <= 256) {
+            failed = _ps_read(ps, buf, length) != 0 || _ps_skip(ps, 4) != 0;
+            if (!failed && ps->color_type == 3) {
+                for (uint32_t i = 0; i < length; i++) ps->palette[i] = (ps->palette[i] & 0xffffffu) | (uint32_t)buf[i] << 24;
+            }
+            else if (!failed && (ps->color_type == 0 || ps->color_type == 2) && length == (uint32_t)ps->channels * 2) {
+                for (int i = 0; i < ps->channels; i++) ps->trns[i] = (uint16_t)(buf[2*i] << 8 | buf[2*i + 1]);
+                ps->has_trns = 1;
+            }
+        }
+        else if (strcmp(type, "IEND") == 0) {
+            failed = 1;
+        }
+        else {
+            failed = _ps_skip(ps, length + 4) != 0;
+        }
+        if (failed) {
+            png_stream_close(ps);
+            return 1;
+        }
+    }
+    ps->idat_left = length;
+
+    ps->rows = (unsigned char *)calloc(2, ps->row_bytes + 1);
+    if (!ps->rows || inflateInit(&ps->z) != Z_OK) {
+        png_stream_close(ps);
+        return 1;
+    }
+    ps->z_ready = 1;
+    ps->prev = ps->rows;
+    ps->cur = ps->rows + ps->row_bytes + 1;
+    return 0;
+}
+
+// Refills the inflate input from the current IDAT chunk or the ones after it.
+static int _ps_refill(PngStream *ps) {
+    while (ps->idat_left == 0) {
+        uint32_t length;
+        char type[5];
+        if (_ps_skip(ps, 4) != 0 || _ps_chunk(ps, &length, type) != 0 || strcmp(type, "IDAT") != 0) return 1;
+        ps->idat_left = length;
+    }
+    uint32_t n = ps->idat_left < PNG_STREAM_INPUT ? ps->idat_left : PNG_STREAM_INPUT;
+    if (_ps_read(ps, ps->input, n) != 0) return 1;
+    ps->idat_left -= n;
+    ps->z.next_in = ps->input;
+    ps->z.avail_in = n;
+    return 0;
+}
+
+static uint8_t _ps_paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return (uint8_t)a;
+    return (uint8_t)(pb <= pc ? b : c);
+}
+
+static int _ps_unfilter(PngStream *ps) {
+    unsigned char *row = ps->cur + 1;
+    const unsigned char *up = ps->prev + 1;
+    size_t n = ps->row_bytes;
+    int bpp = ps->bpp;
+    switch (ps->cur[0]) {
+    case 0:
+        break;
+    case 1:
+        for (size_t i = (size_t)bpp; i < n; i++) row[i] = (uint8_t)(row[i] + row[i - bpp]);
+        break;
+    case 2:
+        for (size_t i = 0; i < n; i++) row[i] = (uint8_t)(row[i] + up[i]);
+        break;
+    case 3:
+        for (size_t i = 0; i < n; i++) {
+            int left = i >= (size_t)bpp ? row[i - bpp] : 0;
+            row[i] = (uint8_t)(row[i] + ((left + up[i]) >> 1));
+        }
+        break;
+    case 4:
+        for (size_t i = 0; i < n; i++) {
+            int left = i >= (size_t)bpp ? row[i - bpp] : 0;
+            int corner = i >= (size_t)bpp ? up[i - bpp] : 0;
+            row[i] = (uint8_t)(row[i] + _ps_paeth(left, up[i], corner));
+        }
+        break;
+    default:
+        return 1;
+    }
+    return 0;
+}
+
+// Sample x of channel c, at the image's bit depth.
+static uint16_t _ps_sample(const PngStream *ps, const unsigned char *row, int x, int c) {
+    if (ps->bit_depth == 16) {
+        const unsigned char *p = row + ((size_t)x * ps->channels + c) * 2;
+        return (uint16_t)(p[0] << 8 | p[1]);
+    }
+    if (ps->bit_depth == 8) return row[(size_t)x * ps->channels + c];
+    int per_byte = 8 / ps->bit_depth;
+    int shift = 8 - ps->bit_depth * (x % per_byte + 1);
+    return (uint16_t)((row[x / per_byte] >> shift) & ((1 << ps->bit_depth) - 1));
+}
+
+static uint32_t _ps_to8(const PngStream *ps, uint16_t v) {
+    if (ps->bit_depth == 16) return v >> 8;
+    return (uint32_t)v * 255 / ((1u << ps->bit_depth) - 1);
+}
+
+int png_stream_read_row(PngStream *ps, uint32_t *argb) {
+    if (!ps->z_ready || ps->rows_read >= ps->height) return 1;
+    unsigned char *swap = ps->prev;
+    ps->prev = ps->cur;
+    ps->cur = swap;
+
+    ps->z.next_out = ps->cur;
+    ps->z.avail_out = (uInt)(ps->row_bytes + 1);
+    while (ps->z.avail_out > 0) {
+        if (ps->z.avail_in == 0 && _ps_refill(ps) != 0) return 1;
+        int result = inflate(&ps->z, Z_NO_FLUSH);
+        if (result == Z_STREAM_END && ps->z.avail_out > 0) return 1;
+        if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) return 1;
+    }
+    if (_ps_unfilter(ps) != 0) return 1;
+    ps->rows_read++;
+
+    const unsigned char *row = ps->cur + 1;
+    if (ps->bit_depth == 8 && (ps->color_type == 6 || (ps->color_type == 2 && !ps->has_trns))) {
+        // The usual card art, without the per-sample work below.
+        int alpha = ps->color_type == 6;
+        for (int x = 0; x < ps->width; x++, row += ps->channels) {
+            argb[x] = (alpha ? (uint32_t)row[3] << 24 : 0xff000000u) | (uint32_t)row[0] << 16 | (uint32_t)row[1] << 8 | row[2];
+        }
+        return 0;
+    }
+    for (int x = 0; x < ps->width; x++) {
+        uint32_t a = 255, r, g, b;
+        switch (ps->color_type) {
+        case 0: {
+            uint16_t v = _ps_sample(ps, row, x, 0);
+            if (ps->has_trns && v == ps->trns[0]) a = 0;
+            r = g = b = _ps_to8(ps, v);
+            break;
+        }
+        case 3:
+            argb[x] = ps->palette[_ps_sample(ps, row, x, 0)];
+            continue;
+        case 4:
+            r = g = b = _ps_to8(ps, _ps_sample(ps, row, x, 0));
+            a = _ps_to8(ps, _ps_sample(ps, row, x, 1));
+            break;
+        default: {
+            uint16_t rv = _ps_sample(ps, row, x, 0), gv = _ps_sample(ps, row, x, 1), bv = _ps_sample(ps, row, x, 2);
+            if (ps->color_type == 2 && ps->has_trns && rv == ps->trns[0] && gv == ps->trns[1] && bv == ps->trns[2]) a = 0;
+            r = _ps_to8(ps, rv);
+            g = _ps_to8(ps, gv);
+            b = _ps_to8(ps, bv);
+            if (ps->color_type == 6) a = _ps_to8(ps, _ps_sample(ps, row, x, 3));
+            break;
+        }
+        }
+        argb[x] = a << 24 | r << 16 | g << 8 | b;
+    }
+    return 0;
+}
+
+void png_stream_close(PngStream *ps) {
+    if (ps->z_ready) inflateEnd(&ps->z);
+    ps->z_ready = 0;
+    if (ps->file) fclose(ps->file);
+    ps->file = NULL;
+    free(ps->rows);
+    ps->rows = ps->prev = ps->cur = NULL;
+}
+
+#endif // PNG_STREAM_UTIL_H
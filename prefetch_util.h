@@ -0,0 +1,413 @@
+// prefetch_util.h
+// Read card files ahead of the renderer in storage order.
+//
+// Files are registered in the order pages need them and grouped into
+// batches of a few pages. A reader thread reads each batch sorted by where
+// the files live on disk (the first physical extent from FIEMAP on Linux,
+// or the inode number when that isn't available) so spinning disks and
+// network volumes see mostly forward reads. The renderer still takes the
+// files in page order; prefetch_take blocks until the file is in memory.
+//
+// At most two batches are read ahead at once: the one being rendered and
+// the next one. A file stays in memory after its batch until everyone who
+// took it has released it, since loads for the next page may still be
+// decoding a file first used by the page before.
+//
+// Usage:
+//   #include "prefetch_util.h"
+//   Prefetcher pf;
+//   prefetch_init(&pf, 4);              // 4 pages per batch
+//   prefetch_add(&pf, "a.png", page);   // for every file, in page order
+//   prefetch_start(&pf);
+//   prefetch_advance(&pf, page);        // before rendering each page
+//   prefetch_take(&pf, "a.png", &data, &size);
+//   prefetch_release(&pf, "a.png");     // once done with the bytes
+//   prefetch_destroy(&pf);
+
+#ifndef PREFETCH_UTIL_H
+#define PREFETCH_UTIL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <SDL2/SDL.h>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+
+#ifndef PREFETCH_PATHLEN
+#define PREFETCH_PATHLEN 128
+#endif
+
+typedef enum PrefetchOrder {
+    prefetchOrderConfig = 0,   // No storage information; keep page order
+    prefetchOrderInode = 1,
+    prefetchOrderExtent = 2
+} PrefetchOrder;
+
+typedef enum PrefetchState {
+    prefetchPending = 0,
+    prefetchLoaded = 1,
+    prefetchFailed = 2,
+    prefetchFreed = 3
+} PrefetchState;
+
+typedef struct PrefetchFile {
+    char path[PREFETCH_PATHLEN];
+    int batch;
+    uint64_t inode;
+    uint64_t extent;     // Physical byte offset of the first extent
+    int has_extent;
+    PrefetchState state;
+    unsigned char *data;
+    size_t size;
+    int taken;
+    int users;           // Takes not released yet
+} PrefetchFile;
+
+typedef struct Prefetcher {
+    int pages_per_batch;
+    PrefetchFile *files;
+    int file_count;
+    int file_cap;
+    int *slots;          // Open-addressed path -> file index, -1 if empty
+    int slot_cap;
+    int batch_count;
+
+    SDL_mutex *lock;
+    SDL_cond *changed;
+    SDL_Thread *reader;
+    int current_batch;   // Batch the renderer is on
+    int stop;
+    SDL_atomic_t queued; // Files read and not taken by the renderer yet
+
+    // Reported after the run
+    PrefetchOrder order;
+    uint64_t bytes_read;
+    uint64_t files_read;
+    uint64_t read_ticks;  // SDL performance counter ticks spent reading
+} Prefetcher;
+
+// API: returns 0 on success; nonzero on failure.
+int prefetch_init(Prefetcher *pf, int pages_per_batch);
+// Register a file needed by page. Repeated paths keep their first page.
+int prefetch_add(Prefetcher *pf, const char *path, int page);
+int prefetch_start(Prefetcher *pf);
+// Tell the reader the renderer moved on to page; older batches are freed,
+// or as soon as they are released if still in use.
+void prefetch_advance(Prefetcher *pf, int page);
+// Returns 0 and the file's bytes once read, nonzero if the file wasn't
+// registered, was already freed or couldn't be read. The bytes stay valid
+// until prefetch_release, which every successful take needs.
+int prefetch_take(Prefetcher *pf, const char *path, const unsigned char **data, size_t *size);
+void prefetch_release(Prefetcher *pf, const char *path);
+void prefetch_destroy(Prefetcher *pf);
+// Read throughput in MB/s of the reads done so far.
+double prefetch_throughput(Prefetcher *pf);
+const char *prefetch_order_name(PrefetchOrder order);
+
+// ===== Implementation (header-only) =====
+
+static uint32_t _pf_hash(const char *s) {
+    uint32_t h = 2166136261u;   // FNV-1a
+    while (*s) {
+        h ^= (uint8_t)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int _pf_find_slot(const Prefetcher *pf, const char *path) {
+    uint32_t i = _pf_hash(path) & (uint32_t)(pf->slot_cap - 1);
+    while (pf->slots[i] >= 0 && strncmp(pf->files[pf->slots[i]].path, path, PREFETCH_PATHLEN) != 0) {
+        i = (i + 1) & (uint32_t)(pf->slot_cap - 1);
+    }
+    return (int)i;
+}
+
+// Where the file lives on disk. Fills inode always, extent when the
+// filesystem reports one.
+static void _pf_locate(PrefetchFile *file) {
+    struct stat st;
+    file->inode = 0;
+    file->has_extent = 0;
+    if (stat(file->path, &st) == 0) file->inode = (uint64_t)st.st_ino;
+
+#if defined(__linux__) && defined(FS_IOC_FIEMAP)
+    int fd = open(file->path, O_RDONLY);
+    if (fd < 0) return;
+
+    union {
+        struct fiemap map;
+        char buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+    } fm;
+    memset(&fm, 0, sizeof(fm));
+    fm.map.fm_start = 0;
+    fm.map.fm_length = ~(uint64_t)0;
+    fm.map.fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, &fm.map) == 0 && fm.map.fm_mapped_extents >= 1) {
+        // Inline and not-yet-allocated data have no meaningful address.
+        const struct fiemap_extent *e = &fm.map.fm_extents[0];
+        if (!(e->fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE))) {
+            file->extent = e->fe_physical;
+            file->has_extent = 1;
+        }
+    }
+    close(fd);
+#endif
+}
+
+static PrefetchOrder _pf_sort_order;
+
+static int _pf_compare(const void *a, const void *b) {
+    const PrefetchFile *fa = (const PrefetchFile *)a;
+    const PrefetchFile *fb = (const PrefetchFile *)b;
+    if (fa->batch != fb->batch) return fa->batch - fb->batch;
+
+    uint64_t ka = 0, kb = 0;
+    if (_pf_sort_order == prefetchOrderExtent) { ka = fa->extent; kb = fb->extent; }
+    else if (_pf_sort_order == prefetchOrderInode) { ka = fa->inode; kb = fb->inode; }
+    if (ka != kb) return ka < kb ? -1 : 1;
+    return 0;
+}
+
+static int _pf_reader(void *data) {
+    Prefetcher *pf = (Prefetcher *)data;
+
+    for (int i = 0; i < pf->file_count; i++) {
+        PrefetchFile *file = &pf->files[i];
+
+        // Stay at most one batch ahead of the renderer.
+        SDL_LockMutex(pf->lock);
+        while (!pf->stop && file->batch > pf->current_batch + 1) SDL_CondWait(pf->changed, pf->lock);
+        int skip = pf->stop || file->batch < pf->current_batch;
+        SDL_UnlockMutex(pf->lock);
+        if (pf->stop) break;
+        if (skip) continue;
+
+        Uint64 start = SDL_GetPerformanceCounter();
+        unsigned char *bytes = NULL;
+        size_t size = 0;
+        FILE *f = fopen(file->path, "rb");
+        if (f) {
+            struct stat st;
+            if (stat(file->path, &st) == 0 && st.st_size > 0) {
+                size = (size_t)st.st_size;
+                bytes = (unsigned char *)malloc(size);
+                if (bytes && fread(bytes, 1, size, f) != size) {
+                    free(bytes);
+                    bytes = NULL;
+                }
+            }
+            fclose(f);
+        }
+        Uint64 elapsed = SDL_GetPerformanceCounter() - start;
+
+        SDL_LockMutex(pf->lock);
+        pf->read_ticks += elapsed;
+        if (file->batch < pf->current_batch) {
+            // The renderer already moved past it.
+            free(bytes);
+            file->state = prefetchFreed;
+        }
+        else if (bytes) {
+            file->data = bytes;
+            file->size = size;
+            file->state = prefetchLoaded;
+            SDL_AtomicAdd(&pf->queued, 1);
+            pf->bytes_read += size;
+            pf->files_read++;
+        }
+        else {
+            file->state = prefetchFailed;
+        }
+        SDL_CondBroadcast(pf->changed);
+        SDL_UnlockMutex(pf->lock);
+    }
+    return 0;
+}
+
+int prefetch_init(Prefetcher *pf, int pages_per_batch) {
+    memset(pf, 0, sizeof(*pf));
+    pf->pages_per_batch = pages_per_batch > 0 ? pages_per_batch : 1;
+    pf->slot_cap = 1024;
+    pf->slots = (int *)malloc(sizeof(int) * (size_t)pf->slot_cap);
+    pf->lock = SDL_CreateMutex();
+    pf->changed = SDL_CreateCond();
+    if (!pf->slots || !pf->lock || !pf->changed) {
+        prefetch_destroy(pf);
+        return 1;
+    }
+    memset(pf->slots, 0xFF, sizeof(int) * (size_t)pf->slot_cap);
+    return 0;
+}
+
+int prefetch_add(Prefetcher *pf, const char *path, int page) {
+    if (pf->reader) return 1;   // Too late, already started
+    if (strlen(path) >= PREFETCH_PATHLEN) return 2;
+
+    if (pf->slots[_pf_find_slot(pf, path)] >= 0) return 0;
+
+    // Keep the table at most half full.
+    if ((pf->file_count + 1) * 2 > pf->slot_cap) {
+        int *old = pf->slots;
+        int old_cap = pf->slot_cap;
+        pf->slot_cap *= 2;
+        pf->slots = (int *)malloc(sizeof(int) * (size_t)pf->slot_cap);
+        if (!pf->slots) { pf->slots = old; pf->slot_cap = old_cap; return 3; }
+        memset(pf->slots, 0xFF, sizeof(int) * (size_t)pf->slot_cap);
+        for (int i = 0; i < old_cap; i++) {
+            if (old[i] >= 0) pf->slots[_pf_find_slot(pf, pf->files[old[i]].path)] = old[i];
+        }
+        free(old);
+    }
+    if (pf->file_count == pf->file_cap) {
+        int cap = pf->file_cap ? pf->file_cap * 2 : 64;
+        PrefetchFile *files = (PrefetchFile *)realloc(pf->files, sizeof(PrefetchFile) * (size_t)cap);
+        if (!files) return 3;
+        pf->files = files;
+        pf->file_cap = cap;
+    }
+
+    PrefetchFile *file = &pf->files[pf->file_count];
+    memset(file, 0, sizeof(*file));
+    strncpy(file->path, path, PREFETCH_PATHLEN - 1);
+    file->batch = page / pf->pages_per_batch;
+    if (file->batch + 1 > pf->batch_count) pf->batch_count = file->batch + 1;
+    pf->slots[_pf_find_slot(pf, path)] = pf->file_count;
+    pf->file_count++;
+    return 0;
+}
+
+int prefetch_start(Prefetcher *pf) {
+    if (pf->reader || pf->file_count == 0) return 0;
+
+    // Mixing extents and inode numbers would make no sense, so extents
+    // are only used when every file has one.
+    int all_extents = 1, all_inodes = 1;
+    for (int i = 0; i < pf->file_count; i++) {
+        _pf_locate(&pf->files[i]);
+        all_extents = all_extents && pf->files[i].has_extent;
+        all_inodes = all_inodes && pf->files[i].inode != 0;
+    }
+    pf->order = all_extents ? prefetchOrderExtent : (all_inodes ? prefetchOrderInode : prefetchOrderConfig);
+
+    // Files arrive nearly sorted by batch already. Insertion sort is
+    // stable, so files without storage information keep page order.
+    _pf_sort_order = pf->order;
+    for (int i = 1; i < pf->file_count; i++) {
+        PrefetchFile tmp = pf->files[i];
+        int j = i - 1;
+        while (j >= 0 && _pf_compare(&pf->files[j], &tmp) > 0) {
+            pf->files[j + 1] = pf->files[j];
+            j--;
+        }
+        pf->files[j + 1] = tmp;
+    }
+
+    memset(pf->slots, 0xFF, sizeof(int) * (size_t)pf->slot_cap);
+    for (int i = 0; i < pf->file_count; i++) {
+        pf->slots[_pf_find_slot(pf, pf->files[i].path)] = i;
+    }
+
+    pf->reader = SDL_CreateThread(_pf_reader, "prefetch", pf);
+    return pf->reader ? 0 : 1;
+}
+
+void prefetch_advance(Prefetcher *pf, int page) {
+    SDL_LockMutex(pf->lock);
+    int batch = page / pf->pages_per_batch;
+    if (batch > pf->current_batch) {
+        for (int i = 0; i < pf->file_count; i++) {
+            PrefetchFile *file = &pf->files[i];
+            if (file->batch < batch && file->state == prefetchLoaded && file->users == 0) {
+                if (!file->taken) SDL_AtomicAdd(&pf->queued, -1);
+                free(file->data);
+                file->data = NULL;
+                file->state = prefetchFreed;
+            }
+        }
+        pf->current_batch = batch;
+        SDL_CondBroadcast(pf->changed);
+    }
+    SDL_UnlockMutex(pf->lock);
+}
+
+int prefetch_take(Prefetcher *pf, const char *path, const unsigned char **data, size_t *size) {
+    if (!pf->reader) return 1;
+
+    SDL_LockMutex(pf->lock);
+    int index = pf->slots[_pf_find_slot(pf, path)];
+    if (index < 0 || pf->files[index].batch < pf->current_batch) {
+        SDL_UnlockMutex(pf->lock);
+        return 1;
+    }
+
+    PrefetchFile *file = &pf->files[index];
+    while (file->state == prefetchPending) SDL_CondWait(pf->changed, pf->lock);
+    int rc = 2;
+    if (file->state == prefetchLoaded) {
+        if (!file->taken) SDL_AtomicAdd(&pf->queued, -1);
+        file->taken = 1;
+        file->users++;
+        *data = file->data;
+        *size = file->size;
+        rc = 0;
+    }
+    SDL_UnlockMutex(pf->lock);
+    return rc;
+}
+
+void prefetch_release(Prefetcher *pf, const char *path) {
+    SDL_LockMutex(pf->lock);
+    int index = pf->slots[_pf_find_slot(pf, path)];
+    PrefetchFile *file = index >= 0 ? &pf->files[index] : NULL;
+    if (file && file->users > 0 && --file->users == 0 && file->batch < pf->current_batch) {
+        // The renderer moved past it while it was in use.
+        free(file->data);
+        file->data = NULL;
+        file->state = prefetchFreed;
+    }
+    SDL_UnlockMutex(pf->lock);
+}
+
+void prefetch_destroy(Prefetcher *pf) {
+    if (pf->reader) {
+        SDL_LockMutex(pf->lock);
+        pf->stop = 1;
+        SDL_CondBroadcast(pf->changed);
+        SDL_UnlockMutex(pf->lock);
+        SDL_WaitThread(pf->reader, NULL);
+    }
+    for (int i = 0; i < pf->file_count; i++) free(pf->files[i].data);
+    free(pf->files);
+    free(pf->slots);
+    if (pf->changed) SDL_DestroyCond(pf->changed);
+    if (pf->lock) SDL_DestroyMutex(pf->lock);
+    memset(pf, 0, sizeof(*pf));
+}
+
+double prefetch_throughput(Prefetcher *pf) {
+    SDL_LockMutex(pf->lock);
+    double seconds = (double)pf->read_ticks / (double)SDL_GetPerformanceFrequency();
+    double mb = (double)pf->bytes_read / (1024.0 * 1024.0);
+    SDL_UnlockMutex(pf->lock);
+    return seconds > 0.0 ? mb / seconds : 0.0;
+}
+
+const char *prefetch_order_name(PrefetchOrder order) {
+    switch (order) {
+        case prefetchOrderExtent: return "physical extent";
+        case prefetchOrderInode: return "inode";
+        default: return "config";
+    }
+}
+
+#endif // PREFETCH_UTIL_H
@@ -0,0 +1,272 @@
+// pwg_util.h
+// PWG raster (PWG 5102.4) writer, streaming pages to a printer as they finish.
+//
+// A PWG raster stream is the "RaS2" sync word followed by each page: a
+// 1796-byte big-endian header (resolution, size in points and pixels, color
+// space) and the page's lines compressed. A line starts with how many times
+// it repeats (less one), then PackBits-style runs of whole pixels: a count
+// byte of 0-127 is one pixel repeated 1-128 times, 129-255 is 257 minus that
+// many literal pixels. CUPS reads it as is (image/pwg-raster), so pages go to
+// a queue with no conversion step in between.
+//
+// Writes 24-bit sRGB from XRGB8888 pixels, or 1-bit black (black_1, 1 is
+// black) from rows packed 1-bit with 1 white, as halftone_util.h makes them;
+// those runs are of bytes rather than pixels. The destination is a file (a FIFO
+// works too), "fd:N" for a descriptor the caller already has open, or
+// "|command" to pipe into a command such as "lp -d queue". Each page is
+// flushed as soon as its last line is written. Every byte written is also
+// handed to the optional sink, like png_band_util.h.
+//
+// Usage:
+//   #include "pwg_util.h"
+//   PwgWriter pwg;
+//   pwg_open(&pwg, "|lp -d proofer", page_count);
+//   pwg_write_page(&pwg, pixels, pitch, width, height, 600, "na_letter_8.5x11in");
+//   pwg_close(&pwg);
+
+#ifndef PWG_UTIL_H
+#define PWG_UTIL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PWG_HEADER_SIZE 1796
+#define PWG_COLORSPACE_BLACK 3
+#define PWG_COLORSPACE_SRGB 19
+
+typedef struct PwgWriter {
+    FILE *f;
+    int piped;                    // Opened with popen
+    int total_pages;              // For the header, 0 if unknown
+    uint8_t *line;                // One compressed line
+    size_t line_cap;
+    uint64_t bytes;
+    int pages;
+    void (*sink)(void *ctx, const void *data, size_t size);
+    void *sink_ctx;
+} PwgWriter;
+
+// API: returns 0 on success; nonzero on failure.
+int pwg_open(PwgWriter *pwg, const char *destination, int total_pages);
+int pwg_write_page(PwgWriter *pwg, const void *pixels, int pitch, int width, int height, int dpi, const char *size_name);
+int pwg_write_bilevel(PwgWriter *pwg, const void *rows, int stride, int width, int height, int dpi, const char *size_name);
+// Writes a page already encoded, as seen by the sink.
+int pwg_write_raw(PwgWriter *pwg, const void *data, size_t size);
+int pwg_close(PwgWriter *pwg);
+
+// ===== Implementation (header-only) =====
+
+static void _pwg_put32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24); p[1] = (uint8_t)(v >> 16); p[2] = (uint8_t)(v >> 8); p[3] = (uint8_t)v;
+}
+
+static int _pwg_fwrite(PwgWriter *pwg, const void *data, size_t size) {
+    if (fwrite(data, 1, size, pwg->f) != size) return 0;
+    if (pwg->sink) pwg->sink(pwg->sink_ctx, data, size);
+    pwg->bytes += size;
+    return 1;
+}
+
+int pwg_open(PwgWriter *pwg, const char *destination, int total_pages) {
+    memset(pwg, 0, sizeof(*pwg));
+    pwg->total_pages = total_pages;
+    if (destination[0] == '|') {
+#if defined(_WIN32)
+        pwg->f = _popen(destination + 1, "wb");
+#else
+        pwg->f = popen(destination + 1, "w");
+#endif
+        pwg->piped = 1;
+    }
+    else if (strncmp(destination, "fd:", 3) == 0) {
+        char *end;
+        long fd = strtol(destination + 3, &end, 10);
+        if (*end != '\0' || fd < 0) return 1;
+#if defined(_WIN32)
+        pwg->f = _fdopen((int)fd, "wb");
+#else
+        pwg->f = fdopen((int)fd, "wb");
+#endif
+    }
+    else {
+        pwg->f = fopen(destination, "wb");
+    }
+    if (!pwg->f) return 2;
+    // Only the sync word; the sink sees pages, which can be written again.
+    if (fwrite("RaS2", 1, 4, pwg->f) != 4) return 3;
+    pwg->bytes = 4;
+    return 0;
+}
+
+static int _pwg_same_pixel(const uint32_t *a, const uint32_t *b) {
+    return ((*a ^ *b) & 0xFFFFFF) == 0;
+}
+
+static uint8_t *_pwg_put_pixel(uint8_t *out, const uint32_t *p) {
+    out[0] = (uint8_t)(*p >> 16);
+    out[1] = (uint8_t)(*p >> 8);
+    out[2] = (uint8_t)*p;
+    return out + 3;
+}
+
+// One line, starting with its repeat count. Returns the compressed size.
+static size_t _pwg_pack_line(uint8_t *out, const uint32_t *row, int width, int repeat) {
+    uint8_t *start = out;
+    *out++ = (uint8_t)(repeat - 1);
+    int x = 0;
+    while (x < width) {
+        int run = 1;
+        while (x + run < width && run < 128 && _pwg_same_pixel(&row[x + run], &row[x])) run++;
+        if (run > 1) {
+            *out++ = (uint8_t)(run - 1);
+            out = _pwg_put_pixel(out, &row[x]);
+            x += run;
+            continue;
+        }
+        // Literals up to the next pair of equal pixels.
+        int count = 1;
+        while (x + count < width && count < 128 &&
+            !(x + count + 1 < width && _pwg_same_pixel(&row[x + count], &row[x + count + 1]))) count++;
+        *out++ = count == 1 ? 0 : (uint8_t)(257 - count);
+        for (int i = 0; i < count; i++) out = _pwg_put_pixel(out, &row[x + i]);
+        x += count;
+    }
+    return (size_t)(out - start);
+}
+
+// The same for a line of bytes, inverted.
+static size_t _pwg_pack_inverted(uint8_t *out, const uint8_t *row, int size, int repeat) {
+    uint8_t *start = out;
+    *out++ = (uint8_t)(repeat - 1);
+    int x = 0;
+    while (x < size) {
+        int run = 1;
+        while (x + run < size && run < 128 && row[x + run] == row[x]) run++;
+        if (run > 1) {
+            *out++ = (uint8_t)(run - 1);
+            *out++ = (uint8_t)~row[x];
+            x += run;
+            continue;
+        }
+        int count = 1;
+        while (x + count < size && count < 128 && !(x + count + 1 < size && row[x + count] == row[x + count + 1])) count++;
+        *out++ = count == 1 ? 0 : (uint8_t)(257 - count);
+        for (int i = 0; i < count; i++) *out++ = (uint8_t)~row[x + i];
+        x += count;
+    }
+    return (size_t)(out - start);
+}
+
+static void _pwg_header(const PwgWriter *pwg, uint8_t *h, int width, int height, int dpi, const char *size_name) {
+    memset(h, 0, PWG_HEADER_SIZE);
+    strcpy((char *)h, "PwgRaster");                  // MediaClass
+    _pwg_put32(h + 276, (uint32_t)dpi);               // HWResolution
+    _pwg_put32(h + 280, (uint32_t)dpi);
+    _pwg_put32(h + 340, 1);                           // NumCopies
+    _pwg_put32(h + 352, (uint32_t)((width * 72 + dpi / 2) / dpi));    // PageSize, points
+    _pwg_put32(h + 356, (uint32_t)((height * 72 + dpi / 2) / dpi));
+    _pwg_put32(h + 372, (uint32_t)width);
+    _pwg_put32(h + 376, (uint32_t)height);
+    _pwg_put32(h + 384, 8);                           // BitsPerColor
+    _pwg_put32(h + 388, 24);                          // BitsPerPixel
+    _pwg_put32(h + 392, (uint32_t)width * 3);         // BytesPerLine
+    _pwg_put32(h + 400, PWG_COLORSPACE_SRGB);
+    _pwg_put32(h + 420, 3);                           // NumColors
+    _pwg_put32(h + 452, (uint32_t)pwg->total_pages);  // TotalPageCount
+    _pwg_put32(h + 456, 1);                           // CrossFeedTransform
+    _pwg_put32(h + 460, 1);                           // FeedTransform
+    _pwg_put32(h + 472, (uint32_t)width);             // ImageBoxRight
+    _pwg_put32(h + 476, (uint32_t)height);            // ImageBoxBottom
+    _pwg_put32(h + 480, 0xFFFFFF);                    // AlternatePrimary
+    if (size_name) strncpy((char *)h + 1732, size_name, 63);   // PageSizeName
+}
+
+// Worst case: every unit literal, a count byte per 128 of them.
+static int _pwg_reserve_line(PwgWriter *pwg, int units, int unit_size) {
+    size_t need = 1 + (size_t)units * unit_size + (size_t)(units + 127) / 128;
+    if (need > pwg->line_cap) {
+        uint8_t *bigger = (uint8_t *)realloc(pwg->line, need);
+        if (!bigger) return 0;
+        pwg->line = bigger;
+        pwg->line_cap = need;
+    }
+    return 1;
+}
+
+int pwg_write_page(PwgWriter *pwg, const void *pixels, int pitch, int width, int height, int dpi, const char *size_name) {
+    if (width <= 0 || height <= 0 || dpi <= 0) return 1;
+    if (!_pwg_reserve_line(pwg, width, 3)) return 2;
+
+    uint8_t header[PWG_HEADER_SIZE];
+    _pwg_header(pwg, header, width, height, dpi, size_name);
+    if (!_pwg_fwrite(pwg, header, sizeof(header))) return 3;
+
+    const uint8_t *base = (const uint8_t *)pixels;
+    size_t row_bytes = (size_t)width * 4;
+    int y = 0;
+    while (y < height) {
+        const uint8_t *row = base + (size_t)y * pitch;
+        int repeat = 1;
+        while (y + repeat < height && repeat < 256 && memcmp(base + (size_t)(y + repeat) * pitch, row, row_bytes) == 0) repeat++;
+        size_t size = _pwg_pack_line(pwg->line, (const uint32_t *)row, width, repeat);
+        if (!_pwg_fwrite(pwg, pwg->line, size)) return 3;
+        y += repeat;
+    }
+    if (fflush(pwg->f) != 0) return 4;
+    pwg->pages++;
+    return 0;
+}
+
+int pwg_write_bilevel(PwgWriter *pwg, const void *rows, int stride, int width, int height, int dpi, const char *size_name) {
+    int size = (width + 7) / 8;
+    if (width <= 0 || height <= 0 || dpi <= 0 || stride < size) return 1;
+    if (!_pwg_reserve_line(pwg, size, 1)) return 2;
+
+    uint8_t header[PWG_HEADER_SIZE];
+    _pwg_header(pwg, header, width, height, dpi, size_name);
+    _pwg_put32(header + 384, 1);                      // BitsPerColor
+    _pwg_put32(header + 388, 1);                      // BitsPerPixel
+    _pwg_put32(header + 392, (uint32_t)size);         // BytesPerLine
+    _pwg_put32(header + 400, PWG_COLORSPACE_BLACK);
+    _pwg_put32(header + 420, 1);                      // NumColors
+    _pwg_put32(header + 480, 0);                      // AlternatePrimary
+    if (!_pwg_fwrite(pwg, header, sizeof(header))) return 3;
+
+    const uint8_t *base = (const uint8_t *)rows;
+    int y = 0;
+    while (y < height) {
+        const uint8_t *row = base + (size_t)y * stride;
+        int repeat = 1;
+        while (y + repeat < height && repeat < 256 && memcmp(base + (size_t)(y + repeat) * stride, row, (size_t)size) == 0) repeat++;
+        size_t packed = _pwg_pack_inverted(pwg->line, row, size, repeat);
+        if (!_pwg_fwrite(pwg, pwg->line, packed)) return 3;
+        y += repeat;
+    }
+    if (fflush(pwg->f) != 0) return 4;
+    pwg->pages++;
+    return 0;
+}
+
+int pwg_write_raw(PwgWriter *pwg, const void *data, size_t size) {
+    if (!_pwg_fwrite(pwg, data, size) || fflush(pwg->f) != 0) return 1;
+    pwg->pages++;
+    return 0;
+}
+
+int pwg_close(PwgWriter *pwg) {
+    int result = 0;
+    if (pwg->f) {
+#if defined(_WIN32)
+        result = pwg->piped ? _pclose(pwg->f) : fclose(pwg->f);
+#else
+        result = pwg->piped ? pclose(pwg->f) : fclose(pwg->f);
+#endif
+    }
+    free(pwg->line);
+    memset(pwg, 0, sizeof(*pwg));
+    return result != 0;
+}
+
+#endif // PWG_UTIL_H
@@ -0,0 +1,691 @@
+// scaled_cache_util.h
+// On-disk cache of card layers already decoded and scaled for the page, so a
+// later run at the same PPI skips decoding the source PNG and resampling it.
+//
+// An entry is stored either raw (ARGB8888 pixels as they are in memory) or
+// compressed with a QOI-style codec: lossless, a single pass, no entropy
+// coding, and several times faster to decode than PNG at roughly half the
+// raw size for card art. Which one is written is decided per entry from
+// what the run has measured so far:
+//
+//   raw costs        size / bandwidth
+//   compressed costs ratio * size / bandwidth + size / decode_rate
+//
+// so raw wins on storage faster than (1 - ratio) * decode_rate and the
+// compressed form wins on slower disks and network volumes. Only reads and
+// writes that reach the storage are timed, since the page cache answers at
+// memory speed whatever the disk: the first loads of entries older than the
+// run drop the file's cached pages before reading it (posix_fadvise), and
+// until such a load has measured the read bandwidth, the first stores are
+// fsynced and their write bandwidth stands in for it. With neither measured
+// yet, entries are compressed. The first compressed entry is also decoded
+// once to time the codec. Where posix_fadvise is missing (Windows, macOS)
+// loads aren't timed and the synced stores decide. A probe can still be
+// served from memory, e.g. by a controller's cache or an NFS server's, which
+// favours raw; the forced choices are there for that.
+//
+// Entries are named by a hash of the source path, its size and modification
+// time, the kind of entry and the dimensions scaled for; the full key is
+// checked on load. Besides layers scaled for a page, the cache keeps the mip
+// levels of a source (see mip_util.h) under their level number. An entry is
+// written to a temporary file and renamed into place, and one whose header
+// matches but whose pixels don't read back is deleted.
+//
+// Nothing is evicted while a run goes on. scaled_cache_prune deletes the
+// entries used least recently, by access or modification time, until the
+// directory is back under a size. Access times are only as fresh as the mount
+// keeps them (daily with relatime), which is enough to age out stale art.
+//
+// Usage:
+//   #include "scaled_cache_util.h"
+//   ScaledCache sc;
+//   scaled_cache_init(&sc, "cache", scaledCacheAuto);
+//   SDL_Surface *s = scaled_cache_load(&sc, path, w, h, ref_w, ref_h, &src_w, &src_h);
+//   if (!s) { ... decode and scale ...; scaled_cache_store(&sc, path, w, h, ref_w, ref_h, src_w, src_h, s); }
+//   scaled_cache_prune(&sc, max_bytes, &removed, &removed_bytes);
+//   scaled_cache_destroy(&sc);
+
+#ifndef SCALED_CACHE_UTIL_H
+#define SCALED_CACHE_UTIL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <SDL2/SDL.h>
+
+#if defined(_WIN32)
+#include <direct.h>
+#include <io.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifndef SCALED_CACHE_PATHLEN
+#define SCALED_CACHE_PATHLEN 256
+#endif
+
+// Bytes of loads and of synced stores timed to measure the storage.
+#ifndef SCALED_CACHE_PROBE_BYTES
+#define SCALED_CACHE_PROBE_BYTES (8u * 1024u * 1024u)
+#endif
+
+typedef enum ScaledCacheFormat {
+    scaledCacheAuto = 0,   // Only as a choice: decide from measurements
+    scaledCacheRaw = 1,
+    scaledCacheQOI = 2
+} ScaledCacheFormat;
+
+typedef enum ScaledCacheKind {
+    scaledCacheLayer = 0,   // Scaled for a page: w, h, ref_w, ref_h
+    scaledCacheLevel = 1    // A mip level of the source, by number
+} ScaledCacheKind;
+
+typedef struct ScaledCache {
+    char dir[SCALED_CACHE_PATHLEN];
+    ScaledCacheFormat choice;
+    SDL_mutex *lock;
+
+    time_t opened;                      // Entries older than this can be probed
+    uint64_t read_bytes, read_ns;       // Storage bandwidth, from loads that missed the page cache
+    uint64_t write_bytes, write_ns;     // The same from synced stores, until a load
+    uint64_t decoded_bytes, decode_ns;  // Pixel bytes out of the decoder
+    uint64_t qoi_in_bytes, qoi_out_bytes;   // Compression ratio, from stores
+
+    uint64_t hits, misses;
+    uint64_t raw_stored, qoi_stored;
+    uint64_t bytes_stored;
+} ScaledCache;
+
+// API: returns 0 on success; nonzero on failure.
+int scaled_cache_init(ScaledCache *sc, const char *dir, ScaledCacheFormat choice);
+void scaled_cache_destroy(ScaledCache *sc);
+// Returns a new ARGB8888 surface and sets the source size, or NULL on a miss.
+SDL_Surface *scaled_cache_load(ScaledCache *sc, const char *path, int w, int h, int ref_w, int ref_h, int *src_w, int *src_h);
+// Like scaled_cache_load, but only reads the header to learn the source size.
+int scaled_cache_peek(ScaledCache *sc, const char *path, int w, int h, int ref_w, int ref_h, int *src_w, int *src_h);
+int scaled_cache_store(ScaledCache *sc, const char *path, int w, int h, int ref_w, int ref_h, int src_w, int src_h, SDL_Surface *surface);
+// The same for mip level k of a source.
+SDL_Surface *scaled_cache_load_level(ScaledCache *sc, const char *path, int level, int *src_w, int *src_h);
+int scaled_cache_peek_level(ScaledCache *sc, const char *path, int level, int *src_w, int *src_h);
+int scaled_cache_store_level(ScaledCache *sc, const char *path, int level, int src_w, int src_h, SDL_Surface *surface);
+// Deletes the least recently used entries until the directory holds at most
+// max_bytes of them, and says how many went.
+int scaled_cache_prune(ScaledCache *sc, uint64_t max_bytes, int *removed, uint64_t *removed_bytes);
+// The format the next store would use.
+ScaledCacheFormat scaled_cache_format(ScaledCache *sc);
+const char *scaled_cache_format_name(ScaledCacheFormat format);
+// Measured rates in MB/s, 0 until measured.
+double scaled_cache_bandwidth(ScaledCache *sc);
+double scaled_cache_decode_rate(ScaledCache *sc);
+
+// QOI-style codec over ARGB8888 pixels. out must hold qoi_max_size(count).
+size_t qoi_max_size(size_t count);
+size_t qoi_encode(const uint32_t *pixels, size_t count, uint8_t *out);
+// Returns 0 on success, nonzero if data runs out or doesn't fill count pixels.
+int qoi_decode(const uint8_t *data, size_t size, uint32_t *pixels, size_t count);
+
+// ===== Implementation (header-only) =====
+
+#define _SC_MAGIC 0x32435153u   // "SQC2", bumped when scaling changes
+
+typedef struct _ScHeader {
+    uint32_t magic;
+    uint32_t format;
+    int32_t w, h, ref_w, ref_h;
+    int32_t src_w, src_h;
+    int32_t out_w, out_h;   // Size of the stored surface
+    uint32_t path_len;
+    uint32_t kind;
+    uint64_t src_size;
+    int64_t src_mtime;
+    uint64_t payload_size;
+} _ScHeader;
+
+#define _QOI_OP_INDEX 0x00
+#define _QOI_OP_DIFF  0x40
+#define _QOI_OP_LUMA  0x80
+#define _QOI_OP_RUN   0xc0
+#define _QOI_OP_RGB   0xfe
+#define _QOI_OP_RGBA  0xff
+#define _QOI_MASK     0xc0
+
+#define _QOI_A(p) ((p) >> 24)
+#define _QOI_R(p) (((p) >> 16) & 0xff)
+#define _QOI_G(p) (((p) >> 8) & 0xff)
+#define _QOI_B(p) ((p) & 0xff)
+#define _QOI_HASH(p) ((_QOI_R(p)*3 + _QOI_G(p)*5 + _QOI_B(p)*7 + _QOI_A(p)*11) % 64)
+
+size_t qoi_max_size(size_t count) {
+    return count * 5;
+}
+
+size_t qoi_encode(const uint32_t *pixels, size_t count, uint8_t *out) {
+    uint32_t index[64] = { 0 };
+    uint32_t prev = 0xff000000u;
+    size_t len = 0;
+    int run = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        uint32_t px = pixels[i];
+        if (px == prev) {
+            run++;
+            if (run == 62 || i + 1 == count) {
+                out[len++] = (uint8_t)(_QOI_OP_RUN | (run - 1));
+                run = 0;
+            }
+            continue;
+        }
+        if (run > 0) {
+            out[len++] = (uint8_t)(_QOI_OP_RUN | (run - 1));
+            run = 0;
+        }
+
+        int slot = _QOI_HASH(px);
+        if (index[slot] == px) {
+            out[len++] = (uint8_t)(_QOI_OP_INDEX | slot);
+        }
+        else {
+            index[slot] = px;
+            if (_QOI_A(px) == _QOI_A(prev)) {
+                int vr = (int)(signed char)(_QOI_R(px) - _QOI_R(prev));
+                int vg = (int)(signed char)(_QOI_G(px) - _QOI_G(prev));
+                int vb = (int)(signed char)(_QOI_B(px) - _QOI_B(prev));
+                int vg_r = vr - vg;
+                int vg_b = vb - vg;
+                if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+                    out[len++] = (uint8_t)(_QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2));
+                }
+                else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8) {
+                    out[len++] = (uint8_t)(_QOI_OP_LUMA | (vg + 32));
+                    out[len++] = (uint8_t)((vg_r + 8) << 4 | (vg_b + 8));
+                }
+                else {
+                    out[len++] = _QOI_OP_RGB;
+                    out[len++] = (uint8_t)_QOI_R(px);
+                    out[len++] = (uint8_t)_QOI_G(px);
+                    out[len++] = (uint8_t)_QOI_B(px);
+                }
+            }
+            else {
+                out[len++] = _QOI_OP_RGBA;
+                out[len++] = (uint8_t)_QOI_R(px);
+                out[len++] = (uint8_t)_QOI_G(px);
+                out[len++] = (uint8_t)_QOI_B(px);
+                out[len++] = (uint8_t)_QOI_A(px);
+            }
+        }
+        prev = px;
+    }
+    return len;
+}
+
+int qoi_decode(const uint8_t *data, size_t size, uint32_t *pixels, size_t count) {
+    uint32_t index[64] = { 0 };
+    uint32_t px = 0xff000000u;
+    size_t p = 0;
+    int run = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        if (run > 0) {
+            run--;
+            pixels[i] = px;
+            continue;
+        }
+        if (p >= size) return 1;
+
+        uint32_t b1 = data[p++];
+        if (b1 == _QOI_OP_RGB) {
+            if (p + 3 > size) return 1;
+            px = (px & 0xff000000u) | (uint32_t)data[p] << 16 | (uint32_t)data[p + 1] << 8 | data[p + 2];
+            p += 3;
+        }
+        else if (b1 == _QOI_OP_RGBA) {
+            if (p + 4 > size) return 1;
+            px = (uint32_t)data[p + 3] << 24 | (uint32_t)data[p] << 16 | (uint32_t)data[p + 1] << 8 | data[p + 2];
+            p += 4;
+        }
+        else if ((b1 & _QOI_MASK) == _QOI_OP_INDEX) {
+            px = index[b1];
+        }
+        else if ((b1 & _QOI_MASK) == _QOI_OP_DIFF) {
+            uint32_t r = (_QOI_R(px) + ((b1 >> 4) & 3) - 2) & 0xff;
+            uint32_t g = (_QOI_G(px) + ((b1 >> 2) & 3) - 2) & 0xff;
+            uint32_t b = (_QOI_B(px) + (b1 & 3) - 2) & 0xff;
+            px = (px & 0xff000000u) | r << 16 | g << 8 | b;
+        }
+        else if ((b1 & _QOI_MASK) == _QOI_OP_LUMA) {
+            if (p >= size) return 1;
+            uint32_t b2 = data[p++];
+            int vg = (int)(b1 & 0x3f) - 32;
+            uint32_t r = (uint32_t)((int)_QOI_R(px) + vg - 8 + (int)((b2 >> 4) & 0x0f)) & 0xff;
+            uint32_t g = (uint32_t)((int)_QOI_G(px) + vg) & 0xff;
+            uint32_t b = (uint32_t)((int)_QOI_B(px) + vg - 8 + (int)(b2 & 0x0f)) & 0xff;
+            px = (px & 0xff000000u) | r << 16 | g << 8 | b;
+        }
+        else {
+            run = (int)(b1 & 0x3f);
+        }
+        index[_QOI_HASH(px)] = px;
+        pixels[i] = px;
+    }
+    return 0;
+}
+
+// Wait for a file's writes to reach the storage.
+static int _sc_sync(FILE *f) {
+#if defined(_WIN32)
+    return _commit(_fileno(f));
+#else
+    return fsync(fileno(f));
+#endif
+}
+
+static uint64_t _sc_now_ns(void) {
+    return (uint64_t)((double)SDL_GetPerformanceCounter() * 1e9 / (double)SDL_GetPerformanceFrequency());
+}
+
+// Fill the key part of a header from the source file. Fails if it's gone.
+static int _sc_key(const char *path, ScaledCacheKind kind, int w, int h, int ref_w, int ref_h, _ScHeader *header) {
+    struct stat st;
+    if (stat(path, &st) != 0) return 1;
+    memset(header, 0, sizeof(*header));
+    header->magic = _SC_MAGIC;
+    header->kind = (uint32_t)kind;
+    header->w = w;
+    header->h = h;
+    header->ref_w = ref_w;
+    header->ref_h = ref_h;
+    header->path_len = (uint32_t)strlen(path);
+    header->src_size = (uint64_t)st.st_size;
+    header->src_mtime = (int64_t)st.st_mtime;
+    return 0;
+}
+
+static void _sc_entry_path(const ScaledCache *sc, const char *path, const _ScHeader *key, char *out, size_t n) {
+    // FNV-1a over the path and everything that makes the scaled result differ.
+    uint64_t hash = 1469598103934665603ull;
+    const unsigned char *parts[2] = { (const unsigned char *)path, (const unsigned char *)&key->w };
+    size_t lens[2] = { key->path_len, sizeof(int32_t) * 4 };
+    for (int i = 0; i < 2; i++) {
+        for (size_t j = 0; j < lens[i]; j++) {
+            hash ^= parts[i][j];
+            hash *= 1099511628211ull;
+        }
+    }
+    hash ^= key->kind;
+    hash *= 1099511628211ull;
+    hash ^= key->src_size * 31 + (uint64_t)key->src_mtime;
+    hash *= 1099511628211ull;
+    snprintf(out, n, "%s/%016llx.sqc", sc->dir, (unsigned long long)hash);
+}
+
+static int _sc_same_key(const _ScHeader *a, const _ScHeader *b) {
+    return a->magic == b->magic && a->kind == b->kind && a->w == b->w && a->h == b->h && a->ref_w == b->ref_w && a->ref_h == b->ref_h &&
+        a->path_len == b->path_len && a->src_size == b->src_size && a->src_mtime == b->src_mtime;
+}
+
+int scaled_cache_init(ScaledCache *sc, const char *dir, ScaledCacheFormat choice) {
+    memset(sc, 0, sizeof(*sc));
+    if (strlen(dir) >= SCALED_CACHE_PATHLEN - 32) return 1;
+    strncpy(sc->dir, dir, SCALED_CACHE_PATHLEN - 1);
+    sc->choice = choice;
+    sc->opened = time(NULL);
+
+#if defined(_WIN32)
+    if (mkdir(dir) != 0 && errno != EEXIST) return 2;
+#else
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) return 2;
+#endif
+    sc->lock = SDL_CreateMutex();
+    if (!sc->lock) return 3;
+    return 0;
+}
+
+void scaled_cache_destroy(ScaledCache *sc) {
+    if (sc->lock) SDL_DestroyMutex(sc->lock);
+    sc->lock = NULL;
+}
+
+ScaledCacheFormat scaled_cache_format(ScaledCache *sc) {
+    if (sc->choice != scaledCacheAuto) return sc->choice;
+
+    SDL_LockMutex(sc->lock);
+    double bandwidth = sc->read_ns ? (double)sc->read_bytes / (double)sc->read_ns :
+        sc->write_ns ? (double)sc->write_bytes / (double)sc->write_ns : 0.0;
+    double decode_rate = sc->decode_ns ? (double)sc->decoded_bytes / (double)sc->decode_ns : 0.0;
+    double ratio = sc->qoi_in_bytes ? (double)sc->qoi_out_bytes / (double)sc->qoi_in_bytes : 0.5;
+    SDL_UnlockMutex(sc->lock);
+
+    if (bandwidth <= 0.0 || decode_rate <= 0.0) return scaledCacheQOI;
+    return bandwidth > (1.0 - ratio) * decode_rate ? scaledCacheRaw : scaledCacheQOI;
+}
+
+static int _sc_peek(ScaledCache *sc, const char *path, ScaledCacheKind kind, int w, int h, int ref_w, int ref_h, int *src_w, int *src_h) {
+    _ScHeader key, header;
+    char entry_path[SCALED_CACHE_PATHLEN];
+    if (_sc_key(path, kind, w, h, ref_w, ref_h, &key) != 0) return 1;
+    _sc_entry_path(sc, path, &key, entry_path, sizeof(entry_path));
+
+    FILE *f = fopen(entry_path, "rb");
+    if (!f) return 2;
+    int ok = fread(&header, sizeof(header), 1, f) == 1 && _sc_same_key(&header, &key);
+    fclose(f);
+    if (!ok) return 3;
+    *src_w = header.src_w;
+    *src_h = header.src_h;
+    return 0;
+}
+
+static SDL_Surface *_sc_load(ScaledCache *sc, const char *path, ScaledCacheKind kind, int w, int h, int ref_w, int ref_h, int *src_w, int *src_h) {
+    _ScHeader key, header;
+    char entry_path[SCALED_CACHE_PATHLEN];
+    char stored_path[SCALED_CACHE_PATHLEN];
+    if (_sc_key(path, kind, w, h, ref_w, ref_h, &key) != 0) return NULL;
+    _sc_entry_path(sc, path, &key, entry_path, sizeof(entry_path));
+
+    FILE *f = fopen(entry_path, "rb");
+    SDL_Surface *surface = NULL;
+    uint8_t *payload = NULL;
+    int ok = 0, matched = 0, probe = 0;
+    if (!f) goto done;
+#if defined(POSIX_FADV_DONTNEED)
+    // An entry written by this run is still in the page cache, likely dirty,
+    // so only older ones are read from the storage to time it.
+    SDL_LockMutex(sc->lock);
+    probe = sc->read_bytes < SCALED_CACHE_PROBE_BYTES;
+    SDL_UnlockMutex(sc->lock);
+    struct stat st;
+    probe = probe && fstat(fileno(f), &st) == 0 && st.st_mtime < sc->opened &&
+        posix_fadvise(fileno(f), 0, 0, POSIX_FADV_DONTNEED) == 0;
+#endif
+    uint64_t start = _sc_now_ns();
+    if (fread(&header, sizeof(header), 1, f) != 1 || !_sc_same_key(&header, &key)) goto done;
+    matched = 1;
+    if (header.path_len >= sizeof(stored_path) || fread(stored_path, 1, header.path_len, f) != header.path_len) goto done;
+    if (memcmp(stored_path, path, header.path_len) != 0) {
+        matched = 0;   // Another path with the same hash, not a bad entry
+        goto done;
+    }
+
+    size_t count = (size_t)header.out_w * (size_t)header.out_h;
+    surface = SDL_CreateRGBSurfaceWithFormat(0, header.out_w, header.out_h, 32, SDL_PIXELFORMAT_ARGB8888);
+    if (!surface) goto done;
+
+    uint64_t decode_start = 0, end = 0;
+    if (header.format == scaledCacheRaw) {
+        // Straight into the surface, a row at a time in case of padding.
+        if (header.payload_size != count * 4) goto done;
+        for (int y = 0; y < header.out_h; y++) {
+            if (fread((uint8_t *)surface->pixels + (size_t)y * surface->pitch, 4, (size_t)header.out_w, f) != (size_t)header.out_w) goto done;
+        }
+        end = decode_start = _sc_now_ns();
+    }
+    else if (header.format == scaledCacheQOI && surface->pitch == header.out_w * 4) {
+        payload = (uint8_t *)malloc(header.payload_size ? header.payload_size : 1);
+        if (!payload || fread(payload, 1, header.payload_size, f) != header.payload_size) goto done;
+        decode_start = _sc_now_ns();
+        if (qoi_decode(payload, header.payload_size, (uint32_t *)surface->pixels, count) != 0) goto done;
+        end = _sc_now_ns();
+    }
+    else {
+        goto done;
+    }
+    ok = 1;
+
+    SDL_LockMutex(sc->lock);
+    if (probe) {
+        sc->read_bytes += sizeof(header) + header.path_len + header.payload_size;
+        sc->read_ns += decode_start - start;
+    }
+    if (header.format == scaledCacheQOI) {
+        sc->decoded_bytes += count * 4;
+        sc->decode_ns += end - decode_start;
+    }
+    sc->hits++;
+    SDL_UnlockMutex(sc->lock);
+
+    *src_w = header.src_w;
+    *src_h = header.src_h;
+
+done:
+    if (f) fclose(f);
+    free(payload);
+    if (!ok) {
+        if (surface) SDL_FreeSurface(surface);
+        surface = NULL;
+        // Truncated or corrupt: it would be hit again on every run.
+        if (matched) remove(entry_path);
+        SDL_LockMutex(sc->lock);
+        sc->misses++;
+        SDL_UnlockMutex(sc->lock);
+    }
+    return surface;
+}
+
+static int _sc_store(ScaledCache *sc, const char *path, ScaledCacheKind kind, int w, int h, int ref_w, int ref_h, int src_w, int src_h, SDL_Surface *surface) {
+    _ScHeader header;
+    char entry_path[SCALED_CACHE_PATHLEN];
+    char temp_path[SCALED_CACHE_PATHLEN + 24];
+    if (surface->format->format != SDL_PIXELFORMAT_ARGB8888 || surface->pitch != surface->w * 4) return 1;
+    if (_sc_key(path, kind, w, h, ref_w, ref_h, &header) != 0) return 2;
+    if (header.path_len >= SCALED_CACHE_PATHLEN) return 2;
+    _sc_entry_path(sc, path, &header, entry_path, sizeof(entry_path));
+
+    // Unique per thread so concurrent stores never share a file.
+    snprintf(temp_path, sizeof(temp_path), "%s.%lu.tmp", entry_path, (unsigned long)SDL_ThreadID());
+
+    size_t count = (size_t)surface->w * (size_t)surface->h;
+    ScaledCacheFormat format = scaled_cache_format(sc);
+    const uint8_t *payload = (const uint8_t *)surface->pixels;
+    uint8_t *encoded = NULL;
+    header.payload_size = count * 4;
+    if (format == scaledCacheQOI) {
+        encoded = (uint8_t *)malloc(qoi_max_size(count));
+        if (!encoded) return 3;
+        header.payload_size = qoi_encode((const uint32_t *)surface->pixels, count, encoded);
+        payload = encoded;
+    }
+
+    // Until a load times the codec, decode the first entry once to do so.
+    uint64_t decode_ns = 0;
+    if (format == scaledCacheQOI && sc->choice == scaledCacheAuto) {
+        SDL_LockMutex(sc->lock);
+        int timed = sc->decode_ns != 0;
+        SDL_UnlockMutex(sc->lock);
+        uint32_t *check = timed ? NULL : (uint32_t *)malloc(count * 4);
+        if (check) {
+            uint64_t decode_start = _sc_now_ns();
+            if (qoi_decode(encoded, header.payload_size, check, count) == 0) decode_ns = _sc_now_ns() - decode_start;
+            free(check);
+        }
+    }
+    header.format = (uint32_t)format;
+    header.out_w = surface->w;
+    header.out_h = surface->h;
+    header.src_w = src_w;
+    header.src_h = src_h;
+
+    // Until a load has timed the storage, the first stores are synced to
+    // time it instead; a buffered write only times a copy into memory.
+    int synced = 0;
+    if (sc->choice == scaledCacheAuto) {
+        SDL_LockMutex(sc->lock);
+        synced = sc->read_ns == 0 && sc->write_bytes < SCALED_CACHE_PROBE_BYTES;
+        SDL_UnlockMutex(sc->lock);
+    }
+    uint64_t write_start = _sc_now_ns();
+    FILE *f = fopen(temp_path, "wb");
+    int ok = f != NULL &&
+        fwrite(&header, sizeof(header), 1, f) == 1 &&
+        fwrite(path, 1, header.path_len, f) == header.path_len &&
+        fwrite(payload, 1, header.payload_size, f) == header.payload_size;
+    if (ok && synced) synced = fflush(f) == 0 && _sc_sync(f) == 0;
+    if (f && fclose(f) != 0) ok = 0;
+    uint64_t write_ns = _sc_now_ns() - write_start;
+    free(encoded);
+    if (ok) {
+#if defined(_WIN32)
+        remove(entry_path);   // rename() doesn't replace files there
+#endif
+        ok = rename(temp_path, entry_path) == 0;
+    }
+    if (!ok) {
+        remove(temp_path);
+        return 4;
+    }
+
+    SDL_LockMutex(sc->lock);
+    if (format == scaledCacheQOI) {
+        sc->qoi_in_bytes += count * 4;
+        sc->qoi_out_bytes += header.payload_size;
+        sc->qoi_stored++;
+    }
+    else {
+        sc->raw_stored++;
+    }
+    sc->bytes_stored += sizeof(header) + header.path_len + header.payload_size;
+    if (synced) {
+        sc->write_bytes += sizeof(header) + header.path_len + header.payload_size;
+        sc->write_ns += write_ns;
+    }
+    if (decode_ns && sc->decode_ns == 0) {
+        sc->decoded_bytes += count * 4;
+        sc->decode_ns += decode_ns;
+    }
+    SDL_UnlockMutex(sc->lock);
+    return 0;
+}
+
+int scaled_cache_peek(ScaledCache *sc, const char *path, int w, int h, int ref_w, int ref_h, int *src_w, int *src_h) {
+    return _sc_peek(sc, path, scaledCacheLayer, w, h, ref_w, ref_h, src_w, src_h);
+}
+
+SDL_Surface *scaled_cache_load(ScaledCache *sc, const char *path, int w, int h, int ref_w, int ref_h, int *src_w, int *src_h) {
+    return _sc_load(sc, path, scaledCacheLayer, w, h, ref_w, ref_h, src_w, src_h);
+}
+
+int scaled_cache_store(ScaledCache *sc, const char *path, int w, int h, int ref_w, int ref_h, int src_w, int src_h, SDL_Surface *surface) {
+    return _sc_store(sc, path, scaledCacheLayer, w, h, ref_w, ref_h, src_w, src_h, surface);
+}
+
+int scaled_cache_peek_level(ScaledCache *sc, const char *path, int level, int *src_w, int *src_h) {
+    return _sc_peek(sc, path, scaledCacheLevel, level, 0, 0, 0, src_w, src_h);
+}
+
+SDL_Surface *scaled_cache_load_level(ScaledCache *sc, const char *path, int level, int *src_w, int *src_h) {
+    return _sc_load(sc, path, scaledCacheLevel, level, 0, 0, 0, src_w, src_h);
+}
+
+int scaled_cache_store_level(ScaledCache *sc, const char *path, int level, int src_w, int src_h, SDL_Surface *surface) {
+    return _sc_store(sc, path, scaledCacheLevel, level, 0, 0, 0, src_w, src_h, surface);
+}
+
+typedef struct _ScFile {
+    char name[32];
+    uint64_t size;
+    int64_t used;           // Later of access and modification time
+} _ScFile;
+
+static int _sc_compare_used(const void *a, const void *b) {
+    int64_t ua = ((const _ScFile *)a)->used, ub = ((const _ScFile *)b)->used;
+    return ua < ub ? -1 : ua > ub;
+}
+
+// Entries are "<16 hex digits>.sqc"; nothing else in the directory is ours.
+static int _sc_is_entry(const char *name) {
+    size_t len = strlen(name);
+    return len == 20 && strcmp(name + 16, ".sqc") == 0;
+}
+
+static int _sc_add_file(_ScFile **files, int *count, int *capacity, const char *name, uint64_t size, int64_t used) {
+    if (*count == *capacity) {
+        int bigger_capacity = *capacity ? *capacity * 2 : 256;
+        _ScFile *bigger = (_ScFile *)realloc(*files, sizeof(_ScFile) * (size_t)bigger_capacity);
+        if (!bigger) return 1;
+        *files = bigger;
+        *capacity = bigger_capacity;
+    }
+    _ScFile *file = &(*files)[(*count)++];
+    strncpy(file->name, name, sizeof(file->name) - 1);
+    file->name[sizeof(file->name) - 1] = '\0';
+    file->size = size;
+    file->used = used;
+    return 0;
+}
+
+int scaled_cache_prune(ScaledCache *sc, uint64_t max_bytes, int *removed, uint64_t *removed_bytes) {
+    _ScFile *files = NULL;
+    int count = 0, capacity = 0;
+    uint64_t total = 0;
+    char entry_path[SCALED_CACHE_PATHLEN + 32];
+    *removed = 0;
+    *removed_bytes = 0;
+
+#if defined(_WIN32)
+    struct _finddata_t found;
+    snprintf(entry_path, sizeof(entry_path), "%s/*.sqc", sc->dir);
+    intptr_t handle = _findfirst(entry_path, &found);
+    if (handle == -1) return errno == ENOENT ? 0 : 1;
+    do {
+        if (!_sc_is_entry(found.name)) continue;
+        int64_t used = found.time_access > found.time_write ? found.time_access : found.time_write;
+        if (_sc_add_file(&files, &count, &capacity, found.name, (uint64_t)found.size, used) != 0) break;
+        total += (uint64_t)found.size;
+    } while (_findnext(handle, &found) == 0);
+    _findclose(handle);
+#else
+    DIR *dir = opendir(sc->dir);
+    if (!dir) return 1;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        struct stat st;
+        if (!_sc_is_entry(ent->d_name)) continue;
+        snprintf(entry_path, sizeof(entry_path), "%s/%.31s", sc->dir, ent->d_name);
+        if (stat(entry_path, &st) != 0) continue;   // Pruned by another run
+        int64_t used = st.st_atime > st.st_mtime ? (int64_t)st.st_atime : (int64_t)st.st_mtime;
+        if (_sc_add_file(&files, &count, &capacity, ent->d_name, (uint64_t)st.st_size, used) != 0) break;
+        total += (uint64_t)st.st_size;
+    }
+    closedir(dir);
+#endif
+
+    if (total > max_bytes) {
+        qsort(files, (size_t)count, sizeof(_ScFile), _sc_compare_used);
+        for (int i = 0; i < count && total > max_bytes; i++) {
+            snprintf(entry_path, sizeof(entry_path), "%s/%s", sc->dir, files[i].name);
+            if (remove(entry_path) != 0) continue;
+            total -= files[i].size;
+            (*removed)++;
+            *removed_bytes += files[i].size;
+        }
+    }
+    free(files);
+    return 0;
+}
+
+const char *scaled_cache_format_name(ScaledCacheFormat format) {
+    static const char *names[] = { "auto", "raw", "qoi" };
+    return names[format];
+}
+
+double scaled_cache_bandwidth(ScaledCache *sc) {
+    SDL_LockMutex(sc->lock);
+    double rate = sc->read_ns ? (double)sc->read_bytes * 1e9 / (double)sc->read_ns / (1024.0 * 1024.0) : 0.0;
+    SDL_UnlockMutex(sc->lock);
+    return rate;
+}
+
+double scaled_cache_decode_rate(ScaledCache *sc) {
+    SDL_LockMutex(sc->lock);
+    double rate = sc->decode_ns ? (double)sc->decoded_bytes * 1e9 / (double)sc->decode_ns / (1024.0 * 1024.0) : 0.0;
+    SDL_UnlockMutex(sc->lock);
+    return rate;
+}
+
+#endif // SCALED_CACHE_UTIL_H
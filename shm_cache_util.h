@@ -0,0 +1,404 @@
+// shm_cache_util.h
+// Card layers decoded and scaled for the page, shared by every cardprint
+// process on the host through a memory-mapped file or a named shared memory
+// segment, so processes rendering from the same card library decode each
+// layer once between them.
+//
+// The mapping holds a header, a fixed open-addressing index and the pixels.
+// There are no locks. A process looking up a layer that isn't there claims a
+// free index slot by compare-and-swap of its pid into the slot's owner, then
+// writes the key and its hash and marks it filling, decodes, copies the pixels
+// in and marks it ready. Other processes asking for the same layer meanwhile
+// see it filling and wait. Every claim names a live process, so a slot whose
+// owner died is taken over: one left filling, one claimed but never
+// published, and one its owner failed to fill (so it is tried again once
+// that process is gone). Pixel space is handed out by an atomic bump
+// of the next free offset and never reused: when it runs out new layers are
+// simply not shared. Delete the file (or the segment) to start afresh.
+//
+// Layers come back as surfaces over the mapping, so processes share the
+// memory as well as the work. They must not be written to.
+//
+// Entries are keyed by the source path, size and modification time and the
+// dimensions scaled for, like scaled_cache_util.h.
+//
+// Usage:
+//   #include "shm_cache_util.h"
+//   ShmCache sc;
+//   shm_cache_open(&sc, "/dev/shm/cards", 1024u << 20);   // or "shm:cards"
+//   int slot;
+//   SDL_Surface *s = shm_cache_acquire(&sc, path, w, h, ref_w, ref_h, &src_w, &src_h, &slot);
+//   if (!s) {
+//       s = ...decode and scale...;
+//       if (slot >= 0 && !s) shm_cache_abandon(&sc, slot);   // others are waiting on it
+//       if (slot >= 0 && s) shared = shm_cache_fill(&sc, slot, src_w, src_h, s);
+//   }
+//   shm_cache_close(&sc);
+
+#ifndef SHM_CACHE_UTIL_H
+#define SHM_CACHE_UTIL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <SDL2/SDL.h>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#ifndef SHM_CACHE_PATHLEN
+#define SHM_CACHE_PATHLEN 256
+#endif
+
+#define SHM_CACHE_MIN_BYTES ((size_t)8 << 20)
+
+typedef struct ShmCache {
+    unsigned char *base;     // The mapping; NULL when closed
+    size_t size;
+    struct _ShmHeader *header;
+    struct _ShmEntry *slots;
+    int pid;
+
+    SDL_atomic_t hits;       // Found ready
+    SDL_atomic_t fills;      // Filled by this process
+    SDL_atomic_t waits;      // Found filling by another process
+    SDL_atomic_t takeovers;  // Filler died, filled here instead
+    SDL_atomic_t unshared;   // No room, or the filler gave up
+} ShmCache;
+
+// API: returns 0 on success; nonzero on failure.
+// name is a file path, or shm:NAME for a POSIX shared memory segment. size
+// only applies when the cache is created; an existing one keeps its size.
+int shm_cache_open(ShmCache *sc, const char *name, size_t size);
+void shm_cache_close(ShmCache *sc);
+// Returns a surface over the shared pixels and sets the source size, or NULL.
+// On NULL *fill_slot is the slot this process now has to fill, or -1 when the
+// layer won't be shared (no room, or the filler couldn't build it either).
+SDL_Surface *shm_cache_acquire(ShmCache *sc, const char *path, int w, int h, int ref_w, int ref_h,
+    int *src_w, int *src_h, int *fill_slot);
+// Copies an ARGB8888 layer into a claimed slot. Returns a surface over the
+// shared copy, or NULL if there's no room, which leaves the slot failed.
+SDL_Surface *shm_cache_fill(ShmCache *sc, int slot, int src_w, int src_h, SDL_Surface *surface);
+// Gives up a claimed slot; the waiting processes build the layer themselves.
+void shm_cache_abandon(ShmCache *sc, int slot);
+// Bytes of pixel space used and available, across all processes.
+void shm_cache_usage(const ShmCache *sc, uint64_t *used, uint64_t *capacity);
+
+// ===== Implementation (header-only) =====
+
+#define _SHM_MAGIC 0x43485343u   // "CSHC"
+#define _SHM_VERSION 2u
+#define _SHM_ALIGN 64
+
+enum { _shmEmpty = 0, _shmFilling = 1, _shmReady = 2, _shmFailed = 3 };
+enum { _shmInitNone = 0, _shmInitBusy = 1, _shmInitDone = 2 };
+
+typedef struct _ShmHeader {
+    uint32_t magic, version;
+    uint32_t init;           // _shmInit*, set by the process that created it
+    uint32_t slot_count;     // Power of two
+    uint64_t size;
+    uint64_t data_offset;
+    uint64_t next_free;      // Bumped atomically
+} _ShmHeader;
+
+typedef struct _ShmEntry {
+    uint64_t hash;           // 0 until the claimer publishes the key
+    uint32_t state;          // _shm*, published after the fields it covers
+    int32_t owner;           // Pid of the claimer, 0 while free; claimed by CAS
+    int32_t w, h, ref_w, ref_h;
+    int32_t src_w, src_h;
+    int32_t layer_w, layer_h;
+    uint64_t src_size;
+    int64_t src_mtime;
+    uint64_t offset;         // Of the pixels from the start of the mapping
+    char path[SHM_CACHE_PATHLEN];
+} _ShmEntry;
+
+#define _SHM_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define _SHM_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define _SHM_CAS(p, expected, desired) \
+    __atomic_compare_exchange_n((p), (expected), (desired), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+
+#if !defined(_WIN32)
+
+static int _shm_alive(int pid) {
+    return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+static int _shm_same_key(const _ShmEntry *e, const _ShmEntry *key) {
+    return e->w == key->w && e->h == key->h && e->ref_w == key->ref_w && e->ref_h == key->ref_h &&
+        e->src_size == key->src_size && e->src_mtime == key->src_mtime && strcmp(e->path, key->path) == 0;
+}
+
+static uint64_t _shm_hash(const _ShmEntry *key) {
+    uint64_t hash = 1469598103934665603ull;
+    for (const unsigned char *p = (const unsigned char *)key->path; *p; p++) {
+        hash ^= *p;
+        hash *= 1099511628211ull;
+    }
+    const int32_t dims[4] = { key->w, key->h, key->ref_w, key->ref_h };
+    const unsigned char *d = (const unsigned char *)dims;
+    for (size_t i = 0; i < sizeof(dims); i++) {
+        hash ^= d[i];
+        hash *= 1099511628211ull;
+    }
+    hash ^= key->src_size * 31 + (uint64_t)key->src_mtime;
+    hash *= 1099511628211ull;
+    return hash ? hash : 1;
+}
+
+static SDL_Surface *_shm_surface(ShmCache *sc, const _ShmEntry *e) {
+    return SDL_CreateRGBSurfaceWithFormatFrom(sc->base + e->offset, e->layer_w, e->layer_h, 32,
+        e->layer_w * 4, SDL_PIXELFORMAT_ARGB8888);
+}
+
+int shm_cache_open(ShmCache *sc, const char *name, size_t size) {
+    memset(sc, 0, sizeof(*sc));
+    sc->pid = (int)getpid();
+
+    int shared_memory = strncmp(name, "shm:", 4) == 0;
+    int fd;
+    if (shared_memory) {
+        char segment[SHM_CACHE_PATHLEN];
+        snprintf(segment, sizeof(segment), "/%s", name + 4);
+        fd = shm_open(segment, O_RDWR | O_CREAT, 0666);
+    }
+    else {
+        fd = open(name, O_RDWR | O_CREAT, 0666);
+    }
+    if (fd < 0) return 1;
+
+    // Whoever finds it empty sizes it. The size in the header is checked below.
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (st.st_size == 0 && ftruncate(fd, (off_t)SDL_max(size, SHM_CACHE_MIN_BYTES)) != 0) ||
+        fstat(fd, &st) != 0 || (size_t)st.st_size < SHM_CACHE_MIN_BYTES) {
+        close(fd);
+        return 2;
+    }
+    sc->size = (size_t)st.st_size;
+    void *base = mmap(NULL, sc->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return 3;
+    sc->base = (unsigned char *)base;
+    sc->header = (_ShmHeader *)base;
+
+    _ShmHeader *header = sc->header;
+    uint32_t expected = _shmInitNone;
+    if (_SHM_CAS(&header->init, &expected, (uint32_t)_shmInitBusy)) {
+        // About one index slot per 64 KB of pixels, the size of a small card.
+        uint32_t slots = 256;
+        while (slots < (1u << 20) && (uint64_t)slots * 65536 < sc->size) slots <<= 1;
+        header->magic = _SHM_MAGIC;
+        header->version = _SHM_VERSION;
+        header->slot_count = slots;
+        header->size = sc->size;
+        header->data_offset = (sizeof(_ShmHeader) + (uint64_t)slots * sizeof(_ShmEntry) + _SHM_ALIGN - 1) & ~(uint64_t)(_SHM_ALIGN - 1);
+        header->next_free = header->data_offset;
+        _SHM_STORE(&header->init, (uint32_t)_shmInitDone);
+    }
+    else {
+        // A creator that died halfway leaves it unusable; give up after a while.
+        for (int waited = 0; _SHM_LOAD(&header->init) != _shmInitDone && waited < 5000; waited++) SDL_Delay(1);
+    }
+
+    if (_SHM_LOAD(&header->init) != _shmInitDone || header->magic != _SHM_MAGIC || header->version != _SHM_VERSION || header->size > sc->size ||
+        header->data_offset >= header->size) {
+        shm_cache_close(sc);
+        return 4;
+    }
+    sc->slots = (_ShmEntry *)(sc->base + sizeof(_ShmHeader));
+    return 0;
+}
+
+void shm_cache_close(ShmCache *sc) {
+    if (sc->base) munmap(sc->base, sc->size);
+    sc->base = NULL;
+    sc->header = NULL;
+    sc->slots = NULL;
+}
+
+// Takes over a slot whose owner died, whatever state it was left in.
+static int _shm_take_over(ShmCache *sc, _ShmEntry *e) {
+    int32_t owner = _SHM_LOAD(&e->owner);
+    if (owner == sc->pid || owner == 0 || _shm_alive(owner)) return 0;
+    if (!_SHM_CAS(&e->owner, &owner, (int32_t)sc->pid)) return 0;
+    SDL_AtomicAdd(&sc->takeovers, 1);
+    return 1;
+}
+
+// Writes the key into a slot this process owns and publishes it as filling.
+static void _shm_publish(_ShmEntry *e, const _ShmEntry *key, uint64_t hash) {
+    memcpy(e->path, key->path, sizeof(key->path));
+    e->w = key->w;
+    e->h = key->h;
+    e->ref_w = key->ref_w;
+    e->ref_h = key->ref_h;
+    e->src_size = key->src_size;
+    e->src_mtime = key->src_mtime;
+    _SHM_STORE(&e->hash, hash);
+    _SHM_STORE(&e->state, (uint32_t)_shmFilling);
+}
+
+// Waits out another process filling the slot. Returns the state it settled
+// in, or _shmFilling when the filler died and this process took the slot.
+static uint32_t _shm_wait(ShmCache *sc, _ShmEntry *e) {
+    SDL_AtomicAdd(&sc->waits, 1);
+    for (int polls = 1;; polls++) {
+        uint32_t state = _SHM_LOAD(&e->state);
+        if (state != _shmFilling) return state;
+        SDL_Delay(1);
+        if (polls % 100 == 0 && _shm_take_over(sc, e)) return _shmFilling;
+    }
+}
+
+SDL_Surface *shm_cache_acquire(ShmCache *sc, const char *path, int w, int h, int ref_w, int ref_h,
+    int *src_w, int *src_h, int *fill_slot) {
+    *fill_slot = -1;
+    _ShmEntry key;
+    struct stat st;
+    if (strlen(path) >= SHM_CACHE_PATHLEN || stat(path, &st) != 0) return NULL;
+    memset(&key, 0, sizeof(key));
+    strcpy(key.path, path);
+    key.w = w;
+    key.h = h;
+    key.ref_w = ref_w;
+    key.ref_h = ref_h;
+    key.src_size = (uint64_t)st.st_size;
+    key.src_mtime = (int64_t)st.st_mtime;
+    uint64_t hash = _shm_hash(&key);
+
+    uint32_t mask = sc->header->slot_count - 1;
+    for (uint32_t probe = 0; probe <= mask; probe++) {
+        uint32_t index = (uint32_t)(hash + probe) & mask;
+        _ShmEntry *e = &sc->slots[index];
+
+        int32_t free_owner = 0;
+        if (_SHM_LOAD(&e->owner) == 0 && _SHM_CAS(&e->owner, &free_owner, (int32_t)sc->pid)) {
+            _shm_publish(e, &key, hash);
+            *fill_slot = (int)index;
+            return NULL;
+        }
+
+        // Claimed. The hash and then the key are readable once the state
+        // leaves empty; until then the claimer is writing them, or died
+        // doing so and the slot is taken over.
+        uint32_t state;
+        for (int polls = 1; (state = _SHM_LOAD(&e->state)) == _shmEmpty; polls++) {
+            uint64_t found = _SHM_LOAD(&e->hash);
+            if (found != 0 && found != hash) break;
+            if (polls % 100 == 0 && _shm_take_over(sc, e)) {
+                _shm_publish(e, &key, hash);
+                *fill_slot = (int)index;
+                return NULL;
+            }
+            SDL_Delay(1);
+        }
+        if (_SHM_LOAD(&e->hash) != hash || state == _shmEmpty || !_shm_same_key(e, &key)) continue;
+
+        if (state == _shmFilling) {
+            if (_SHM_LOAD(&e->owner) == sc->pid) return NULL;   // Another thread here; build it alongside
+            state = _shm_wait(sc, e);
+            if (state == _shmFilling) {
+                *fill_slot = (int)index;
+                return NULL;
+            }
+        }
+        // A failed slot is tried again once the process that failed it is
+        // gone, as the file or the room may have changed since.
+        if (state == _shmFailed && _shm_take_over(sc, e)) {
+            _SHM_STORE(&e->state, (uint32_t)_shmFilling);
+            *fill_slot = (int)index;
+            return NULL;
+        }
+        if (state != _shmReady) {
+            SDL_AtomicAdd(&sc->unshared, 1);
+            return NULL;
+        }
+
+        SDL_Surface *surface = _shm_surface(sc, e);
+        if (surface) {
+            *src_w = e->src_w;
+            *src_h = e->src_h;
+            SDL_AtomicAdd(&sc->hits, 1);
+        }
+        return surface;
+    }
+    SDL_AtomicAdd(&sc->unshared, 1);
+    return NULL;
+}
+
+SDL_Surface *shm_cache_fill(ShmCache *sc, int slot, int src_w, int src_h, SDL_Surface *surface) {
+    _ShmEntry *e = &sc->slots[slot];
+    uint64_t row = (uint64_t)surface->w * 4;
+    uint64_t bytes = (row * (uint64_t)surface->h + _SHM_ALIGN - 1) & ~(uint64_t)(_SHM_ALIGN - 1);
+    uint64_t offset = __atomic_fetch_add(&sc->header->next_free, bytes, __ATOMIC_RELAXED);
+    if (surface->format->format != SDL_PIXELFORMAT_ARGB8888 || offset + bytes > sc->header->size) {
+        SDL_AtomicAdd(&sc->unshared, 1);
+        _SHM_STORE(&e->state, (uint32_t)_shmFailed);
+        return NULL;
+    }
+
+    for (int y = 0; y < surface->h; y++) {
+        memcpy(sc->base + offset + (uint64_t)y * row, (const unsigned char *)surface->pixels + (size_t)y * surface->pitch, (size_t)row);
+    }
+    e->src_w = src_w;
+    e->src_h = src_h;
+    e->layer_w = surface->w;
+    e->layer_h = surface->h;
+    e->offset = offset;
+    _SHM_STORE(&e->state, (uint32_t)_shmReady);
+    SDL_AtomicAdd(&sc->fills, 1);
+    return _shm_surface(sc, e);
+}
+
+void shm_cache_abandon(ShmCache *sc, int slot) {
+    _SHM_STORE(&sc->slots[slot].state, (uint32_t)_shmFailed);
+}
+
+void shm_cache_usage(const ShmCache *sc, uint64_t *used, uint64_t *capacity) {
+    uint64_t next_free = _SHM_LOAD(&sc->header->next_free);
+    *capacity = sc->header->size - sc->header->data_offset;
+    *used = SDL_min(next_free, sc->header->size) - sc->header->data_offset;
+}
+
+#else
+
+int shm_cache_open(ShmCache *sc, const char *name, size_t size) {
+    (void)name; (void)size;
+    memset(sc, 0, sizeof(*sc));
+    return 1;
+}
+
+void shm_cache_close(ShmCache *sc) { (void)sc; }
+
+SDL_Surface *shm_cache_acquire(ShmCache *sc, const char *path, int w, int h, int ref_w, int ref_h,
+    int *src_w, int *src_h, int *fill_slot) {
+    (void)sc; (void)path; (void)w; (void)h; (void)ref_w; (void)ref_h; (void)src_w; (void)src_h;
+    *fill_slot = -1;
+    return NULL;
+}
+
+SDL_Surface *shm_cache_fill(ShmCache *sc, int slot, int src_w, int src_h, SDL_Surface *surface) {
+    (void)sc; (void)slot; (void)src_w; (void)src_h; (void)surface;
+    return NULL;
+}
+
+void shm_cache_abandon(ShmCache *sc, int slot) { (void)sc; (void)slot; }
+
+void shm_cache_usage(const ShmCache *sc, uint64_t *used, uint64_t *capacity) {
+    (void)sc;
+    *used = 0;
+    *capacity = 0;
+}
+
+#endif
+
+#endif // SHM_CACHE_UTIL_H
@@ -0,0 +1,123 @@
+#!/bin/sh
+# Soak test: streams many random jobs through each cardprint process under
+# --memory-check, and stops at the first run that fails or keeps growing.
+#
+# Usage: ./soak.sh [RUNS (default 10, 0 = until stopped)] [SEED] [FIRST (default 1)]
+#   CARDPRINT=path/to/cardprint  Binary to run (default build/cardprint)
+#   SOAK_CHECK_MB=N              --memory-check limit (default 16)
+#
+# A run is one process printing a gang of random orders back to back, so
+# memory is sampled after every page across all of them and growth from one
+# order to the next shows up. Orders mix plain cards from playingcards/ with
+# layered cards, missing files and a truncated PNG. Each run also picks a paper
+# size, a PPI (300, 600 or 1200), the outputs and PNG encoder, and whether to
+# use checksums, halftoning, PWG raster, the disk cache and the shared cache;
+# both caches are kept from run to run. Runs are seeded from SEED and their
+# number, so FIRST repeats a failed run on its own (with empty caches).
+
+CARDPRINT=${CARDPRINT:-build/cardprint}
+CHECK_MB=${SOAK_CHECK_MB:-16}
+RUNS=${1:-10}
+SEED=${2:-$(date +%s)}
+FIRST=${3:-1}
+CARDS=$(cd "$(dirname "$0")" && pwd)/playingcards
+
+if [ ! -x "$CARDPRINT" ]; then
+    echo "No cardprint at $CARDPRINT; run make first or set CARDPRINT"
+    exit 1
+fi
+
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/cardprint-soak.XXXXXX") || exit 1
+head -c 4096 "$CARDS/King_of_hearts2.svg.png" > "$DIR/truncated.png"
+
+run=$FIRST
+while [ "$RUNS" -eq 0 ] || [ "$run" -lt $((FIRST + RUNS)) ]; do
+    # One awk per run writes the orders and prints the settings.
+    job=$(awk -v seed="$SEED" -v run="$run" -v cards="$CARDS" -v dir="$DIR" 'BEGIN {
+        srand(seed + run);
+        n = split("King_of_hearts2 Queen_of_hearts2 Jack_of_hearts2 10_of_hearts", names, " ");
+        ppis[1] = 300; ppis[2] = 600; ppis[3] = 1200;
+        ppi = ppis[1 + int(rand()*3)];
+        paper = rand() < 0.5 ? "US" : "A4";
+        corners = int(rand()*2);
+        # Fewer pages at higher PPI, where each one is much bigger. Orders
+        # are added while they fit even with the leftovers of each on a
+        # sheet of their own, so the gang never runs out of pages.
+        pages = ppi == 300 ? 30 + int(rand()*31) : ppi == 600 ? 10 + int(rand()*9) : 8 + int(rand()*3);
+
+        list = dir "/orders" run ".txt";
+        total = 0;
+        for (o = 0; ; o++) {
+            count = 1 + int(rand()*30);
+            sheets = int((count + 8)/9);
+            if (sheets > pages) break;
+            pages -= sheets;
+            total += count;
+            order = dir "/order" run "_" o ".txt";
+            print order > list;
+            print paper > order;
+            print ppi > order;
+            print "255 255 255 255" > order;
+            print "64 64 64 255" > order;
+            print corners > order;
+            for (i = 0; i < count; i++) {
+                r = rand();
+                card = cards "/" names[1 + int(rand()*n)] ".svg.png";
+                if (r < 0.05)
+                    print dir "/missing" int(rand()*4) ".png" > order;
+                else if (r < 0.08)
+                    print dir "/truncated.png" > order;
+                else if (r < 0.30)
+                    print card " | " cards "/" names[1 + int(rand()*n)] ".svg.png @ " int(rand()*300) "," int(rand()*500) > order;
+                else
+                    print card > order;
+            }
+            close(order);
+        }
+
+        outputs[1] = "png"; outputs[2] = "jpeg"; outputs[3] = "both"; outputs[4] = "none";
+        output = outputs[1 + int(rand()*4)];
+        encoder = rand() < 0.7 ? "bands" : "sdl";
+        options = "--output " output " --png-encoder " encoder;
+        pwg = output == "none" || rand() < 0.3;
+        if (pwg)
+            options = options " --pwg-raster " dir "/out/pages.pwg";
+        # Halftoning applies to PNGs from the bands encoder and PWG raster.
+        pngs = output == "png" || output == "both";
+        if (rand() < 0.2 && (pngs || pwg) && !(pngs && encoder == "sdl"))
+            options = options " --halftone 1" (rand() < 0.5 ? " --dither diffusion" : "");
+        if (rand() < 0.3)
+            options = options " --checksums" (rand() < 0.3 ? " --sha256" : "");
+        if (rand() < 0.5)
+            options = options " --disk-cache " dir "/disk";
+        if (rand() < 0.3)
+            options = options " --shared-cache " dir "/shared";
+        if (rand() < 0.3)
+            options = options " --cache-mb " (16 + int(rand()*128));
+        print list, ppi, paper, total, o, options;
+    }')
+    set -- $job
+    list=$1 ppi=$2 paper=$3
+    echo "Run $run (seed $SEED): $5 orders, $4 cards, $ppi PPI, $paper"
+    shift 5
+    echo "  $*"
+    mkdir -p "$DIR/out"
+    "$CARDPRINT" --gang "$list" "$DIR/out/page" "$ppi" "$paper" "$@" \
+        --memory-check "$CHECK_MB" > "$DIR/run$run.log" 2>&1
+    status=$?
+    grep "^Memory check" "$DIR/run$run.log"
+    if [ $status -ne 0 ]; then
+        if [ $status -eq 2 ]; then
+            echo "Memory kept growing in run $run; see $DIR/run$run.log"
+        else
+            echo "Run $run failed with status $status; see $DIR/run$run.log"
+        fi
+        echo "Repeat with: $0 1 $SEED $run"
+        exit 1
+    fi
+    rm -rf "$DIR/out" "$DIR/run$run.log" "$list" "$DIR/order${run}_"*.txt
+    run=$((run + 1))
+done
+
+rm -rf "$DIR"
+echo "Soak passed"
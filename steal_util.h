@@ -0,0 +1,204 @@
+// steal_util.h
+// Work-stealing pool of worker threads for tasks of very uneven cost.
+//
+// Each worker has its own queue. A batch of tasks is sorted by cost, largest
+// first, and dealt round-robin across the queues, so the expensive ones start
+// right away instead of landing at the end of one worker's share. A worker
+// runs its own queue front to back; once it's empty it steals the front task,
+// the largest left, from the queue with the most tasks. Batches are queued
+// behind earlier ones, so earlier batches still finish first.
+//
+// Usage:
+//   #include "steal_util.h"
+//   StealPool pool;
+//   steal_pool_init(&pool, 8);
+//   StealTask tasks[n] = { { run, arg, cost }, ... };
+//   int queued = steal_pool_submit(&pool, tasks, n);   // returns at once
+//   steal_pool_destroy(&pool);            // runs what's queued, then stops
+
+#ifndef STEAL_UTIL_H
+#define STEAL_UTIL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+
+#define STEAL_MAX_WORKERS 64
+
+// worker is the index of the thread running the task, for per-thread state.
+typedef void (*steal_task_fn)(void *arg, int worker);
+
+typedef struct StealTask {
+    steal_task_fn run;
+    void *arg;
+    uint64_t cost;      // Only compared; any unit
+} StealTask;
+
+typedef struct StealQueue {
+    SDL_mutex *lock;
+    StealTask *tasks;   // Ring buffer
+    int head, count, cap;
+} StealQueue;
+
+typedef struct StealWorker {
+    struct StealPool *pool;
+    int index;
+} StealWorker;
+
+typedef struct StealPool {
+    int worker_count;
+    StealWorker workers[STEAL_MAX_WORKERS];
+    StealQueue queues[STEAL_MAX_WORKERS];
+    SDL_Thread *threads[STEAL_MAX_WORKERS];
+    SDL_mutex *idle_lock;
+    SDL_cond *work;
+    SDL_atomic_t pending;    // Queued and not yet taken
+    SDL_atomic_t steals;
+    int next_queue;          // Where the next batch starts dealing
+    int stopping;
+} StealPool;
+
+// API: returns 0 on success; nonzero on failure.
+int steal_pool_init(StealPool *pool, int workers);
+// Sorts tasks in place and returns how many were queued: all of them, or
+// the first ones if a queue couldn't grow. Those run whatever happens.
+int steal_pool_submit(StealPool *pool, StealTask *tasks, int count);
+void steal_pool_destroy(StealPool *pool);
+
+// ===== Implementation (header-only) =====
+
+static int _sp_take(StealQueue *q, StealTask *task) {
+    int taken = 0;
+    SDL_LockMutex(q->lock);
+    if (q->count > 0) {
+        *task = q->tasks[q->head];
+        q->head = (q->head + 1) % q->cap;
+        q->count--;
+        taken = 1;
+    }
+    SDL_UnlockMutex(q->lock);
+    return taken;
+}
+
+static int _sp_push(StealQueue *q, const StealTask *task) {
+    SDL_LockMutex(q->lock);
+    if (q->count == q->cap) {
+        int cap = q->cap ? q->cap * 2 : 64;
+        StealTask *bigger = (StealTask *)malloc(sizeof(StealTask) * (size_t)cap);
+        if (!bigger) {
+            SDL_UnlockMutex(q->lock);
+            return 1;
+        }
+        for (int i = 0; i < q->count; i++) bigger[i] = q->tasks[(q->head + i) % q->cap];
+        free(q->tasks);
+        q->tasks = bigger;
+        q->head = 0;
+        q->cap = cap;
+    }
+    q->tasks[(q->head + q->count) % q->cap] = *task;
+    q->count++;
+    SDL_UnlockMutex(q->lock);
+    return 0;
+}
+
+static int _sp_steal(StealPool *pool, int self, StealTask *task) {
+    // Counts are read without the locks; a stale one only picks a worse victim.
+    int victim = -1, most = 0;
+    for (int i = 0; i < pool->worker_count; i++) {
+        if (i != self && pool->queues[i].count > most) {
+            most = pool->queues[i].count;
+            victim = i;
+        }
+    }
+    if (victim < 0 || !_sp_take(&pool->queues[victim], task)) return 0;
+    SDL_AtomicAdd(&pool->steals, 1);
+    return 1;
+}
+
+static int _sp_worker(void *data) {
+    StealWorker *worker = (StealWorker *)data;
+    StealPool *pool = worker->pool;
+    StealTask task;
+    for (;;) {
+        if (_sp_take(&pool->queues[worker->index], &task) || _sp_steal(pool, worker->index, &task)) {
+            SDL_AtomicAdd(&pool->pending, -1);
+            task.run(task.arg, worker->index);
+            continue;
+        }
+
+        SDL_LockMutex(pool->idle_lock);
+        while (SDL_AtomicGet(&pool->pending) == 0 && !pool->stopping) SDL_CondWait(pool->work, pool->idle_lock);
+        int done = pool->stopping && SDL_AtomicGet(&pool->pending) == 0;
+        SDL_UnlockMutex(pool->idle_lock);
+        if (done) return 0;
+    }
+}
+
+static int _sp_compare_cost(const void *a, const void *b) {
+    uint64_t ca = ((const StealTask *)a)->cost, cb = ((const StealTask *)b)->cost;
+    return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+int steal_pool_init(StealPool *pool, int workers) {
+    memset(pool, 0, sizeof(*pool));
+    pool->worker_count = SDL_max(1, SDL_min(workers, STEAL_MAX_WORKERS));
+    pool->idle_lock = SDL_CreateMutex();
+    pool->work = SDL_CreateCond();
+    if (!pool->idle_lock || !pool->work) {
+        steal_pool_destroy(pool);
+        return 1;
+    }
+    for (int i = 0; i < pool->worker_count; i++) {
+        pool->queues[i].lock = SDL_CreateMutex();
+        if (!pool->queues[i].lock) {
+            steal_pool_destroy(pool);
+            return 1;
+        }
+    }
+    for (int i = 0; i < pool->worker_count; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        pool->threads[i] = SDL_CreateThread(_sp_worker, "steal", &pool->workers[i]);
+        if (!pool->threads[i]) {
+            steal_pool_destroy(pool);
+            return 2;
+        }
+    }
+    return 0;
+}
+
+int steal_pool_submit(StealPool *pool, StealTask *tasks, int count) {
+    qsort(tasks, (size_t)count, sizeof(StealTask), _sp_compare_cost);
+    SDL_LockMutex(pool->idle_lock);
+    int queued = 0;
+    while (queued < count && _sp_push(&pool->queues[pool->next_queue], &tasks[queued]) == 0) {
+        SDL_AtomicAdd(&pool->pending, 1);
+        pool->next_queue = (pool->next_queue + 1) % pool->worker_count;
+        queued++;
+    }
+    SDL_CondBroadcast(pool->work);
+    SDL_UnlockMutex(pool->idle_lock);
+    return queued;
+}
+
+void steal_pool_destroy(StealPool *pool) {
+    if (pool->idle_lock) {
+        SDL_LockMutex(pool->idle_lock);
+        pool->stopping = 1;
+        if (pool->work) SDL_CondBroadcast(pool->work);
+        SDL_UnlockMutex(pool->idle_lock);
+    }
+    for (int i = 0; i < pool->worker_count; i++) {
+        if (pool->threads[i]) SDL_WaitThread(pool->threads[i], NULL);
+    }
+    for (int i = 0; i < pool->worker_count; i++) {
+        if (pool->queues[i].lock) SDL_DestroyMutex(pool->queues[i].lock);
+        free(pool->queues[i].tasks);
+    }
+    if (pool->work) SDL_DestroyCond(pool->work);
+    if (pool->idle_lock) SDL_DestroyMutex(pool->idle_lock);
+    memset(pool, 0, sizeof(*pool));
+}
+
+#endif // STEAL_UTIL_H
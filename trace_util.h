@@ -0,0 +1,53 @@
+// trace_util.h
+// Static tracepoints (USDT, SystemTap-style) for watching a live run with
+// bpftrace, perf or SystemTap without restarting it under a profiler.
+//
+// Built in with `make USDT=1`, which needs <sys/sdt.h> (systemtap-sdt-dev on
+// Debian/Ubuntu, systemtap-sdt-devel on Fedora). A probe is a single nop until
+// a tracer attaches. Without USDT=1 the macros compile to nothing.
+//
+// All probes are in the "cardprint" provider. Paths are char*, pages count
+// from 1 and results are 0 on success:
+//   card_load_start(path, page)         card_load_end(path, page, result)
+//   cache_hit(path, page)               cache_miss(path, page)
+//   page_compose_start(page)            page_compose_end(page, cards_placed)
+//   encode_start(path, page)            encode_end(path, page, result)
+//   dpi_update_start(path, page)        dpi_update_end(path, page, result)
+//
+// Example:
+//   bpftrace -e 'usdt:./build/cardprint:cardprint:card_load_end
+//                { printf("%s page %d -> %d\n", str(arg0), arg1, arg2); }' -p PID
+
+#ifndef TRACE_UTIL_H
+#define TRACE_UTIL_H
+
+#ifdef CFLAG_USDT
+#include <sys/sdt.h>
+
+#define TRACE_CARD_LOAD_START(path, page)         DTRACE_PROBE2(cardprint, card_load_start, path, page)
+#define TRACE_CARD_LOAD_END(path, page, result)   DTRACE_PROBE3(cardprint, card_load_end, path, page, result)
+#define TRACE_CACHE_HIT(path, page)               DTRACE_PROBE2(cardprint, cache_hit, path, page)
+#define TRACE_CACHE_MISS(path, page)              DTRACE_PROBE2(cardprint, cache_miss, path, page)
+#define TRACE_PAGE_COMPOSE_START(page)            DTRACE_PROBE1(cardprint, page_compose_start, page)
+#define TRACE_PAGE_COMPOSE_END(page, placed)      DTRACE_PROBE2(cardprint, page_compose_end, page, placed)
+#define TRACE_ENCODE_START(path, page)            DTRACE_PROBE2(cardprint, encode_start, path, page)
+#define TRACE_ENCODE_END(path, page, result)      DTRACE_PROBE3(cardprint, encode_end, path, page, result)
+#define TRACE_DPI_UPDATE_START(path, page)        DTRACE_PROBE2(cardprint, dpi_update_start, path, page)
+#define TRACE_DPI_UPDATE_END(path, page, result)  DTRACE_PROBE3(cardprint, dpi_update_end, path, page, result)
+
+#else
+
+#define TRACE_CARD_LOAD_START(path, page)         ((void)(path), (void)(page))
+#define TRACE_CARD_LOAD_END(path, page, result)   ((void)(path), (void)(page), (void)(result))
+#define TRACE_CACHE_HIT(path, page)               ((void)(path), (void)(page))
+#define TRACE_CACHE_MISS(path, page)              ((void)(path), (void)(page))
+#define TRACE_PAGE_COMPOSE_START(page)            ((void)(page))
+#define TRACE_PAGE_COMPOSE_END(page, placed)      ((void)(page), (void)(placed))
+#define TRACE_ENCODE_START(path, page)            ((void)(path), (void)(page))
+#define TRACE_ENCODE_END(path, page, result)      ((void)(path), (void)(page), (void)(result))
+#define TRACE_DPI_UPDATE_START(path, page)        ((void)(path), (void)(page))
+#define TRACE_DPI_UPDATE_END(path, page, result)  ((void)(path), (void)(page), (void)(result))
+
+#endif // CFLAG_USDT
+
+#endif // TRACE_UTIL_H
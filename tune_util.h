@@ -0,0 +1,177 @@
+// tune_util.h
+// Per-host tuning profiles and the calibration runs that produce them.
+//
+// A profile holds the settings that make a host render fastest: threads,
+// pages of card files read ahead, JPEG band height and the PNG deflate level
+// and strategy. It is a text file of "name value" lines, by default named
+// after the host in the home directory, so each machine sharing a home keeps
+// its own. Names a profile doesn't have keep the caller's defaults.
+//
+// A calibration run is the renderer itself started as a child process; the
+// last line it prints says how long it took, how much it wrote and its peak
+// resident memory, and tune_run reads that line back.
+//
+// Usage:
+//   #include "tune_util.h"
+//   char path[512];
+//   tune_default_path(path, sizeof(path), "cardprint");
+//   TuneProfile profile = { ...defaults... };
+//   tune_profile_load(&profile, path);
+//   TuneResult result;
+//   tune_run("./cardprint in.txt tune --threads 4", &result);
+//   tune_profile_save(&profile, path);
+
+#ifndef TUNE_UTIL_H
+#define TUNE_UTIL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+// What the renderer prints last, for a calibration run to be read back.
+#define TUNE_RESULT_PRINT "Rendered %d pages in %.3f s (%.2f pages/s), %llu bytes written, peak RSS %.0f MB\n"
+#define TUNE_RESULT_SCAN "Rendered %d pages in %lf s (%lf pages/s), %llu bytes written, peak RSS %lf MB"
+
+typedef struct TuneProfile {
+    int threads;
+    int prefetch_pages;
+    int jpeg_band_rows;       // MCU rows per JPEG band
+    int png_level;            // Deflate level, 0-9
+    int png_strategy;         // zlib strategy
+    double pages_per_s;       // Measured with these settings, 0 if unknown
+    double rss_mb;
+} TuneProfile;
+
+typedef struct TuneResult {
+    int pages;
+    double seconds;
+    double pages_per_s;
+    unsigned long long bytes;
+    double rss_mb;            // 0 where the child couldn't read it
+} TuneResult;
+
+// API: returns 0 on success; nonzero on failure.
+// "$HOME/.<app>-<hostname>.tune", or in the current directory without HOME.
+int tune_default_path(char *out, size_t n, const char *app);
+int tune_profile_load(TuneProfile *profile, const char *path);
+int tune_profile_save(const TuneProfile *profile, const char *path);
+// Appends arg to out, quoted for the shell.
+int tune_append_arg(char *out, size_t n, const char *arg);
+// Runs command, discarding its output but the result line.
+int tune_run(const char *command, TuneResult *result);
+
+// ===== Implementation (header-only) =====
+
+int tune_default_path(char *out, size_t n, const char *app) {
+    char host[256] = "host";
+#if defined(_WIN32)
+    DWORD size = sizeof(host);
+    if (!GetComputerNameA(host, &size)) strcpy(host, "host");
+    const char *home = getenv("USERPROFILE");
+#else
+    if (gethostname(host, sizeof(host) - 1) != 0) strcpy(host, "host");
+    host[sizeof(host) - 1] = '\0';
+    const char *home = getenv("HOME");
+#endif
+    // A domain or odd characters would make a strange file name.
+    for (char *c = host; *c; c++) {
+        if (*c == '.') { *c = '\0'; break; }
+        if (*c == '/' || *c == '\\' || *c == ':') *c = '_';
+    }
+    int written = home && *home
+        ? snprintf(out, n, "%s/.%s-%s.tune", home, app, host)
+        : snprintf(out, n, ".%s-%s.tune", app, host);
+    return written < 0 || (size_t)written >= n;
+}
+
+int tune_profile_load(TuneProfile *profile, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) return 1;
+    char line[256], name[64];
+    double value;
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#' || sscanf(line, "%63s %lf", name, &value) != 2) continue;
+        if (strcmp(name, "threads") == 0 && value >= 1) profile->threads = (int)value;
+        else if (strcmp(name, "prefetch_pages") == 0 && value >= 0) profile->prefetch_pages = (int)value;
+        else if (strcmp(name, "jpeg_band_rows") == 0 && value >= 1) profile->jpeg_band_rows = (int)value;
+        else if (strcmp(name, "png_level") == 0 && value >= 0 && value <= 9) profile->png_level = (int)value;
+        else if (strcmp(name, "png_strategy") == 0 && value >= 0) profile->png_strategy = (int)value;
+        else if (strcmp(name, "pages_per_s") == 0) profile->pages_per_s = value;
+        else if (strcmp(name, "rss_mb") == 0) profile->rss_mb = value;
+    }
+    fclose(f);
+    return 0;
+}
+
+int tune_profile_save(const TuneProfile *profile, const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) return 1;
+    fprintf(f, "# cardprint tuning profile, written by --autotune\n");
+    fprintf(f, "threads %d\n", profile->threads);
+    fprintf(f, "prefetch_pages %d\n", profile->prefetch_pages);
+    fprintf(f, "jpeg_band_rows %d\n", profile->jpeg_band_rows);
+    fprintf(f, "png_level %d\n", profile->png_level);
+    fprintf(f, "png_strategy %d\n", profile->png_strategy);
+    fprintf(f, "pages_per_s %.3f\n", profile->pages_per_s);
+    fprintf(f, "rss_mb %.0f\n", profile->rss_mb);
+    return fclose(f) != 0;
+}
+
+int tune_append_arg(char *out, size_t n, const char *arg) {
+    size_t len = strlen(out);
+#if defined(_WIN32)
+    // cmd.exe: double quotes, and no way to pass one inside.
+    if (strchr(arg, '"')) return 1;
+    int written = snprintf(out + len, n - len, "%s\"%s\"", len ? " " : "", arg);
+    return written < 0 || (size_t)written >= n - len;
+#else
+    // Single quotes, each ' inside written as '\''.
+    if (len + 3 >= n) return 1;
+    if (len) out[len++] = ' ';
+    out[len++] = '\'';
+    for (const char *c = arg; *c; c++) {
+        if (len + 5 >= n) return 1;
+        if (*c == '\'') {
+            memcpy(out + len, "'\\''", 4);
+            len += 4;
+        }
+        else out[len++] = *c;
+    }
+    out[len++] = '\'';
+    out[len] = '\0';
+    return 0;
+#endif
+}
+
+int tune_run(const char *command, TuneResult *result) {
+#if defined(_WIN32)
+    FILE *p = _popen(command, "r");
+#else
+    FILE *p = popen(command, "r");
+#endif
+    if (!p) return 1;
+    char line[1024];
+    int found = 0;
+    memset(result, 0, sizeof(*result));
+    while (fgets(line, sizeof(line), p)) {
+        TuneResult r;
+        if (sscanf(line, TUNE_RESULT_SCAN, &r.pages, &r.seconds, &r.pages_per_s, &r.bytes, &r.rss_mb) == 5) {
+            *result = r;
+            found = 1;
+        }
+    }
+#if defined(_WIN32)
+    int status = _pclose(p);
+#else
+    int status = pclose(p);
+#endif
+    if (status != 0) return 2;
+    return found ? 0 : 3;
+}
+
+#endif // TUNE_UTIL_H